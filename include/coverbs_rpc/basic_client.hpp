@@ -1,7 +1,13 @@
 #pragma once
 
 #include "coverbs_rpc/common.hpp"
+#include "coverbs_rpc/metrics.hpp"
+#include "coverbs_rpc/transport.hpp"
 
+#include <chrono>
+#include <concepts>
+#include <cppcoro/async_generator.hpp>
+#include <cppcoro/cancellation_token.hpp>
 #include <cppcoro/task.hpp>
 #include <memory>
 #include <rdmapp/qp.h>
@@ -9,14 +15,138 @@
 
 namespace coverbs_rpc {
 
+/**
+ * @brief A non-owning reference to a cppcoro scheduler, e.g. a static_thread_pool or an
+ * io_service, for calls to resume on instead of the thread that received their response.
+ *
+ * The scheduler must outlive every call that uses it.
+ */
+class resume_scheduler {
+public:
+  resume_scheduler() noexcept = default;
+
+  template <typename Scheduler>
+    requires(!std::same_as<Scheduler, resume_scheduler> && requires(Scheduler &s) {
+      s.schedule();
+    })
+  resume_scheduler(Scheduler &scheduler) noexcept
+      : scheduler_(&scheduler)
+      , schedule_([](void *s) -> cppcoro::task<void> {
+        co_await static_cast<Scheduler *>(s)->schedule();
+      }) {}
+
+  explicit operator bool() const noexcept { return scheduler_ != nullptr; }
+
+  // Completes on a thread of the scheduler.
+  auto schedule() const -> cppcoro::task<void> { return schedule_(scheduler_); }
+
+private:
+  void *scheduler_ = nullptr;
+  cppcoro::task<void> (*schedule_)(void *) = nullptr;
+};
+
+struct call_options {
+  // Zero falls back to RpcConfig::call_timeout.
+  std::chrono::nanoseconds timeout{0};
+  cppcoro::cancellation_token cancel_token{};
+  // Overrides the client's resume_on() for this call.
+  resume_scheduler resume_on{};
+  // Which slots the call may take, see RpcConfig::bulk_slots. typed_client sets it from
+  // handler_priority.
+  rpc_priority priority = rpc_priority::normal;
+};
+
+/**
+ * Calls that pass their deadline or get cancelled throw rpc_error. Their slot is reclaimed right
+ * away, and a late response is dropped because its req_id no longer matches the slot. They
+ * resume on their resume_on() scheduler, or in poll() with caller polling. Deadlines and
+ * RpcConfig::call_timeout only apply to call(), not to notify() or call_stream().
+ */
 class basic_client {
 public:
-  basic_client(std::shared_ptr<rdmapp::qp> qp, RpcConfig config = {});
+  // Unary calls are recorded into `metrics` if one is given.
+  basic_client(std::shared_ptr<transport> transport, RpcConfig config = {},
+               std::shared_ptr<rpc_metrics> metrics = nullptr);
+  basic_client(std::shared_ptr<rdmapp::qp> qp, RpcConfig config = {},
+               std::shared_ptr<rpc_metrics> metrics = nullptr);
   ~basic_client();
 
-  auto call(uint32_t fn_id, std::span<const std::byte> req_data, std::span<std::byte> resp_buffer)
+  auto call(uint32_t fn_id, std::span<const std::byte> req_data, std::span<std::byte> resp_buffer,
+            call_options opts = {}) -> cppcoro::task<std::size_t>;
+
+  /**
+   * @brief Call with a request made of several parts, e.g. a fixed header and a large value.
+   *
+   * The parts are gathered straight into the registered send slot, so callers do not have to
+   * assemble them into a contiguous buffer first. The parts must stay valid until the request
+   * has been sent.
+   */
+  auto call(uint32_t fn_id, std::span<const std::span<const std::byte>> req_parts,
+            std::span<std::byte> resp_buffer, call_options opts = {})
+      -> cppcoro::task<std::size_t>;
+
+  /**
+   * @brief Same, with parts that may lie in memory registered with the qp's device.
+   *
+   * Parts that carry the lkey of their memory region go out as SGEs of their own, so the NIC
+   * reads them where they are and only the header and the other parts are copied into the
+   * send slot. That needs an rdma transport whose qp takes an SGE per part, and a call without
+   * deadline or cancellation token, which only ends once the server has read the request.
+   * Otherwise every part is copied. The parts must stay untouched until the call returns.
+   */
+  auto call(uint32_t fn_id, std::span<const send_part> req_parts,
+            std::span<std::byte> resp_buffer, call_options opts = {})
       -> cppcoro::task<std::size_t>;
 
+  /**
+   * @brief Send a one-way request. Completes once the request is on the wire.
+   *
+   * No reply is sent back, so no response buffer is held and the slot is only used while the
+   * request is being sent. There is no deadline, it waits for a credit as long as it takes.
+   */
+  auto notify(uint32_t fn_id, std::span<const std::byte> req_data,
+              rpc_priority priority = rpc_priority::normal) -> cppcoro::task<void>;
+
+  /**
+   * @brief Call a stream handler and consume its chunks as they arrive.
+   *
+   * The request is sent when the first chunk is requested, so `req_data` must stay valid until
+   * then. Each yielded chunk is only valid until the generator is resumed. The server may run at
+   * most `RpcConfig::stream_window` chunks ahead of the consumer. There is no deadline. A
+   * consumer gives up on a stream by destroying the generator between chunks, which cancels it.
+   */
+  auto call_stream(uint32_t fn_id, std::span<const std::byte> req_data,
+                   rpc_priority priority = rpc_priority::normal)
+      -> cppcoro::async_generator<std::span<const std::byte>>;
+
+  /**
+   * @brief Resume calls and streams on `scheduler` rather than on the receive thread.
+   *
+   * Otherwise whatever follows `co_await call(...)` runs on the thread that received the
+   * response and holds up every other response of the connection until it suspends. Calls
+   * always resume on it, even when their response was in before they suspended; streams carry
+   * on where they are while chunks are buffered. Set it before making calls; an empty
+   * scheduler restores the default.
+   */
+  auto resume_on(resume_scheduler scheduler) noexcept -> void;
+
+  // Whether responses are handled by poll() callers, see RpcConfig::caller_polling.
+  auto caller_polling() const noexcept -> bool;
+
+  /**
+   * @brief Handle up to `max` responses that have arrived, on the calling thread.
+   *
+   * Only does anything with caller polling, where nothing else handles responses. Calls
+   * complete inside, whichever thread made them, so a thread waiting for its own call
+   * typically polls until it is done, e.g. with utils::poll_wait. Returns the number of
+   * messages handled.
+   */
+  auto poll(std::size_t max = 32) -> std::size_t;
+
+  // Roughly how many slots are taken by calls and streams in flight. Cheap enough to ask on
+  // every call, e.g. to pick the least busy of several clients.
+  auto inflight() const noexcept -> std::size_t;
+
 private:
   struct Impl;
   std::unique_ptr<Impl> impl_;
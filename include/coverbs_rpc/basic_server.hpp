@@ -1,39 +1,124 @@
 #pragma once
 
 #include "coverbs_rpc/common.hpp"
+#include "coverbs_rpc/detail/credit_gate.hpp"
+#include "coverbs_rpc/metrics.hpp"
 #include "coverbs_rpc/server_mux.hpp"
+#include "coverbs_rpc/transport.hpp"
+#include "coverbs_rpc/utils/codel.hpp"
 
+#include <atomic>
+#include <cppcoro/async_auto_reset_event.hpp>
 #include <cppcoro/static_thread_pool.hpp>
 #include <cppcoro/task.hpp>
 #include <cstdint>
 #include <memory>
-#include <rdmapp/mr.h>
+#include <mutex>
+#include <optional>
 #include <rdmapp/qp.h>
-#include <vector>
+#include <unordered_map>
+#include <span>
+#include <string_view>
 
 namespace coverbs_rpc {
 
 class basic_server {
 public:
+  // Requests are recorded into `metrics` if one is given, it can be shared between servers.
+  basic_server(std::shared_ptr<transport> transport, basic_mux const &mux, RpcConfig config = {},
+               std::uint32_t thread_count = 4, std::shared_ptr<rpc_metrics> metrics = nullptr);
   basic_server(std::shared_ptr<rdmapp::qp> qp, basic_mux const &mux, RpcConfig config = {},
-               std::uint32_t thread_count = 4);
+               std::uint32_t thread_count = 4, std::shared_ptr<rpc_metrics> metrics = nullptr);
 
   auto run() -> cppcoro::task<void>;
 
 private:
+  struct stream_state {
+    std::atomic<int64_t> credits{0};
+    std::atomic<bool> cancelled{false};
+    // Credits of control messages whose receives are posted again, handed back with the next
+    // chunk.
+    std::atomic<uint32_t> returned_credits{0};
+    cppcoro::async_auto_reset_event credit_event;
+  };
+
+  // What a worker still owes the client for the message it just handled. It is settled only
+  // once the message's receive is posted again, so that a credit never reaches the client
+  // ahead of the receive it stands for.
+  struct settlement {
+    enum class kind : uint8_t {
+      none,
+      // Send the `reply_len` bytes waiting in the worker's send buffer, adding the request's
+      // credit to those they carry.
+      reply,
+      // The credit of a one-way request, handed back with a later message.
+      credit,
+      // The credit of a control message for stream `req_id`, handed back with its chunks.
+      stream_credit,
+    };
+    kind what = kind::none;
+    std::size_t reply_len = 0;
+    uint64_t req_id = 0;
+  };
+
   auto server_worker(std::size_t idx) -> cppcoro::task<void>;
 
+  // Posts the receive at `recv_offset`, settles `owed` and returns the length of the next
+  // message.
+  auto recv_settled(std::size_t recv_offset, std::size_t send_offset, settlement owed)
+      -> cppcoro::task<std::size_t>;
+
+  auto settle(settlement owed, std::size_t send_offset) -> cppcoro::task<void>;
+
+  // Leaves the end marker in the send buffer for the worker to settle.
+  auto serve_stream(detail::RpcHeader header, std::span<std::byte> payload,
+                    std::size_t send_offset) -> cppcoro::task<settlement>;
+
+  // Whether to reject a request received at `recv_ns` rather than queue it for a pool thread.
+  auto overloaded(int64_t recv_ns) noexcept -> bool;
+
+  // Answers a shed request with kFlagOverloaded in place of a response.
+  auto reject(detail::RpcHeader const &header, std::size_t send_offset) -> settlement;
+
+  // Lets the stream send the chunks granted by a control message, or stops it.
+  auto grant_stream_credits(detail::RpcHeader const &header) -> void;
+
+  auto return_credits(std::size_t send_offset, uint32_t credits) -> cppcoro::task<void>;
+
+  // Completes every receive the closing client keeps posted.
+  auto answer_close(std::size_t send_offset) -> cppcoro::task<void>;
+
+  // Ends the connection once the client left or the transport failed: receives are failed so
+  // that every worker exits, and streams waiting for credits give up. run() then returns.
+  auto disconnect(std::string_view reason) noexcept -> void;
+
+  // Runs `dispatch` (returning the response length) and records it if metrics are on.
+  template <typename Dispatch>
+  auto dispatch_recorded(detail::RpcHeader const &header, int64_t recv_ns, int64_t start_ns,
+                         Dispatch &&dispatch) -> std::size_t;
+
   basic_mux const &mux_;
   RpcConfig const config_;
   std::size_t const send_buffer_size_;
   std::size_t const recv_buffer_size_;
-  std::shared_ptr<rdmapp::qp> qp_;
+  uint32_t const credit_batch_;
+  std::shared_ptr<transport> transport_;
+  std::shared_ptr<rpc_metrics> metrics_;
   cppcoro::static_thread_pool tp_;
+  // Set if RpcConfig::shed_target is.
+  std::optional<utils::codel> shedder_;
+  // Set if RpcConfig::bulk_concurrency is, holds one credit per bulk request it admits.
+  std::optional<detail::CreditGate> bulk_gate_;
+
+  std::span<std::byte> const recv_buffer_pool_;
+  std::span<std::byte> const send_buffer_pool_;
+
+  // Credits whose receives are posted again but that have not been handed back yet.
+  std::atomic<uint32_t> pending_credits_{0};
+  std::atomic<bool> disconnected_{false};
 
-  std::vector<std::byte> recv_buffer_pool_;
-  rdmapp::local_mr recv_mr_;
-  std::vector<std::byte> send_buffer_pool_;
-  rdmapp::local_mr send_mr_;
+  std::mutex streams_mutex_;
+  std::unordered_map<uint64_t, stream_state *> streams_;
 };
 
 } // namespace coverbs_rpc
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "coverbs_rpc/typed_client.hpp"
+
+#include <chrono>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/task.hpp>
+#include <memory>
+#include <string>
+
+namespace coverbs_rpc {
+
+class rdma_context;
+
+/**
+ * @brief typed_clients for many servers, connected on first use and shared.
+ *
+ * get() returns the client of an endpoint and connects one, without blocking, if there is
+ * none. Concurrent get()s of an endpoint share one connection attempt, and a failed attempt is
+ * forgotten so that the next get() tries again. Clients nobody has asked for within
+ * `idle_timeout` and nobody holds any more are closed in the background. Safe to use from
+ * several threads. Must outlive its pending get()s.
+ */
+class client_pool {
+public:
+  struct options {
+    std::chrono::nanoseconds idle_timeout = std::chrono::seconds(60);
+  };
+
+  client_pool(cppcoro::io_service &io_service, TypedRpcConfig config, options opts);
+  explicit client_pool(cppcoro::io_service &io_service, TypedRpcConfig config = {});
+
+  // Connects over RDMA through `context`, which must outlive the pool.
+  client_pool(rdma_context &context, TypedRpcConfig config, options opts);
+  explicit client_pool(rdma_context &context, TypedRpcConfig config = {});
+
+  ~client_pool();
+
+  auto get(std::string hostname, uint16_t port) -> cppcoro::task<std::shared_ptr<typed_client>>;
+
+  // Closes the idle clients now rather than on the next background pass. Returns how many.
+  auto reap_idle() -> std::size_t;
+
+  // Endpoints with a client or a connection attempt.
+  auto size() const -> std::size_t;
+
+private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+};
+
+} // namespace coverbs_rpc
@@ -1,32 +1,143 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <optional>
 #include <rdmapp/qp.h>
+#include <span>
+#include <stdexcept>
 
 namespace coverbs_rpc {
 
 struct ConnConfig {
   uint32_t cq_size = 256;
   rdmapp::qp_config qp_config = rdmapp::default_qp_config();
+  // Connector only: all qps share one send and one recv CQ, polled by one poller each, rather
+  // than getting a pair of their own. cq_size must then cover the work posted on all of them.
+  bool share_cqs = false;
+  // qps kept ready in INIT state by a background thread, so that connecting only has to move
+  // one to RTR and RTS. Zero creates every qp during its handshake. Pooled qps come with the
+  // CQs any other qp would get: a pair of their own, or the shared pair with share_cqs.
+  std::size_t qp_pool_size = 0;
 };
 
 struct RpcConfig {
   std::size_t max_inflight = 128;
   std::size_t max_req_payload = 256;
   std::size_t max_resp_payload = 4096;
+  // Number of chunks a server stream may send before the client grants more credits.
+  uint32_t stream_window = 8;
+  // Deadline applied to calls that do not set their own, zero means no deadline.
+  std::chrono::nanoseconds call_timeout{0};
+  // Client only: responses are handled by the threads that call basic_client::poll() rather
+  // than by the transport's receive thread. Only the shm transport supports it, with others
+  // the client throws std::invalid_argument.
+  bool caller_polling = false;
+  // Server only: load shedding, see utils::codel. Once requests have waited for a handler
+  // thread longer than `shed_target` for all of a `shed_interval`, new ones are rejected with
+  // rpc_status::overloaded as they arrive, until an interval shows the queue drained. Zero
+  // never sheds.
+  std::chrono::nanoseconds shed_target{0};
+  std::chrono::nanoseconds shed_interval = std::chrono::milliseconds(100);
+  // Client only: slots that calls to rpc_priority::bulk handlers may hold at once. The others
+  // are kept for normal calls, however many bulk calls are waiting. Zero does not limit them.
+  std::size_t bulk_slots = 0;
+  // Server only: bulk requests that may be waiting for or running on the thread pool at
+  // once, so that normal requests never queue behind more than that many of them. Zero does
+  // not limit them.
+  std::size_t bulk_concurrency = 0;
 
   auto to_conn_config() const noexcept -> ConnConfig {
     ConnConfig cfg;
     cfg.qp_config.max_send_wr = max_inflight + 64;
-    cfg.qp_config.max_recv_wr = max_inflight + 64;
+    // A header and a few registered parts of a gathered request, see send_part.
+    cfg.qp_config.max_send_sge = 4;
+    // Clients post twice max_inflight receives, see detail::client_receives().
+    cfg.qp_config.max_recv_wr = 2 * max_inflight + 64;
+    // Each CQ of a qp takes the completions of one queue, so it must hold all of them.
+    if (cfg.cq_size < 2 * max_inflight + 64) {
+      cfg.cq_size = static_cast<uint32_t>(2 * max_inflight + 64);
+    }
     return cfg;
   }
 };
 
+enum class transport_kind : uint8_t {
+  rdma,
+  // Shared-memory rings, for processes on the same host. Connection setup still goes through
+  // the TCP port, no RDMA device is opened.
+  shm,
+  // Plain TCP sockets, for hosts without RDMA.
+  tcp,
+};
+
 struct TypedRpcConfig : public RpcConfig {
   uint32_t device_nr = 0;
   uint32_t port_nr = 1;
+  transport_kind transport = transport_kind::rdma;
+  // Size of each direction's ring with transport_kind::shm, a power of two.
+  std::size_t shm_ring_bytes = 1 << 20;
+  // Server only, with transport_kind::rdma: see ConnConfig::qp_pool_size.
+  std::size_t qp_pool_size = 0;
+  // Client only: calls to bulk handlers get a connection of their own (with its own qp,
+  // slots and server receive buffers), so they never hold up normal calls on the wire.
+  bool bulk_connection = false;
+};
+
+enum class rpc_priority : uint8_t {
+  // Latency-critical calls, the default.
+  normal,
+  // Large or slow calls that may wait, e.g. exports. See RpcConfig::bulk_slots and
+  // bulk_concurrency.
+  bulk,
+};
+
+/**
+ * @brief The priority class of a handler, seen by both the server registering it and the
+ * clients calling it:
+ *
+ *   template <>
+ *   inline constexpr coverbs_rpc::rpc_priority coverbs_rpc::handler_priority<&export_table> =
+ *       coverbs_rpc::rpc_priority::bulk;
+ */
+template <auto Handler>
+inline constexpr rpc_priority handler_priority = rpc_priority::normal;
+
+enum class rpc_status : uint32_t {
+  ok = 0,
+  timeout = 1,
+  cancelled = 2,
+  // The server shed the call without running it, another replica may have room.
+  overloaded = 3,
+};
+
+auto inline to_string(rpc_status status) noexcept -> char const * {
+  switch (status) {
+    case rpc_status::ok:
+      return "ok";
+    case rpc_status::timeout:
+      return "deadline exceeded";
+    case rpc_status::cancelled:
+      return "cancelled";
+    case rpc_status::overloaded:
+      return "server overloaded";
+  }
+  return "unknown";
+}
+
+class rpc_error : public std::runtime_error {
+public:
+  explicit rpc_error(rpc_status status)
+      : std::runtime_error(to_string(status))
+      , status_(status) {}
+
+  auto status() const noexcept -> rpc_status { return status_; }
+
+private:
+  rpc_status status_;
 };
 
 namespace detail {
@@ -35,9 +146,78 @@ struct RpcHeader {
   uint64_t req_id;
   uint32_t payload_len;
   uint32_t fn_id;
+  uint32_t flags;
+  // Request: initial window of a stream (kFlagStream) or chunks granted to it (kFlagCredit).
+  // Response: connection credits handed back to the client.
+  uint32_t credits;
 };
 
 constexpr uintptr_t kWaiterEmpty = 0;
+// The call has been completed and its waiter must not suspend.
+constexpr uintptr_t kWaiterDone = 1;
+
+// Values of a client slot's expected req_id that no live request uses. Sequence numbers start
+// at 1, so every real req_id is at least 1 << 32.
+constexpr uint64_t kReqIdIdle = 0;
+constexpr uint64_t kReqIdDone = 1;
+constexpr uint64_t kReqIdTimedOut = 2;
+constexpr uint64_t kReqIdCancelled = 3;
+constexpr uint64_t kReqIdOverloaded = 4;
+
+// Request: open a server stream with `credits` initial chunk credits.
+// Response: one chunk of a server stream.
+constexpr uint32_t kFlagStream = 1u << 0;
+// Response: the last message of a server stream, carries no payload.
+constexpr uint32_t kFlagStreamEnd = 1u << 1;
+// Request: grant `credits` more chunks to the stream identified by `req_id`.
+constexpr uint32_t kFlagCredit = 1u << 2;
+// Request: with kFlagCredit, ask the server to stop the stream early.
+constexpr uint32_t kFlagCancel = 1u << 3;
+// Request: one-way call, the server sends no reply.
+constexpr uint32_t kFlagOneWay = 1u << 4;
+// Request: the client is going away. The server answers with one kFlagClose message per
+// receive the client keeps posted, so that all of them complete.
+// Response: stop receiving.
+constexpr uint32_t kFlagClose = 1u << 5;
+// Response: the server was overloaded and rejected the request unhandled, rpc_status::overloaded.
+constexpr uint32_t kFlagOverloaded = 1u << 6;
+
+// Exchanged as QP user data: how many receives the sender keeps posted for the connection, i.e.
+// how many messages the peer may have in flight towards it.
+struct CreditHello {
+  uint32_t magic;
+  uint32_t recv_credits;
+};
+
+constexpr uint32_t kCreditHelloMagic = 0x43524544; // "CRED"
+
+auto inline encode_credit_hello(uint32_t recv_credits) noexcept
+    -> std::array<std::byte, sizeof(CreditHello)> {
+  std::array<std::byte, sizeof(CreditHello)> buf;
+  CreditHello hello{.magic = kCreditHelloMagic, .recv_credits = recv_credits};
+  std::memcpy(buf.data(), &hello, sizeof(hello));
+  return buf;
+}
+
+auto inline parse_credit_hello(std::span<const std::byte> data) noexcept
+    -> std::optional<uint32_t> {
+  CreditHello hello;
+  if (data.size() < sizeof(hello)) {
+    return std::nullopt;
+  }
+  std::memcpy(&hello, data.data(), sizeof(hello));
+  if (hello.magic != kCreditHelloMagic) {
+    return std::nullopt;
+  }
+  return hello.recv_credits;
+}
+
+// Receives a client keeps posted, which is also what it announces in its hello. Every message
+// the server sends either hands back credits, of which the client holds at most max_inflight,
+// or is a stream chunk, which the client grants only for one of max_inflight more receives.
+auto inline client_receives(RpcConfig const &config) noexcept -> uint32_t {
+  return static_cast<uint32_t>(2 * config.max_inflight);
+}
 
 auto inline make_req_id(uint64_t seq, uint32_t slot_idx) noexcept -> uint64_t {
   return (seq << 32) | static_cast<uint64_t>(slot_idx);
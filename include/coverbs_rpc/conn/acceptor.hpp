@@ -1,18 +1,22 @@
 #pragma once
 
 #include "coverbs_rpc/common.hpp"
+#include "coverbs_rpc/conn/polled_cqs.hpp"
+#include "coverbs_rpc/conn/qp_pool.hpp"
 #include "coverbs_rpc/conn/transmission.hpp"
 
 #include <cppcoro/net/socket.hpp>
 #include <cppcoro/task.hpp>
 #include <cstdint>
-#include <list>
 #include <memory>
 #include <rdmapp/cq.h>
 #include <rdmapp/cq_poller.h>
 #include <rdmapp/device.h>
 #include <rdmapp/pd.h>
 #include <rdmapp/qp.h>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace cppcoro {
 class io_service;
@@ -32,26 +36,43 @@ struct qp_acceptor {
 
   auto accept() -> cppcoro::task<std::shared_ptr<qp_t>>;
 
+  // Accepts the TCP connection and returns the qp exchange over it, which does not have to
+  // finish before the next accept. Exchanges may run concurrently.
+  auto accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<qp_t>>>;
+
   auto accept_multiple(qp_handshake &handshake)
       -> cppcoro::task<std::vector<std::shared_ptr<qp_t>>>;
 
   auto close() noexcept -> void;
 
+  // User data sent to every connecting peer. The peer's own user data ends up in the accepted
+  // qp's user_data().
+  auto set_user_data(std::span<const std::byte> data) -> void;
+
   ~qp_acceptor() = default;
 
 private:
-  auto accept_qp(cppcoro::net::socket &socket, std::shared_ptr<rdmapp::cq> send_cq,
-                 std::shared_ptr<rdmapp::cq> recv_cq) -> cppcoro::task<std::shared_ptr<qp_t>>;
+  // Brings `local_qp`, in INIT state, up to RTS with the peer's qp.
+  auto accept_qp(cppcoro::net::socket &socket, std::shared_ptr<qp_t> local_qp)
+      -> cppcoro::task<std::shared_ptr<qp_t>>;
+
+  auto exchange_qp(cppcoro::net::socket socket) -> cppcoro::task<std::shared_ptr<qp_t>>;
 
   auto alloc_cq() -> std::shared_ptr<rdmapp::cq>;
 
+  // The send and recv CQ for a new qp, a pair of its own like every accepted qp.
+  auto cqs_for_qp() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>>;
+
   cppcoro::net::socket acceptor_socket_;
   std::shared_ptr<pd> pd_;
   std::shared_ptr<srq> srq_;
-  std::list<cq_poller_t> pollers_;
+  polled_cqs cqs_;
+  std::vector<std::byte> user_data_;
   uint16_t const port_;
   cppcoro::io_service &io_service_;
   ConnConfig const config_;
+  // Declared last: it creates CQs through cqs_for_qp() from its own thread.
+  std::unique_ptr<qp_pool> qp_pool_;
 };
 
 } // namespace coverbs_rpc
@@ -1,17 +1,20 @@
 #pragma once
 
 #include "coverbs_rpc/common.hpp"
+#include "coverbs_rpc/conn/polled_cqs.hpp"
+#include "coverbs_rpc/conn/qp_pool.hpp"
 #include "coverbs_rpc/conn/transmission.hpp"
 
 #include <cppcoro/net/socket.hpp>
 #include <cppcoro/task.hpp>
 #include <cstdint>
-#include <list>
 #include <memory>
+#include <mutex>
 #include <rdmapp/cq.h>
 #include <rdmapp/cq_poller.h>
 #include <rdmapp/pd.h>
 #include <rdmapp/qp.h>
+#include <utility>
 
 namespace cppcoro {
 class io_service;
@@ -31,20 +34,38 @@ struct qp_connector {
   auto connect(std::string_view hostname, uint16_t port, std::span<const std::byte> userdata = {})
       -> cppcoro::task<std::shared_ptr<qp_t>>;
 
+  // Same, with a qp configured by `qp_config` rather than the connector's config.
+  auto connect(std::string_view hostname, uint16_t port, std::span<const std::byte> userdata,
+               rdmapp::qp_config const &qp_config) -> cppcoro::task<std::shared_ptr<qp_t>>;
+
   auto connect(std::string_view hostname, uint16_t port, qp_handshake const &handshake)
       -> cppcoro::task<std::vector<std::shared_ptr<qp_t>>>;
 
 private:
-  auto from_socket(cppcoro::net::socket &socket, std::span<std::byte const> userdata)
-      -> cppcoro::task<std::shared_ptr<qp_t>>;
+  auto from_socket(cppcoro::net::socket &socket, std::span<std::byte const> userdata,
+                   rdmapp::qp_config const &qp_config) -> cppcoro::task<std::shared_ptr<qp_t>>;
 
   auto alloc_cq() noexcept -> std::shared_ptr<cq>;
 
+  // The send and recv CQ for a new qp.
+  auto cqs_for_qp() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>>;
+
+  // The send and recv CQ shared by all qps with share_cqs, created on first use.
+  auto shared_cqs() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>>;
+
+  // A qp in INIT state, from the pool if it has one.
+  auto make_qp(rdmapp::qp_config const &qp_config) -> std::shared_ptr<qp_t>;
+
   std::shared_ptr<pd> pd_;
   std::shared_ptr<srq> srq_;
-  std::list<cq_poller_t> pollers_;
+  std::mutex cq_mutex_;
+  polled_cqs cqs_;
+  std::shared_ptr<cq> shared_send_cq_;
+  std::shared_ptr<cq> shared_recv_cq_;
   cppcoro::io_service &io_service_;
   ConnConfig const config_;
+  // Declared last: it creates CQs through cqs_for_qp() from its own thread.
+  std::unique_ptr<qp_pool> qp_pool_;
 };
 
 } // namespace coverbs_rpc
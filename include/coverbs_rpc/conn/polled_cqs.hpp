@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <rdmapp/cq.h>
+#include <rdmapp/cq_poller.h>
+#include <rdmapp/device.h>
+#include <thread>
+
+namespace coverbs_rpc {
+
+/**
+ * @brief CQs together with the pollers that drive them.
+ *
+ * A CQ's poller is stopped as soon as nothing uses the CQ any more, so connection churn does
+ * not pile up poller threads and CQs. The last qp may go away on the poller's own thread, which
+ * cannot join itself, so a thread of polled_cqs stops the pollers instead.
+ */
+class polled_cqs {
+public:
+  polled_cqs();
+  ~polled_cqs();
+
+  polled_cqs(polled_cqs const &) = delete;
+  auto operator=(polled_cqs const &) -> polled_cqs & = delete;
+
+  // A new CQ and its poller. The poller stays until every copy of the returned pointer is gone.
+  auto alloc(std::shared_ptr<rdmapp::device> device, uint32_t cq_size)
+      -> std::shared_ptr<rdmapp::cq>;
+
+  // CQs whose pollers are still running, including unused ones not reclaimed yet.
+  auto size() const -> std::size_t;
+
+private:
+  struct entry {
+    explicit entry(std::shared_ptr<rdmapp::cq> cq)
+        : poller(std::move(cq)) {}
+
+    rdmapp::native_cq_poller poller;
+  };
+
+  // Outlives polled_cqs as long as some CQ is still in use.
+  struct state {
+    std::mutex mutex;
+    std::condition_variable_any unused_cv;
+    std::list<entry> entries;
+    // Entries whose CQ is no longer used, for the reclaimer to stop.
+    std::list<entry> unused;
+    bool closed = false;
+  };
+
+  auto reclaim(std::stop_token stop) -> void;
+
+  std::shared_ptr<state> state_;
+  std::jthread reclaimer_;
+};
+
+} // namespace coverbs_rpc
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <rdmapp/cq.h>
+#include <rdmapp/pd.h>
+#include <rdmapp/qp.h>
+#include <thread>
+#include <utility>
+
+namespace coverbs_rpc {
+
+/**
+ * @brief qps in INIT state with their CQs, created ahead of time by a background thread.
+ *
+ * Creating a qp takes several verbs calls that would otherwise sit on the connection
+ * handshake. take() hands out a pooled qp that only needs rtr() and rts(), and the thread
+ * replaces it. The thread makes qps of the qp_config last asked for, so when all connections are
+ * configured alike only the first one misses. qps of an earlier config stay until their room is
+ * needed for new ones.
+ */
+class qp_pool {
+public:
+  using qp_t = rdmapp::basic_qp;
+  // The two CQs for a new qp, in the order the qp constructor takes them. Pooled qps are meant
+  // to share them, rather than bring a pair of CQs and pollers each.
+  using cq_factory =
+      std::function<std::pair<std::shared_ptr<rdmapp::cq>, std::shared_ptr<rdmapp::cq>>()>;
+
+  qp_pool(std::shared_ptr<rdmapp::pd> pd, std::shared_ptr<rdmapp::srq> srq, cq_factory cqs,
+          rdmapp::qp_config const &config, std::size_t size);
+  ~qp_pool();
+
+  qp_pool(qp_pool const &) = delete;
+  auto operator=(qp_pool const &) -> qp_pool & = delete;
+
+  // A pooled qp configured like `config`, or nullptr if there is none ready.
+  auto take(rdmapp::qp_config const &config) -> std::shared_ptr<qp_t>;
+
+private:
+  struct pooled {
+    rdmapp::qp_config config;
+    std::shared_ptr<qp_t> qp;
+  };
+
+  auto run(std::stop_token stop) -> void;
+
+  // Pooled qps configured like config_, the ones the thread keeps up to size_.
+  auto ready() const -> std::size_t;
+
+  std::shared_ptr<rdmapp::pd> const pd_;
+  std::shared_ptr<rdmapp::srq> const srq_;
+  cq_factory const cqs_;
+  std::size_t const size_;
+
+  std::mutex mutex_;
+  std::condition_variable_any cv_;
+  rdmapp::qp_config config_;
+  std::deque<pooled> qps_;
+
+  // Declared last so it is stopped before the pooled qps go away.
+  std::jthread thread_;
+};
+
+} // namespace coverbs_rpc
@@ -1,8 +1,18 @@
 #pragma once
 
+#include <chrono>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/io_service.hpp>
 #include <cppcoro/net/socket.hpp>
+#include <cppcoro/operation_cancelled.hpp>
 #include <cppcoro/task.hpp>
+#include <cppcoro/when_all_ready.hpp>
 #include <rdmapp/qp.h>
+#include <span>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
 
 namespace coverbs_rpc {
 
@@ -20,4 +30,51 @@ auto send_qp(rdmapp::qp const &qp, cppcoro::net::socket &socket) -> cppcoro::tas
 
 auto recv_qp(cppcoro::net::socket &socket) -> cppcoro::task<rdmapp::deserialized_qp>;
 
+// Length-prefixed byte strings, for setting up transports that do not exchange qps.
+auto send_blob(std::span<const std::byte> blob, cppcoro::net::socket &socket)
+    -> cppcoro::task<void>;
+
+auto recv_blob(cppcoro::net::socket &socket) -> cppcoro::task<std::vector<std::byte>>;
+
+// How long a listener waits for a connected peer to finish its side of the handshake.
+inline constexpr auto kHandshakeTimeout = std::chrono::seconds(5);
+
+// Runs `exchange` over `socket`, shutting the socket down once `timeout` has passed, so that a
+// peer that connects and then stalls fails the exchange instead of holding it up for good.
+template <typename T>
+auto with_timeout(cppcoro::io_service &io_service, cppcoro::net::socket &socket,
+                  std::chrono::nanoseconds timeout, cppcoro::task<T> exchange)
+    -> cppcoro::task<T> {
+  cppcoro::cancellation_source finished;
+  bool timed_out = false;
+
+  auto timer = [](cppcoro::io_service &io_service, cppcoro::net::socket &socket,
+                  std::chrono::nanoseconds timeout, cppcoro::cancellation_token token,
+                  bool &timed_out) -> cppcoro::task<void> {
+    try {
+      co_await io_service.schedule_after(timeout, std::move(token));
+    } catch (cppcoro::operation_cancelled const &) {
+      co_return;
+    }
+    timed_out = true;
+    ::shutdown(socket.native_handle(), SHUT_RDWR);
+  };
+  auto run = [](cppcoro::task<T> exchange,
+                cppcoro::cancellation_source &finished) -> cppcoro::task<T> {
+    struct stop_timer {
+      cppcoro::cancellation_source &finished;
+      ~stop_timer() { finished.request_cancellation(); }
+    } guard{finished};
+    co_return co_await std::move(exchange);
+  };
+
+  auto [result, _] = co_await cppcoro::when_all_ready(
+      run(std::move(exchange), finished),
+      timer(io_service, socket, timeout, finished.token(), timed_out));
+  if (timed_out) {
+    throw std::runtime_error("handshake timed out");
+  }
+  co_return std::move(result).result();
+}
+
 } // namespace coverbs_rpc
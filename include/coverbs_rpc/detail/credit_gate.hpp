@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace coverbs_rpc::detail {
+
+// An asynchronous counting semaphore. acquire() takes a credit and suspends while none are
+// left, release() hands credits back and resumes waiters inline, in FIFO order. The client
+// counts the receives the server keeps posted for its connection with one, the server the bulk
+// requests it lets onto its thread pool.
+class CreditGate {
+public:
+  explicit CreditGate(int64_t credits) noexcept
+      : available_(credits) {}
+
+  struct Awaitable {
+    CreditGate &gate;
+    auto await_ready() noexcept -> bool {
+      return gate.available_.fetch_sub(1, std::memory_order_acq_rel) > 0;
+    }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      std::scoped_lock lock(gate.mutex_);
+      if (gate.pending_wakeups_ > 0) {
+        --gate.pending_wakeups_;
+        return false;
+      }
+      gate.waiters_.push_back(h);
+      return true;
+    }
+    constexpr void await_resume() const noexcept {}
+  };
+
+  auto acquire() noexcept -> Awaitable { return Awaitable{*this}; }
+
+  // Takes a credit only if one is available right away.
+  auto try_acquire() noexcept -> bool {
+    int64_t available = available_.load(std::memory_order_relaxed);
+    while (available > 0) {
+      if (available_.compare_exchange_weak(available, available - 1,
+                                           std::memory_order_acq_rel)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Credits not taken right now, negative while acquirers wait.
+  auto available() const noexcept -> int64_t { return available_.load(std::memory_order_acquire); }
+
+  auto release(int64_t n) -> void {
+    int64_t prev = available_.fetch_add(n, std::memory_order_acq_rel);
+    if (prev >= 0) {
+      return;
+    }
+    // Waiters that already took their credit but have not queued yet pick up a pending wakeup.
+    for (int64_t i = 0, wake = std::min(n, -prev); i < wake; ++i) {
+      std::coroutine_handle<> h;
+      {
+        std::scoped_lock lock(mutex_);
+        if (waiters_.empty()) {
+          ++pending_wakeups_;
+          continue;
+        }
+        h = waiters_.front();
+        waiters_.pop_front();
+      }
+      h.resume();
+    }
+  }
+
+private:
+  std::atomic<int64_t> available_;
+  std::mutex mutex_;
+  std::deque<std::coroutine_handle<>> waiters_;
+  int64_t pending_wakeups_ = 0;
+};
+
+} // namespace coverbs_rpc::detail
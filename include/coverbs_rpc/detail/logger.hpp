@@ -1,59 +1,339 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <format>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #include "coverbs_rpc/log.hpp"
 
+// Calls below this level (a log_level value) compile to nothing, e.g.
+// -DCOVERBS_RPC_MIN_LOG_LEVEL=2 drops trace and debug. Log through the COVERBS_RPC_LOG_*
+// macros below so that the arguments of those calls are not evaluated either.
+#ifndef COVERBS_RPC_MIN_LOG_LEVEL
+#define COVERBS_RPC_MIN_LOG_LEVEL 0
+#endif
+
 namespace coverbs_rpc::detail {
 
+inline constexpr log_level kMinLogLevel = static_cast<log_level>(COVERBS_RPC_MIN_LOG_LEVEL);
+
+/**
+ * @brief Lets `burst` messages per `period` through from one call site and counts the rest.
+ *
+ * A suppressed message costs a clock read and two relaxed atomics, so an error storm does not
+ * stall the thread reporting it. Keep one per call site, e.g. as a static local.
+ */
+class rate_limit {
+public:
+  explicit constexpr rate_limit(
+      uint32_t burst = 10, std::chrono::nanoseconds period = std::chrono::seconds(1)) noexcept
+      : burst_(burst)
+      , period_ns_(period.count()) {}
+
+  // On true, `suppressed` is the number of messages dropped since the last one let through.
+  auto admit(uint64_t &suppressed) noexcept -> bool {
+    int64_t const now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch())
+                            .count();
+    int64_t start = window_start_.load(std::memory_order_relaxed);
+    if (now - start >= period_ns_ &&
+        window_start_.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+      used_.store(0, std::memory_order_relaxed);
+    }
+    if (used_.fetch_add(1, std::memory_order_relaxed) < burst_) {
+      suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+      return true;
+    }
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+private:
+  uint64_t const burst_;
+  int64_t const period_ns_;
+  std::atomic<int64_t> window_start_{0};
+  std::atomic<uint64_t> used_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+// A message waiting in the async sink. Arguments that are plain numbers are kept as they are
+// and formatted by the sink thread; anything else, strings in particular, may not outlive the
+// call and is formatted into `data` up front.
+struct log_record {
+  static constexpr std::size_t kDataBytes = 448;
+
+  char const *level_str;
+  uint64_t suppressed;
+  std::string_view fmt;
+  void (*render)(log_record const &record, std::string &out);
+  std::size_t text_len;
+  alignas(std::max_align_t) std::byte data[kDataBytes];
+};
+
+template <typename T>
+inline constexpr bool deferrable_arg_v = std::is_arithmetic_v<T> || std::is_enum_v<T>;
+
+// Bounded multi-producer, single-consumer queue of records. Producers never wait, a full ring
+// drops the message.
+class log_ring {
+public:
+  explicit log_ring(std::size_t capacity)
+      : cells_(std::bit_ceil(capacity))
+      , mask_(cells_.size() - 1) {
+    for (std::size_t i = 0; i < cells_.size(); ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  template <typename Fill>
+  auto try_push(Fill &&fill) noexcept -> bool {
+    uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell &c = cells_[pos & mask_];
+      uint64_t const seq = c.seq.load(std::memory_order_acquire);
+      auto const diff = static_cast<int64_t>(seq - pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          fill(c.record);
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Consumer side only.
+  template <typename Consume>
+  auto try_pop(Consume &&consume) -> bool {
+    cell &c = cells_[dequeue_pos_ & mask_];
+    if (c.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+      return false;
+    }
+    consume(c.record);
+    c.seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    return true;
+  }
+
+private:
+  struct cell {
+    std::atomic<uint64_t> seq;
+    log_record record;
+  };
+
+  std::vector<cell> cells_;
+  std::size_t const mask_;
+  alignas(64) std::atomic<uint64_t> enqueue_pos_{0};
+  alignas(64) uint64_t dequeue_pos_{0};
+};
+
+// Writes queued records from its own thread, batching them into one fwrite.
+class async_log_sink {
+public:
+  static constexpr std::size_t kCapacity = 4096;
+
+  async_log_sink()
+      : ring_(kCapacity)
+      , thread_([this](std::stop_token stop) { run(stop); }) {}
+
+  auto ring() noexcept -> log_ring & { return ring_; }
+
+  auto count_dropped() noexcept -> void { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+  auto run(std::stop_token stop) -> void {
+    std::string batch;
+    auto idle = std::chrono::microseconds(50);
+    while (true) {
+      bool const stopping = stop.stop_requested();
+      batch.clear();
+      while (batch.size() < 64 * 1024 && ring_.try_pop([&](log_record const &record) {
+        record.render(record, batch);
+      })) {
+      }
+      if (uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+        std::format_to(std::back_inserter(batch),
+                       "[coverbs_rpc] [WARN ] log queue full, dropped {} messages\n", dropped);
+      }
+      if (!batch.empty()) {
+        std::fwrite(batch.data(), 1, batch.size(), stdout);
+        std::fflush(stdout);
+        idle = std::chrono::microseconds(50);
+        continue;
+      }
+      if (stopping) {
+        return;
+      }
+      std::this_thread::sleep_for(idle);
+      idle = std::min<std::chrono::microseconds>(idle * 2, std::chrono::milliseconds(5));
+    }
+  }
+
+  log_ring ring_;
+  std::atomic<uint64_t> dropped_{0};
+  // Declared last so it is joined, after draining the ring, before the ring goes away.
+  std::jthread thread_;
+};
+
 class logger {
 public:
   void set_level(log_level level) { level_.store(level, std::memory_order_relaxed); }
 
+  void set_sink(log_sink sink) {
+    std::scoped_lock lock(sink_mutex_);
+    if (sink == log_sink::async && !async_storage_) {
+      async_storage_ = std::make_unique<async_log_sink>();
+    }
+    async_.store(sink == log_sink::async ? async_storage_.get() : nullptr,
+                 std::memory_order_release);
+  }
+
+  // Whether a message at `level` would be written, before any rate limit.
+  auto enabled(log_level level) const noexcept -> bool {
+    return level >= kMinLogLevel && level >= level_.load(std::memory_order_relaxed);
+  }
+
   template <typename... Args>
   void trace(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::trace, "TRACE", fmt, std::forward<Args>(args)...);
+    log<log_level::trace>("TRACE", nullptr, fmt, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void debug(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::debug, "DEBUG", fmt, std::forward<Args>(args)...);
+    log<log_level::debug>("DEBUG", nullptr, fmt, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void info(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::info, "INFO ", fmt, std::forward<Args>(args)...);
+    log<log_level::info>("INFO ", nullptr, fmt, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void warn(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::warn, "WARN ", fmt, std::forward<Args>(args)...);
+    log<log_level::warn>("WARN ", nullptr, fmt, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void error(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::err, "ERROR", fmt, std::forward<Args>(args)...);
+    log<log_level::err>("ERROR", nullptr, fmt, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void critical(std::format_string<Args...> fmt, Args &&...args) {
-    log(log_level::critical, "CRIT ", fmt, std::forward<Args>(args)...);
+    log<log_level::critical>("CRIT ", nullptr, fmt, std::forward<Args>(args)...);
   }
 
-private:
+  // Rate limited variants for call sites that can fire once per message.
   template <typename... Args>
-  void log(log_level level, const char *level_str, std::format_string<Args...> fmt,
+  void debug(rate_limit &limit, std::format_string<Args...> fmt, Args &&...args) {
+    log<log_level::debug>("DEBUG", &limit, fmt, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void warn(rate_limit &limit, std::format_string<Args...> fmt, Args &&...args) {
+    log<log_level::warn>("WARN ", &limit, fmt, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void error(rate_limit &limit, std::format_string<Args...> fmt, Args &&...args) {
+    log<log_level::err>("ERROR", &limit, fmt, std::forward<Args>(args)...);
+  }
+
+private:
+  template <log_level Level, typename... Args>
+  void log(const char *level_str, rate_limit *limit, std::format_string<Args...> fmt,
            Args &&...args) {
-    if (level >= level_.load(std::memory_order_relaxed)) {
-      std::string s = std::format("[coverbs_rpc] [{}] {}\n", level_str,
-                                  std::format(fmt, std::forward<Args>(args)...));
-      std::printf("%s", s.c_str());
+    if constexpr (Level >= kMinLogLevel) {
+      if (Level < level_.load(std::memory_order_relaxed)) {
+        return;
+      }
+      uint64_t suppressed = 0;
+      if (limit != nullptr && !limit->admit(suppressed)) {
+        return;
+      }
+      if (auto *sink = async_.load(std::memory_order_acquire)) {
+        if (!sink->ring().try_push([&](log_record &record) {
+              fill(record, level_str, suppressed, fmt, std::forward<Args>(args)...);
+            })) {
+          sink->count_dropped();
+        }
+        return;
+      }
+      thread_local std::string line;
+      line.clear();
+      write_prefix(line, level_str);
+      std::format_to(std::back_inserter(line), fmt, std::forward<Args>(args)...);
+      write_suffix(line, suppressed);
+      std::fwrite(line.data(), 1, line.size(), stdout);
+    }
+  }
+
+  static auto write_prefix(std::string &out, char const *level_str) -> void {
+    out.append("[coverbs_rpc] [").append(level_str).append("] ");
+  }
+
+  static auto write_suffix(std::string &out, uint64_t suppressed) -> void {
+    if (suppressed > 0) {
+      std::format_to(std::back_inserter(out), " ({} similar messages suppressed)", suppressed);
+    }
+    out.push_back('\n');
+  }
+
+  template <typename... Args>
+  static auto fill(log_record &record, char const *level_str, uint64_t suppressed,
+                   std::format_string<Args...> fmt, Args &&...args) -> void {
+    record.level_str = level_str;
+    record.suppressed = suppressed;
+    using stored = std::tuple<std::decay_t<Args>...>;
+    if constexpr ((deferrable_arg_v<std::decay_t<Args>> && ...) &&
+                  sizeof(stored) <= log_record::kDataBytes) {
+      record.fmt = fmt.get();
+      new (record.data) stored(std::forward<Args>(args)...);
+      record.render = [](log_record const &r, std::string &out) {
+        write_prefix(out, r.level_str);
+        std::apply(
+            [&](auto const &...values) {
+              std::vformat_to(std::back_inserter(out), r.fmt, std::make_format_args(values...));
+            },
+            *std::launder(reinterpret_cast<stored const *>(r.data)));
+        write_suffix(out, r.suppressed);
+      };
+    } else {
+      auto *text = reinterpret_cast<char *>(record.data);
+      auto result =
+          std::format_to_n(text, log_record::kDataBytes, fmt, std::forward<Args>(args)...);
+      record.text_len = std::min<std::size_t>(result.size, log_record::kDataBytes);
+      record.render = [](log_record const &r, std::string &out) {
+        write_prefix(out, r.level_str);
+        out.append(reinterpret_cast<char const *>(r.data), r.text_len);
+        write_suffix(out, r.suppressed);
+      };
     }
   }
 
   std::atomic<log_level> level_{log_level::info};
+  std::atomic<async_log_sink *> async_{nullptr};
+  std::mutex sink_mutex_;
+  std::unique_ptr<async_log_sink> async_storage_;
 };
 
 inline logger *get_logger() {
@@ -62,3 +342,21 @@ inline logger *get_logger() {
 }
 
 } // namespace coverbs_rpc::detail
+
+// Calls get_logger()->method(...) only when `level` is enabled, so a disabled call costs one
+// relaxed load and never evaluates its arguments. Below kMinLogLevel it compiles to nothing.
+#define COVERBS_RPC_LOG(level, method, ...)                                                      \
+  do {                                                                                           \
+    if constexpr (::coverbs_rpc::log_level::level >= ::coverbs_rpc::detail::kMinLogLevel) {      \
+      if (::coverbs_rpc::detail::get_logger()->enabled(::coverbs_rpc::log_level::level)) {       \
+        ::coverbs_rpc::detail::get_logger()->method(__VA_ARGS__);                                \
+      }                                                                                          \
+    }                                                                                            \
+  } while (false)
+
+#define COVERBS_RPC_LOG_TRACE(...) COVERBS_RPC_LOG(trace, trace, __VA_ARGS__)
+#define COVERBS_RPC_LOG_DEBUG(...) COVERBS_RPC_LOG(debug, debug, __VA_ARGS__)
+#define COVERBS_RPC_LOG_INFO(...) COVERBS_RPC_LOG(info, info, __VA_ARGS__)
+#define COVERBS_RPC_LOG_WARN(...) COVERBS_RPC_LOG(warn, warn, __VA_ARGS__)
+#define COVERBS_RPC_LOG_ERROR(...) COVERBS_RPC_LOG(err, error, __VA_ARGS__)
+#define COVERBS_RPC_LOG_CRITICAL(...) COVERBS_RPC_LOG(critical, critical, __VA_ARGS__)
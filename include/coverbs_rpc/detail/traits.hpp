@@ -1,5 +1,8 @@
 #pragma once
 
+#include "coverbs_rpc/utils/bump_arena.hpp"
+
+#include <cppcoro/async_generator.hpp>
 #include <cppcoro/task.hpp>
 #include <glaze/glaze.hpp>
 #include <tuple>
@@ -14,6 +17,13 @@ struct is_task<cppcoro::task<R>> : std::true_type {};
 template <typename T>
 inline constexpr bool is_task_v = is_task<T>::value;
 
+template <typename T>
+struct is_async_generator : std::false_type {};
+template <typename R>
+struct is_async_generator<cppcoro::async_generator<R>> : std::true_type {};
+template <typename T>
+inline constexpr bool is_async_generator_v = is_async_generator<T>::value;
+
 template <typename T>
 struct task_result {
   using type = T;
@@ -22,23 +32,49 @@ template <typename R>
 struct task_result<cppcoro::task<R>> {
   using type = R;
 };
+template <typename R>
+struct task_result<cppcoro::async_generator<R>> {
+  using type = R;
+};
 template <typename T>
 using task_result_t = typename task_result<T>::type;
 
+// Handlers of the form `void(const Req &, Resp &, utils::bump_arena &)` fill in a response
+// object owned by the server instead of returning one.
+template <bool Reuse, typename R, typename Params>
+struct response_of {
+  using type = std::decay_t<task_result_t<R>>;
+};
+template <typename R, typename Params>
+struct response_of<true, R, Params> {
+  using type = std::decay_t<std::tuple_element_t<1, Params>>;
+};
+
 template <typename F>
 struct function_traits;
 
 template <typename R, typename... Args>
 struct function_traits_base {
   static constexpr size_t arity = sizeof...(Args);
-  static_assert(arity >= 1 && arity <= 2, "RPC function must have 1 or 2 arguments");
+  static_assert(arity >= 1 && arity <= 3, "RPC function must have 1 to 3 arguments");
 
   using raw_resp_type = std::decay_t<R>;
   using params = std::tuple<Args...>;
 
+  static constexpr bool is_reuse() {
+    if constexpr (arity == 3) {
+      return std::is_void_v<raw_resp_type> &&
+             std::is_same_v<std::tuple_element_t<2, params>, utils::bump_arena &>;
+    }
+    return false;
+  }
+
+  static constexpr bool is_reuse_fn_v = is_reuse();
   static constexpr bool is_coro_fn_v = is_task_v<raw_resp_type>;
+  static constexpr bool is_stream_fn_v = is_async_generator_v<raw_resp_type>;
+  static constexpr bool is_oneway_fn_v = std::is_void_v<raw_resp_type> && !is_reuse_fn_v;
   using request_type = std::decay_t<std::tuple_element_t<0, params>>;
-  using response_type = std::decay_t<task_result_t<raw_resp_type>>;
+  using response_type = typename response_of<is_reuse_fn_v, raw_resp_type, params>::type;
 
   static constexpr bool is_with_session() {
     if constexpr (arity == 2) {
@@ -77,6 +113,15 @@ using rpc_resp_t = typename function_traits<decltype(Handler)>::response_type;
 template <auto Handler>
 inline constexpr bool is_coro_fn_v = function_traits<decltype(Handler)>::is_coro_fn_v;
 
+template <auto Handler>
+inline constexpr bool is_stream_fn_v = function_traits<decltype(Handler)>::is_stream_fn_v;
+
+template <auto Handler>
+inline constexpr bool is_reuse_fn_v = function_traits<decltype(Handler)>::is_reuse_fn_v;
+
+template <auto Handler>
+inline constexpr bool is_oneway_fn_v = function_traits<decltype(Handler)>::is_oneway_fn_v;
+
 template <auto Handler>
 inline constexpr bool is_with_session_v = function_traits<decltype(Handler)>::call_with_session;
 
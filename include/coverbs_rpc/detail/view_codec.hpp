@@ -0,0 +1,49 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <glaze/glaze.hpp>
+#include <span>
+#include <string_view>
+
+// BEVE support for byte span fields (`std::span<const std::byte>`, `<const char>` or
+// `<const uint8_t>`) that point into the buffer they were read from. glaze already reads
+// `std::string_view` in place; byte spans are encoded as BEVE strings and read back the same
+// way, so neither needs a copy or an allocation.
+//
+// Where a field lands in the receive buffer depends on everything encoded before it, so only
+// bytes are viewed in place. Spans of anything else are left to glaze.
+
+namespace coverbs_rpc::detail {
+
+template <typename T>
+concept view_byte =
+    std::same_as<T, std::byte> || std::same_as<T, char> || std::same_as<T, unsigned char>;
+
+} // namespace coverbs_rpc::detail
+
+namespace glz {
+
+template <coverbs_rpc::detail::view_byte T>
+struct to<BEVE, std::span<const T>> {
+  template <auto Opts>
+  static void op(auto &&value, is_context auto &&ctx, auto &&...args) {
+    std::string_view bytes{reinterpret_cast<const char *>(value.data()), value.size()};
+    serialize<BEVE>::op<Opts>(bytes, ctx, args...);
+  }
+};
+
+template <coverbs_rpc::detail::view_byte T>
+struct from<BEVE, std::span<const T>> {
+  template <auto Opts>
+  static void op(auto &value, is_context auto &&ctx, auto &&it, auto &&end) {
+    std::string_view bytes;
+    parse<BEVE>::op<Opts>(bytes, ctx, it, end);
+    if (bool(ctx.error)) [[unlikely]] {
+      return;
+    }
+    value = std::span<const T>{reinterpret_cast<const T *>(bytes.data()), bytes.size()};
+  }
+};
+
+} // namespace glz
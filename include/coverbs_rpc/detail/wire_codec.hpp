@@ -0,0 +1,76 @@
+#pragma once
+
+#include "coverbs_rpc/detail/view_codec.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <glaze/glaze.hpp>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+namespace coverbs_rpc {
+
+/**
+ * @brief Opt a trivially copyable type into the raw wire format.
+ *
+ * Such types are sent as their object representation instead of BEVE, so both ends must agree
+ * on layout and endianness. Structs must opt in explicitly because being trivially copyable
+ * does not rule out pointers or views (e.g. a `std::string_view` field):
+ *
+ *   template <>
+ *   inline constexpr bool coverbs_rpc::enable_raw_wire<KvKey> = true;
+ */
+template <typename T>
+inline constexpr bool enable_raw_wire = false;
+
+namespace detail {
+
+template <typename T>
+concept raw_scalar = std::is_arithmetic_v<T> || std::is_enum_v<T>;
+
+template <typename T>
+struct is_raw_scalar_array : std::false_type {};
+template <raw_scalar T, std::size_t N>
+struct is_raw_scalar_array<std::array<T, N>> : std::true_type {};
+
+template <typename T>
+concept raw_wire_type = std::is_trivially_copyable_v<T> &&
+                        (raw_scalar<T> || is_raw_scalar_array<T>::value || enable_raw_wire<T>);
+
+// Serializes `value` into `out` and returns the number of bytes written, the format being
+// chosen at compile time.
+template <typename T>
+auto wire_write(const T &value, std::span<std::byte> out) -> std::optional<std::size_t> {
+  if constexpr (raw_wire_type<T>) {
+    if (out.size() < sizeof(T)) [[unlikely]] {
+      return std::nullopt;
+    }
+    std::memcpy(out.data(), &value, sizeof(T));
+    return sizeof(T);
+  } else {
+    auto ec = glz::write_beve(value, out);
+    if (ec) [[unlikely]] {
+      return std::nullopt;
+    }
+    return ec.count;
+  }
+}
+
+template <typename T>
+auto wire_read(T &value, std::span<std::byte> in) -> bool {
+  if constexpr (raw_wire_type<T>) {
+    // Payloads are not aligned for T, copy rather than cast.
+    if (in.size() != sizeof(T)) [[unlikely]] {
+      return false;
+    }
+    std::memcpy(&value, in.data(), sizeof(T));
+    return true;
+  } else {
+    return !glz::read_beve(value, in);
+  }
+}
+
+} // namespace detail
+} // namespace coverbs_rpc
@@ -21,4 +21,19 @@ enum class log_level : uint8_t {
  */
 void set_log_level(log_level level);
 
+enum class log_sink : uint8_t {
+  // Format and write on the calling thread.
+  sync,
+  // Queue the message and write it from a background thread. Numeric arguments are formatted
+  // there too; a full queue drops messages instead of blocking.
+  async,
+};
+
+/**
+ * @brief Choose where log messages are written, log_sink::sync by default.
+ *
+ * @param sink The sink to use from now on.
+ */
+void set_log_sink(log_sink sink);
+
 } // namespace coverbs_rpc
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "coverbs_rpc/utils/latency_histogram.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace coverbs_rpc {
+
+// Latency histograms kept by the metrics. 1/8 precision is plenty for monitoring and keeps each
+// one small enough to have several per fn_id and thread.
+using metrics_histogram = utils::basic_latency_histogram<4>;
+
+struct fn_metrics {
+  uint64_t calls{0};
+  uint64_t errors{0};
+  uint64_t req_bytes{0};
+  uint64_t resp_bytes{0};
+  // Client: waiting for a free slot and a send credit.
+  metrics_histogram slot_wait_ns;
+  // Client: request posted until its response arrived.
+  metrics_histogram wire_ns;
+  // Server: request received until a pool thread picked it up.
+  metrics_histogram queue_ns;
+  // Server: running the handler.
+  metrics_histogram handler_ns;
+
+  auto merge(const fn_metrics &other) -> void;
+};
+
+struct metrics_snapshot {
+  std::map<uint32_t, fn_metrics> by_fn;
+
+  auto merge(const metrics_snapshot &other) -> void;
+  auto total() const -> fn_metrics;
+};
+
+/**
+ * @brief Per-fn_id call statistics, recorded without locks on the calling thread.
+ *
+ * Every thread that records gets its own shard with a single writer, so recording is a lookup
+ * plus plain relaxed stores. snapshot() sums the shards up and may run concurrently with
+ * recording; it sees each counter at some recent value.
+ */
+class rpc_metrics {
+public:
+  // Durations are in ns, negative ones are not recorded.
+  struct sample {
+    uint32_t fn_id;
+    bool error = false;
+    uint64_t req_bytes = 0;
+    uint64_t resp_bytes = 0;
+    int64_t slot_wait_ns = -1;
+    int64_t wire_ns = -1;
+    int64_t queue_ns = -1;
+    int64_t handler_ns = -1;
+  };
+
+  rpc_metrics();
+  ~rpc_metrics();
+
+  rpc_metrics(const rpc_metrics &) = delete;
+  auto operator=(const rpc_metrics &) -> rpc_metrics & = delete;
+
+  auto record(const sample &s) -> void;
+
+  auto snapshot() const -> metrics_snapshot;
+
+private:
+  struct shard;
+
+  auto local_shard() -> shard &;
+
+  // Tells registries apart in the per-thread shard cache, unlike addresses ids are never reused.
+  uint64_t const id_;
+  // Where the per-thread shard cache keeps this registry's shard, reused once it is destroyed.
+  uint32_t const index_;
+  mutable std::mutex shards_mutex_;
+  std::vector<std::unique_ptr<shard>> shards_;
+};
+
+} // namespace coverbs_rpc
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "coverbs_rpc/metrics.hpp"
+#include "coverbs_rpc/typed_client.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cppcoro/async_manual_reset_event.hpp>
+#include <cppcoro/async_scope.hpp>
+#include <cppcoro/cancellation_registration.hpp>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/operation_cancelled.hpp>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace coverbs_rpc {
+
+enum class balance_policy : uint8_t {
+  // The replica with the fewest calls in flight on its client.
+  least_inflight,
+  // The replica with the lowest recent call latency, weighted by its calls in flight so that
+  // a fast replica does not take all the load until it slows down.
+  lowest_latency,
+};
+
+/**
+ * @brief Spreads calls over clients of replicas that serve the same handlers.
+ *
+ * Each call compares two replicas picked at random and goes to the better one under the
+ * policy. Two choices are nearly as good as looking at every replica, cost the same however
+ * many replicas there are, and do not send every caller to the same replica at once. Load
+ * moves off replicas that are busy or slow without any configuration. Safe to use from
+ * several threads.
+ *
+ * call_hedged() additionally sends a second copy of a slow call to another replica and takes
+ * whichever answer comes first. It is for idempotent calls only.
+ */
+class replica_set {
+public:
+  // When call_hedged() sends a second copy of a call.
+  struct hedge_policy {
+    // A call that has not completed after this percentile of recent call latencies is sent
+    // to another replica as well. Hedging starts once enough calls have been measured, zero
+    // turns it off.
+    double percentile = 95;
+    // At most this many hedges per call_hedged() on average, with bursts of up to ten.
+    double budget = 0.05;
+  };
+
+  struct options {
+    balance_policy policy = balance_policy::least_inflight;
+    hedge_policy hedge{};
+  };
+
+  replica_set(std::vector<std::shared_ptr<typed_client>> replicas, options opts);
+  explicit replica_set(std::vector<std::shared_ptr<typed_client>> replicas);
+
+  // Waits for hedges that lost to finish cancelling.
+  ~replica_set();
+
+  template <auto Handler>
+  auto call(auto &&req, call_options opts = {}) -> cppcoro::task<detail::rpc_resp_t<Handler>> {
+    replica &r = pick(nullptr);
+    auto const start = std::chrono::steady_clock::now();
+    try {
+      auto resp = co_await r.client->call<Handler>(req, std::move(opts));
+      r.observe(std::chrono::steady_clock::now() - start);
+      co_return resp;
+    } catch (...) {
+      // Failed calls count with the time they took, which keeps timing out replicas unattractive.
+      r.observe(std::chrono::steady_clock::now() - start);
+      throw;
+    }
+  }
+
+  template <auto Handler>
+  auto call_lease(auto &&req, call_options opts = {})
+      -> cppcoro::task<response_lease<detail::rpc_resp_t<Handler>>> {
+    replica &r = pick(nullptr);
+    auto const start = std::chrono::steady_clock::now();
+    try {
+      auto lease = co_await r.client->call_lease<Handler>(req, std::move(opts));
+      r.observe(std::chrono::steady_clock::now() - start);
+      co_return lease;
+    } catch (...) {
+      r.observe(std::chrono::steady_clock::now() - start);
+      throw;
+    }
+  }
+
+  /**
+   * @brief Like call, but a call that takes longer than usual is also sent to a second replica.
+   *
+   * The first response wins. The other copy is cancelled, which frees its slot right away and
+   * drops its response when that arrives. The call fails only if every copy fails. Hedges
+   * need the clients' io_service to run, for their timers.
+   */
+  template <auto Handler>
+  auto call_hedged(auto &&req, call_options opts = {})
+      -> cppcoro::task<detail::rpc_resp_t<Handler>> {
+    using race_t = hedge_race<detail::rpc_req_t<Handler>, detail::rpc_resp_t<Handler>>;
+    earn_hedge_budget();
+    auto race = std::make_shared<race_t>(req);
+
+    std::optional<cppcoro::cancellation_registration> forward_cancel;
+    if (opts.cancel_token.can_be_cancelled()) {
+      forward_cancel.emplace(opts.cancel_token, [race] { race->cancel.request_cancellation(); });
+    }
+    auto const resume_on = opts.resume_on;
+    call_options leg_opts{.timeout = opts.timeout, .cancel_token = race->cancel.token()};
+
+    replica &first = pick(nullptr);
+    auto const delay = hedge_delay();
+    if (delay.count() > 0 && replicas_.size() > 1) {
+      scope_.spawn(hedge_timer<Handler>(race, first, delay, leg_opts));
+    } else {
+      race->pending = 1;
+    }
+    scope_.spawn(hedge_leg<Handler>(race, first, leg_opts));
+
+    co_await race->done;
+    if (resume_on) {
+      co_await resume_on.schedule();
+    }
+    if (!race->value) {
+      std::rethrow_exception(race->error);
+    }
+    co_return std::move(*race->value);
+  }
+
+  template <auto Handler>
+  auto notify(auto &&req) -> cppcoro::task<void> {
+    co_await pick(nullptr).client->notify<Handler>(req);
+  }
+
+  auto size() const noexcept -> std::size_t { return replicas_.size(); }
+
+  auto client(std::size_t idx) const noexcept -> typed_client & { return *replicas_[idx]->client; }
+
+  // Recent call latency of a replica, zero until it has served a call.
+  auto latency(std::size_t idx) const noexcept -> std::chrono::nanoseconds {
+    return std::chrono::nanoseconds(replicas_[idx]->ewma_ns.load(std::memory_order_relaxed));
+  }
+
+private:
+  struct replica {
+    explicit replica(std::shared_ptr<typed_client> client)
+        : client(std::move(client)) {}
+
+    // Exponentially weighted, each call moves the average 1/8 of the way.
+    auto observe(std::chrono::nanoseconds elapsed) noexcept -> void;
+
+    std::shared_ptr<typed_client> const client;
+    std::atomic<int64_t> ewma_ns{0};
+  };
+
+  // The copies of one call_hedged().
+  template <typename Req, typename Resp>
+  struct hedge_race {
+    explicit hedge_race(Req const &req)
+        : req(req) {}
+
+    // The first response or the last failure decides the race.
+    auto settle(std::optional<Resp> resp, std::exception_ptr error_ptr) -> void {
+      bool finished = false;
+      bool cancel_timer = false;
+      {
+        std::scoped_lock lock(mutex);
+        if (decided) {
+          return;
+        }
+        if (resp) {
+          value = std::move(resp);
+          finished = true;
+        } else {
+          if (!error) {
+            error = error_ptr;
+          }
+          finished = --pending == 0;
+          // The primary failed before being hedged, that is not worth a retry.
+          cancel_timer = !finished && !hedged;
+        }
+        decided = finished;
+      }
+      if (finished || cancel_timer) {
+        cancel.request_cancellation();
+      }
+      if (finished) {
+        done.set();
+      }
+    }
+
+    // Called by the timer once it fired or was cancelled. Returns whether to send the hedge.
+    auto start_hedge(bool send) -> bool {
+      {
+        std::scoped_lock lock(mutex);
+        if (decided) {
+          return false;
+        }
+        if (send) {
+          hedged = true;
+          return true;
+        }
+        if (--pending > 0) {
+          return false;
+        }
+        decided = true;
+      }
+      done.set();
+      return false;
+    }
+
+    Req const req;
+    cppcoro::cancellation_source cancel;
+    cppcoro::async_manual_reset_event done;
+
+    std::mutex mutex;
+    // Copies still running, with the timer counting for the hedge.
+    uint32_t pending = 2;
+    bool hedged = false;
+    bool decided = false;
+    std::optional<Resp> value;
+    std::exception_ptr error;
+  };
+
+  template <auto Handler, typename Race>
+  auto hedge_leg(std::shared_ptr<Race> race, replica &r, call_options opts)
+      -> cppcoro::task<void> {
+    auto const start = std::chrono::steady_clock::now();
+    std::exception_ptr error;
+    bool slow = true;
+    try {
+      auto resp = co_await r.client->call<Handler>(race->req, std::move(opts));
+      auto const elapsed = std::chrono::steady_clock::now() - start;
+      r.observe(elapsed);
+      record_latency(elapsed);
+      race->settle(std::move(resp), nullptr);
+      co_return;
+    } catch (const rpc_error &e) {
+      // The losing copy is cancelled on purpose, which says nothing about its replica.
+      slow = e.status() != rpc_status::cancelled;
+      error = std::current_exception();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    if (slow) {
+      r.observe(std::chrono::steady_clock::now() - start);
+    }
+    race->settle(std::nullopt, std::move(error));
+  }
+
+  template <auto Handler, typename Race>
+  auto hedge_timer(std::shared_ptr<Race> race, replica &first, std::chrono::nanoseconds delay,
+                   call_options opts) -> cppcoro::task<void> {
+    bool send = false;
+    try {
+      co_await first.client->io_service().schedule_after(delay, race->cancel.token());
+      send = take_hedge_budget();
+    } catch (const cppcoro::operation_cancelled &) {
+    }
+    if (race->start_hedge(send)) {
+      co_await hedge_leg<Handler>(race, pick(&first), std::move(opts));
+    }
+  }
+
+  // Picks a replica other than `exclude`, if given.
+  auto pick(replica const *exclude) noexcept -> replica &;
+
+  // Lower is better.
+  auto cost(replica const &r) const noexcept -> double;
+
+  // Latencies of call_hedged() copies, for the hedge delay.
+  auto record_latency(std::chrono::nanoseconds elapsed) -> void;
+  auto hedge_delay() const noexcept -> std::chrono::nanoseconds;
+
+  auto earn_hedge_budget() noexcept -> void;
+  auto take_hedge_budget() noexcept -> bool;
+
+  options const opts_;
+  std::vector<std::unique_ptr<replica>> replicas_;
+
+  std::mutex latency_mutex_;
+  metrics_histogram latency_window_;
+  std::atomic<int64_t> hedge_delay_ns_{0};
+  // In thousandths of a hedge.
+  std::atomic<int64_t> hedge_budget_{0};
+
+  // Declared last so it is joined before the replicas go away.
+  cppcoro::async_scope scope_;
+};
+
+} // namespace coverbs_rpc
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "coverbs_rpc/common.hpp"
+
+#include <cppcoro/async_generator.hpp>
 #include <cstdint>
 #include <functional>
 #include <map>
@@ -13,13 +16,43 @@ public:
   using Handler =
       std::function<std::size_t(std::span<std::byte> payload, std::span<std::byte> resp)>;
 
-  auto register_handler(uint32_t fn_id, std::string_view fn_name, Handler h) -> void;
+  // A stream handler serializes each chunk into `resp` and yields its length. The server sends
+  // the chunk before resuming the generator, so `resp` can be reused for every chunk.
+  using StreamHandler = std::function<cppcoro::async_generator<std::size_t>(
+      std::span<std::byte> payload, std::span<std::byte> resp)>;
+
+  using OneWayHandler = std::function<void(std::span<std::byte> payload)>;
+
+  auto register_handler(uint32_t fn_id, std::string_view fn_name, Handler h,
+                        rpc_priority priority = rpc_priority::normal) -> void;
+
+  auto register_stream_handler(uint32_t fn_id, std::string_view fn_name, StreamHandler h,
+                               rpc_priority priority = rpc_priority::normal) -> void;
+
+  auto register_oneway_handler(uint32_t fn_id, std::string_view fn_name, OneWayHandler h,
+                               rpc_priority priority = rpc_priority::normal) -> void;
+
+  // The class `fn_id` was registered with, normal for unknown ones.
+  auto priority(uint32_t fn_id) const -> rpc_priority;
 
   auto dispatch(uint32_t fn_id, std::span<std::byte> payload, std::span<std::byte> resp) const
       -> std::size_t;
 
+  auto dispatch_oneway(uint32_t fn_id, std::span<std::byte> payload) const -> void;
+
+  auto dispatch_stream(uint32_t fn_id, std::span<std::byte> payload,
+                       std::span<std::byte> resp) const -> cppcoro::async_generator<std::size_t>;
+
 private:
+  auto check_unique(uint32_t fn_id) const -> void;
+
+  auto set_priority(uint32_t fn_id, rpc_priority priority) -> void;
+
   std::map<uint32_t, Handler> handlers_;
+  std::map<uint32_t, StreamHandler> stream_handlers_;
+  std::map<uint32_t, OneWayHandler> oneway_handlers_;
+  // Only handlers that are not rpc_priority::normal.
+  std::map<uint32_t, rpc_priority> priorities_;
 };
 
 } // namespace coverbs_rpc
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "coverbs_rpc/common.hpp"
+
+#include <cppcoro/task.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace cppcoro {
+class io_service;
+}
+
+namespace coverbs_rpc {
+
+// A piece of a message. `lkey` is set for bytes in memory registered with the RDMA device of
+// the transport, which it can send from where they are.
+struct send_part {
+  std::span<const std::byte> bytes;
+  std::optional<uint32_t> lkey{};
+};
+
+/**
+ * @brief Moves RPC messages between two endpoints.
+ *
+ * The transport owns a send pool and a recv pool that the RPC layer carves into slots. It
+ * keeps RDMA's semantics whatever is underneath: messages are delivered whole and in order,
+ * each into the oldest pending recv, and the sender has made sure through credits that the
+ * peer has a recv pending for every message it sends.
+ */
+class transport {
+public:
+  virtual ~transport() = default;
+
+  // Allocates (and registers, where that matters) both pools. Called once before any I/O.
+  virtual auto setup_buffers(std::size_t send_bytes, std::size_t recv_bytes) -> void = 0;
+
+  virtual auto send_pool() noexcept -> std::span<std::byte> = 0;
+  virtual auto recv_pool() noexcept -> std::span<std::byte> = 0;
+
+  // Sends send_pool()[offset, offset + len). Once this returns the range may be reused.
+  virtual auto send(std::size_t offset, std::size_t len) -> cppcoro::task<void> = 0;
+
+  // Posts `parts` as one message without copying them, parts without an lkey lying in
+  // send_pool(). Nothing tells when the send is done, so the parts must stay untouched until
+  // the peer has answered it. Returns false, having posted nothing, if the transport cannot
+  // gather these parts right now, the caller then copies them and uses send().
+  virtual auto send_gathered(std::span<const send_part> parts [[maybe_unused]]) -> bool {
+    return false;
+  }
+
+  // Receives the next message into recv_pool()[offset, offset + len) and returns its length.
+  virtual auto recv(std::size_t offset, std::size_t len) -> cppcoro::task<std::size_t> = 0;
+
+  // Whatever the peer handed over while connecting, e.g. its credit hello.
+  virtual auto peer_data() const noexcept -> std::span<const std::byte> = 0;
+
+  // Asks the transport to complete receives only from poll(), on whichever thread calls it,
+  // instead of from a thread of its own. Call before setup_buffers(). Returns false if the
+  // transport cannot work that way.
+  virtual auto set_caller_polling() -> bool { return false; }
+
+  // Fails the pending receives and any posted later, for when the peer will not send anything
+  // that completes them. Transports that cannot cancel a receive do nothing.
+  virtual auto shutdown() noexcept -> void {}
+
+  // With caller polling, completes up to `max` receives whose messages have arrived and
+  // returns how many it completed. Safe to call from several threads at once.
+  virtual auto poll(std::size_t max [[maybe_unused]]) -> std::size_t { return 0; }
+};
+
+class transport_listener {
+public:
+  virtual ~transport_listener() = default;
+
+  virtual auto accept() -> cppcoro::task<std::shared_ptr<transport>> = 0;
+
+  // Waits for the next peer only and returns the handshake that completes its connection, so
+  // that the caller can accept more peers while earlier handshakes are still running. By
+  // default the handshake is done by accept() and the returned task is already complete.
+  virtual auto accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<transport>>>;
+
+  virtual auto close() noexcept -> void = 0;
+};
+
+// Listens on `port` for the transport picked in `config`, sending `user_data` to every peer.
+auto make_listener(cppcoro::io_service &io_service, uint16_t port, TypedRpcConfig const &config,
+                   std::span<const std::byte> user_data) -> std::unique_ptr<transport_listener>;
+
+// Connects to a make_listener() of the same transport kind.
+auto connect_transport(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                       TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>>;
+
+} // namespace coverbs_rpc
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "coverbs_rpc/transport.hpp"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <rdmapp/mr.h>
+#include <rdmapp/qp.h>
+#include <vector>
+
+namespace coverbs_rpc {
+
+class rdma_memory;
+
+// A registered range: `bytes` starts `mr_offset` bytes into `mr`.
+struct rdma_buffer {
+  std::span<std::byte> bytes;
+  rdmapp::local_mr *mr = nullptr;
+  std::size_t mr_offset = 0;
+};
+
+class rdma_transport final : public transport {
+public:
+  // `keepalive` holds whatever the qp depends on beyond itself, e.g. the connector polling its
+  // CQs. It is released after the qp and the memory regions. With `memory`, the pools are
+  // carved out of it instead of being registered on their own.
+  explicit rdma_transport(std::shared_ptr<rdmapp::qp> qp,
+                          std::shared_ptr<void> keepalive = nullptr,
+                          std::shared_ptr<rdma_memory> memory = nullptr);
+  ~rdma_transport() override;
+
+  auto setup_buffers(std::size_t send_bytes, std::size_t recv_bytes) -> void override;
+
+  auto send_pool() noexcept -> std::span<std::byte> override { return send_.bytes; }
+  auto recv_pool() noexcept -> std::span<std::byte> override { return recv_.bytes; }
+
+  auto send(std::size_t offset, std::size_t len) -> cppcoro::task<void> override;
+
+  // Posts an unsignaled send with one SGE per part, if the qp takes that many.
+  auto send_gathered(std::span<const send_part> parts) -> bool override;
+
+  auto recv(std::size_t offset, std::size_t len) -> cppcoro::task<std::size_t> override;
+
+  auto peer_data() const noexcept -> std::span<const std::byte> override;
+
+  // Moves the qp to the error state, which flushes the posted receives and sends.
+  auto shutdown() noexcept -> void override;
+
+  auto qp() const noexcept -> std::shared_ptr<rdmapp::qp> const & { return qp_; }
+
+private:
+  std::shared_ptr<void> keepalive_;
+  std::shared_ptr<rdma_memory> memory_;
+  std::shared_ptr<rdmapp::qp> qp_;
+  rdma_buffer send_;
+  rdma_buffer recv_;
+  std::vector<std::byte> send_pool_;
+  std::optional<rdmapp::local_mr> send_mr_;
+  std::vector<std::byte> recv_pool_;
+  std::optional<rdmapp::local_mr> recv_mr_;
+  std::atomic<bool> shut_down_{false};
+
+  static constexpr std::size_t kMaxGatheredSges = 16;
+  // An unsignaled send keeps its place in the send queue until a signaled one posted after it
+  // completes, so no more than this many may be waiting for that.
+  static constexpr uint64_t kMaxUnretired = 16;
+  uint32_t max_send_sge_ = 1;
+  // Gathered sends posted, and those of them known to be done from a later send() completing.
+  std::atomic<uint64_t> gathered_{0};
+  std::atomic<uint64_t> retired_{0};
+};
+
+/**
+ * @brief RDMA resources for many client connections to share.
+ *
+ * Holds the device, the protection domain, one send and one recv CQ with their pollers, and
+ * registered memory that the connections' buffer pools are carved from. Each connection made
+ * through it costs a QP and its slots rather than a device, CQs, poller threads and memory
+ * registrations of its own. Connections keep what they use alive, and connect() may be called
+ * from several threads.
+ */
+class rdma_context {
+public:
+  struct options {
+    uint32_t device_nr = 0;
+    uint32_t port_nr = 1;
+    // Shared by every connection, so large enough for the work posted on all of them.
+    uint32_t cq_size = 1 << 16;
+    // Registered memory is added in chunks of at least this size as connections need it.
+    std::size_t chunk_bytes = std::size_t{64} << 20;
+    // See ConnConfig::qp_pool_size. The pool adopts the qp sizing of the last connection that
+    // missed it, so clients with one RpcConfig keep hitting it.
+    std::size_t qp_pool_size = 0;
+  };
+
+  rdma_context(cppcoro::io_service &io_service, options opts);
+  explicit rdma_context(cppcoro::io_service &io_service);
+
+  // Connects to an rdma make_listener(), with a qp sized for `config`.
+  auto connect(std::string_view hostname, uint16_t port, RpcConfig const &config,
+               std::span<const std::byte> user_data)
+      -> cppcoro::task<std::shared_ptr<transport>>;
+
+  auto io_service() const noexcept -> cppcoro::io_service &;
+
+private:
+  struct impl;
+  std::shared_ptr<impl> impl_;
+};
+
+auto make_rdma_listener(cppcoro::io_service &io_service, uint16_t port,
+                        TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener>;
+
+auto connect_rdma(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                  TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>>;
+
+} // namespace coverbs_rpc
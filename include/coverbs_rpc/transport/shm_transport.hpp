@@ -0,0 +1,21 @@
+#pragma once
+
+#include "coverbs_rpc/transport.hpp"
+
+namespace coverbs_rpc {
+
+/**
+ * Shared-memory transport for peers on the same host. The connecting side creates a segment
+ * holding one byte ring per direction and hands its name over the TCP connection; after that no
+ * socket or RDMA device is involved. Each end runs a thread that drains the incoming ring into
+ * the posted receives.
+ */
+auto make_shm_listener(cppcoro::io_service &io_service, uint16_t port,
+                       TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener>;
+
+auto connect_shm(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                 TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>>;
+
+} // namespace coverbs_rpc
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "coverbs_rpc/transport.hpp"
+
+namespace coverbs_rpc {
+
+/**
+ * Plain TCP transport for hosts without RDMA. Messages go on the stream as they are, framed by
+ * their RpcHeader. The socket is non-blocking and senders only queue their message: a writer
+ * thread per connection waits until the socket is writable and writes every queued message
+ * with one sendmsg() before resuming their senders. A reader thread per connection reads in
+ * large chunks and splits them into the posted receives.
+ */
+auto make_tcp_listener(cppcoro::io_service &io_service, uint16_t port,
+                       TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener>;
+
+auto connect_tcp(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                 TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>>;
+
+} // namespace coverbs_rpc
@@ -1,58 +1,226 @@
 #pragma once
 
 #include "coverbs_rpc/basic_client.hpp"
-#include "coverbs_rpc/conn/connector.hpp"
 #include "coverbs_rpc/detail/traits.hpp"
+#include "coverbs_rpc/detail/wire_codec.hpp"
+#include "coverbs_rpc/transport.hpp"
 
+#include <cppcoro/async_generator.hpp>
 #include <cppcoro/io_service.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <glaze/glaze.hpp>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace coverbs_rpc {
 
+class rdma_context;
+
+// A deserialized response together with the buffer its views point into.
+template <typename Resp>
+class response_lease {
+public:
+  response_lease() = default;
+  response_lease(response_lease &&) noexcept = default;
+  auto operator=(response_lease &&) noexcept -> response_lease & = default;
+  response_lease(const response_lease &) = delete;
+  auto operator=(const response_lease &) -> response_lease & = delete;
+
+  auto operator*() const noexcept -> const Resp & { return value_; }
+  auto operator->() const noexcept -> const Resp * { return &value_; }
+
+private:
+  friend class typed_client;
+
+  // Moving a vector keeps its storage, so the views in value_ survive a move of the lease.
+  std::vector<std::byte> buffer_;
+  Resp value_{};
+};
+
 class typed_client {
 public:
   typed_client(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
                TypedRpcConfig config = {});
 
+  // Connects over RDMA with the device, CQs and registered memory of `context`, which is much
+  // cheaper per server than a client of its own. The device and transport in `config` are
+  // ignored.
+  typed_client(rdma_context &context, std::string_view hostname, uint16_t port,
+               TypedRpcConfig config = {});
+
+  // Over a transport that was connected with encode_credit_hello(config.max_inflight).
+  typed_client(cppcoro::io_service &io_service, std::shared_ptr<transport> transport,
+               TypedRpcConfig config = {});
+
+  // Like the above, with bulk calls going over `bulk_transport` (see
+  // TypedRpcConfig::bulk_connection), which was connected the same way.
+  typed_client(cppcoro::io_service &io_service, std::shared_ptr<transport> transport,
+               std::shared_ptr<transport> bulk_transport, TypedRpcConfig config = {});
+
+  // Like the constructors, but without blocking the calling thread while connecting.
+  static auto connect(cppcoro::io_service &io_service, std::string hostname, uint16_t port,
+                      TypedRpcConfig config = {}) -> cppcoro::task<std::unique_ptr<typed_client>>;
+  static auto connect(rdma_context &context, std::string hostname, uint16_t port,
+                      TypedRpcConfig config = {}) -> cppcoro::task<std::unique_ptr<typed_client>>;
+
+  // Statistics of the unary calls made so far, by fn_id.
+  auto metrics() const -> metrics_snapshot { return metrics_->snapshot(); }
+
+  // See basic_client::resume_on().
+  auto resume_on(resume_scheduler scheduler) noexcept -> void {
+    client_->resume_on(scheduler);
+    if (bulk_client_) {
+      bulk_client_->resume_on(scheduler);
+    }
+  }
+
+  // See basic_client::poll().
+  auto caller_polling() const noexcept -> bool { return client_->caller_polling(); }
+  auto poll(std::size_t max = 32) -> std::size_t {
+    std::size_t handled = client_->poll(max);
+    if (bulk_client_ && handled < max) {
+      handled += bulk_client_->poll(max - handled);
+    }
+    return handled;
+  }
+
+  auto io_service() const noexcept -> cppcoro::io_service & { return io_service_; }
+
+  // See basic_client::inflight().
+  auto inflight() const noexcept -> std::size_t {
+    return client_->inflight() + (bulk_client_ ? bulk_client_->inflight() : 0);
+  }
+
   template <auto Handler>
-  auto call(auto &&req) -> cppcoro::task<detail::rpc_resp_t<Handler>> {
+  auto call(auto &&req, call_options opts = {}) -> cppcoro::task<detail::rpc_resp_t<Handler>> {
     using Resp = detail::rpc_resp_t<Handler>;
+    Resp resp{};
+    if constexpr (detail::raw_wire_type<Resp>) {
+      // The response is copied out of the receive slot straight into `resp`.
+      std::size_t resp_size = co_await call_raw<Handler>(
+          req, std::as_writable_bytes(std::span{&resp, 1}), std::move(opts));
+      if (resp_size != sizeof(Resp)) [[unlikely]] {
+        throw std::runtime_error("typed_client: failed to deserialize response");
+      }
+    } else {
+      std::vector<std::byte> recv_buffer(config_.max_resp_payload);
+      std::size_t resp_size = co_await call_raw<Handler>(req, recv_buffer, std::move(opts));
+      if (!detail::wire_read(resp, std::span{recv_buffer.data(), resp_size})) [[unlikely]] {
+        throw std::runtime_error("typed_client: failed to deserialize response");
+      }
+    }
+
+    co_return resp;
+  }
+
+  /**
+   * @brief Like call, but for responses with `std::string_view` or byte span fields.
+   *
+   * The response is read in place and its views point into the lease, so they stay valid for
+   * as long as the lease (or whatever it is moved into) is alive.
+   */
+  template <auto Handler>
+  auto call_lease(auto &&req, call_options opts = {})
+      -> cppcoro::task<response_lease<detail::rpc_resp_t<Handler>>> {
+    response_lease<detail::rpc_resp_t<Handler>> lease;
+    lease.buffer_.resize(config_.max_resp_payload);
+    std::size_t resp_size = co_await call_raw<Handler>(req, lease.buffer_, std::move(opts));
+
+    if (!detail::wire_read(lease.value_, std::span{lease.buffer_.data(), resp_size}))
+        [[unlikely]] {
+      throw std::runtime_error("typed_client: failed to deserialize response");
+    }
+
+    co_return lease;
+  }
+
+  template <auto Handler>
+  auto notify(auto &&req) -> cppcoro::task<void> {
     using Req = detail::rpc_req_t<Handler>;
     static_assert(std::same_as<Req, std::decay_t<decltype(req)>>);
+    static_assert(detail::is_oneway_fn_v<Handler>, "Handler must return void");
     constexpr uint32_t fn_id = detail::function_id<Handler>;
 
-    std::vector<std::byte> send_buffer(config_.max_req_payload);
-    auto ec = glz::write_beve(req, send_buffer);
-    if (ec) [[unlikely]] {
-      throw std::runtime_error("typed_client: failed to serialize request");
-    }
-    std::size_t req_size = ec.count;
+    std::vector<std::byte> send_buffer;
+    co_await client_for<Handler>().notify(fn_id, encode_request(req, send_buffer),
+                                          handler_priority<Handler>);
+  }
 
-    std::vector<std::byte> recv_buffer(config_.max_resp_payload);
-    std::size_t resp_size =
-        co_await client_->call(fn_id, std::span{send_buffer.data(), req_size}, recv_buffer);
+  // The generator runs lazily and outlives the statement that creates it, so it keeps a copy
+  // of `req` rather than a reference that could dangle before the request is sent.
+  template <auto Handler>
+  auto call_stream(detail::rpc_req_t<Handler> req)
+      -> cppcoro::async_generator<detail::rpc_resp_t<Handler>> {
+    using Resp = detail::rpc_resp_t<Handler>;
+    static_assert(detail::is_stream_fn_v<Handler>, "Handler must return an async_generator");
+    constexpr uint32_t fn_id = detail::function_id<Handler>;
 
-    Resp resp{};
-    auto err = glz::read_beve(resp, std::span{recv_buffer.data(), resp_size});
-    if (err) [[unlikely]] {
-      throw std::runtime_error("typed_client: failed to deserialize response");
+    std::vector<std::byte> send_buffer;
+    auto chunks = client_for<Handler>().call_stream(fn_id, encode_request(req, send_buffer),
+                                                    handler_priority<Handler>);
+    for (auto it = co_await chunks.begin(); it != chunks.end(); co_await ++it) {
+      Resp resp{};
+      if (!detail::wire_read(resp, *it)) [[unlikely]] {
+        throw std::runtime_error("typed_client: failed to deserialize stream chunk");
+      }
+      co_yield resp;
     }
-
-    co_return resp;
   }
 
 private:
+  // Bulk handlers are called over their own connection if there is one.
+  template <auto Handler>
+  auto client_for() noexcept -> basic_client & {
+    if constexpr (handler_priority<Handler> == rpc_priority::bulk) {
+      if (bulk_client_) {
+        return *bulk_client_;
+      }
+    }
+    return *client_;
+  }
+
+  template <auto Handler>
+  auto call_raw(auto const &req, std::span<std::byte> recv_buffer, call_options opts)
+      -> cppcoro::task<std::size_t> {
+    using Req = detail::rpc_req_t<Handler>;
+    static_assert(std::same_as<Req, std::decay_t<decltype(req)>>);
+    static_assert(!detail::is_stream_fn_v<Handler>, "use call_stream for stream handlers");
+    static_assert(!detail::is_oneway_fn_v<Handler>, "use notify for handlers returning void");
+    constexpr uint32_t fn_id = detail::function_id<Handler>;
+
+    std::vector<std::byte> send_buffer;
+    opts.priority = handler_priority<Handler>;
+    co_return co_await client_for<Handler>().call(fn_id, encode_request(req, send_buffer),
+                                                  recv_buffer, std::move(opts));
+  }
+
+  // Raw wire requests are sent from `req` itself, anything else is serialized into `buffer`.
+  template <typename Req>
+  auto encode_request(const Req &req, std::vector<std::byte> &buffer)
+      -> std::span<const std::byte> {
+    if constexpr (detail::raw_wire_type<Req>) {
+      return std::as_bytes(std::span{&req, 1});
+    } else {
+      buffer.resize(config_.max_req_payload);
+      auto len = detail::wire_write(req, buffer);
+      if (!len) [[unlikely]] {
+        throw std::runtime_error("typed_client: failed to serialize request");
+      }
+      return std::span{buffer.data(), *len};
+    }
+  }
+
   TypedRpcConfig const config_;
-  std::shared_ptr<rdmapp::device> device_;
-  std::shared_ptr<rdmapp::pd> pd_;
   cppcoro::io_service &io_service_;
-  qp_connector connector_;
-  std::shared_ptr<rdmapp::qp> qp_;
+  std::shared_ptr<transport> transport_;
+  std::shared_ptr<rpc_metrics> metrics_;
   std::unique_ptr<basic_client> client_;
+  // Set with TypedRpcConfig::bulk_connection.
+  std::shared_ptr<transport> bulk_transport_;
+  std::unique_ptr<basic_client> bulk_client_;
 };
 
 } // namespace coverbs_rpc
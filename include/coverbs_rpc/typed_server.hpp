@@ -1,14 +1,20 @@
 #pragma once
 
-#include "coverbs_rpc/conn/acceptor.hpp"
 #include "coverbs_rpc/detail/traits.hpp"
+#include "coverbs_rpc/detail/wire_codec.hpp"
+#include "coverbs_rpc/metrics.hpp"
 #include "coverbs_rpc/server_mux.hpp"
+#include "coverbs_rpc/transport.hpp"
+#include "coverbs_rpc/utils/bump_arena.hpp"
 
+#include <atomic>
+#include <cppcoro/async_generator.hpp>
 #include <cppcoro/io_service.hpp>
 #include <cppcoro/task.hpp>
 #include <exception>
 #include <glaze/glaze.hpp>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 
 namespace coverbs_rpc {
@@ -37,53 +43,140 @@ public:
 
   auto run() -> cppcoro::task<void>;
 
+  // Statistics of the requests served so far over all connections, by fn_id.
+  auto metrics() const -> metrics_snapshot { return metrics_->snapshot(); }
+
+  // How long connections took from being accepted until their handshake completed, in ns.
+  // Handshakes run concurrently, so a slow peer does not hold up the ones behind it.
+  auto accept_latency() const -> metrics_histogram {
+    std::scoped_lock lock(accept_mutex_);
+    return accept_ns_;
+  }
+
+  // Connections whose handshake completed and that are still being served.
+  auto connections() const noexcept -> std::size_t {
+    return connections_.load(std::memory_order_relaxed);
+  }
+
   ~typed_server();
 
 private:
+  // The wire format of Req and Resp (raw bytes or BEVE) is fixed by their types, see
+  // enable_raw_wire. Requests are read straight out of the receive buffer, which is not reposted
+  // until the handler (or the whole stream) is done. `std::string_view` and byte span request
+  // fields therefore stay valid for the handler call, and so does a response pointing into
+  // them.
   template <auto Handler, typename Invoker>
   auto register_handler_impl(Invoker invoker) -> void {
     using Req = detail::rpc_req_t<Handler>;
-    using Resp = detail::rpc_resp_t<Handler>;
     constexpr uint32_t fn_id = detail::function_id<Handler>;
     constexpr std::string_view fn_name = detail::function_name<Handler>;
 
-    auto h = [inv = std::move(invoker)](std::span<std::byte> req_bytes,
-                                        std::span<std::byte> resp_bytes) -> std::size_t {
-      Req req{};
-      auto err = glz::read_beve(req, req_bytes);
-      if (err) [[unlikely]] {
-        throw std::runtime_error("typed_server: failed to deserialize request");
-      }
-
-      Resp resp;
-      if constexpr (detail::is_coro_fn_v<Handler>) {
-        // Current architecture doesn't support async handlers yet, but we can add later
-        // resp = co_await inv(req);
-        std::terminate(); // Not implemented
-        static_assert(!sizeof(Handler));
-      } else {
-        resp = inv(req);
-      }
-
-      auto ec = glz::write_beve(resp, resp_bytes);
-      if (ec) [[unlikely]] {
-        throw std::runtime_error("typed_server: failed to serialize response");
-      }
-      return ec.count;
-    };
-
-    mux_.register_handler(fn_id, fn_name, std::move(h));
+    if constexpr (detail::is_stream_fn_v<Handler>) {
+      auto h = [inv = std::move(invoker)](
+                   std::span<std::byte> req_bytes,
+                   std::span<std::byte> resp_bytes) -> cppcoro::async_generator<std::size_t> {
+        Req req{};
+        if (!detail::wire_read(req, req_bytes)) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to deserialize request");
+        }
+
+        auto gen = inv(req);
+        for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it) {
+          auto len = detail::wire_write(*it, resp_bytes);
+          if (!len) [[unlikely]] {
+            throw std::runtime_error("typed_server: failed to serialize stream chunk");
+          }
+          co_yield *len;
+        }
+      };
+
+      mux_.register_stream_handler(fn_id, fn_name, std::move(h), handler_priority<Handler>);
+    } else if constexpr (detail::is_reuse_fn_v<Handler>) {
+      using Resp = detail::rpc_resp_t<Handler>;
+      auto h = [inv = std::move(invoker)](std::span<std::byte> req_bytes,
+                                          std::span<std::byte> resp_bytes) -> std::size_t {
+        // The request is fresh every call, deserializing leaves fields the client omitted as
+        // they were. The response and arena are one per pool thread, handlers run to completion
+        // on their thread, so nothing else touches them in between and string/vector capacity
+        // carries over to the next call.
+        Req req{};
+        thread_local Resp resp{};
+        thread_local utils::bump_arena arena;
+
+        if (!detail::wire_read(req, req_bytes)) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to deserialize request");
+        }
+
+        // The reply is in the send buffer once serialized, after that nothing may point into
+        // the arena any more.
+        struct arena_reset {
+          utils::bump_arena &arena;
+          ~arena_reset() { arena.reset(); }
+        } reset_guard{arena};
+
+        inv(req, resp, arena);
+
+        auto len = detail::wire_write(resp, resp_bytes);
+        if (!len) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to serialize response");
+        }
+        return *len;
+      };
+
+      mux_.register_handler(fn_id, fn_name, std::move(h), handler_priority<Handler>);
+    } else if constexpr (detail::is_oneway_fn_v<Handler>) {
+      auto h = [inv = std::move(invoker)](std::span<std::byte> req_bytes) {
+        Req req{};
+        if (!detail::wire_read(req, req_bytes)) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to deserialize request");
+        }
+        inv(req);
+      };
+
+      mux_.register_oneway_handler(fn_id, fn_name, std::move(h), handler_priority<Handler>);
+    } else {
+      using Resp = detail::rpc_resp_t<Handler>;
+      auto h = [inv = std::move(invoker)](std::span<std::byte> req_bytes,
+                                          std::span<std::byte> resp_bytes) -> std::size_t {
+        Req req{};
+        if (!detail::wire_read(req, req_bytes)) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to deserialize request");
+        }
+
+        Resp resp;
+        if constexpr (detail::is_coro_fn_v<Handler>) {
+          // Current architecture doesn't support async handlers yet, but we can add later
+          // resp = co_await inv(req);
+          std::terminate(); // Not implemented
+          static_assert(!sizeof(Handler));
+        } else {
+          resp = inv(req);
+        }
+
+        auto len = detail::wire_write(resp, resp_bytes);
+        if (!len) [[unlikely]] {
+          throw std::runtime_error("typed_server: failed to serialize response");
+        }
+        return *len;
+      };
+
+      mux_.register_handler(fn_id, fn_name, std::move(h), handler_priority<Handler>);
+    }
   }
 
-  auto handle_connection(std::shared_ptr<rdmapp::qp> qp) -> cppcoro::task<void>;
+  auto handle_connection(cppcoro::task<std::shared_ptr<transport>> handshake)
+      -> cppcoro::task<void>;
 
   TypedRpcConfig const config_;
   uint32_t const thread_count_;
-  std::shared_ptr<rdmapp::device> device_;
-  std::shared_ptr<rdmapp::pd> pd_;
   cppcoro::io_service &io_service_;
-  qp_acceptor acceptor_;
+  std::unique_ptr<transport_listener> listener_;
   basic_mux mux_;
+  std::shared_ptr<rpc_metrics> metrics_;
+  mutable std::mutex accept_mutex_;
+  metrics_histogram accept_ns_;
+  std::atomic<std::size_t> connections_{0};
 };
 
 } // namespace coverbs_rpc
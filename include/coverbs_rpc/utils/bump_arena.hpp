@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+namespace coverbs_rpc::utils {
+
+/**
+ * @brief A bump allocator whose blocks survive reset().
+ *
+ * Allocation is a pointer bump and deallocation is a no-op; reset() rewinds to the first block
+ * without returning anything to the system, so a warmed up arena never calls malloc again. It is
+ * also a std::pmr::memory_resource for use with pmr containers. Not thread safe.
+ */
+class bump_arena : public std::pmr::memory_resource {
+public:
+  explicit bump_arena(std::size_t block_size = 64 * 1024) : block_size_(block_size) {}
+
+  bump_arena(const bump_arena &) = delete;
+  auto operator=(const bump_arena &) -> bump_arena & = delete;
+
+  template <typename T, typename... Args>
+  auto make(Args &&...args) -> T * {
+    return std::construct_at(static_cast<T *>(allocate(sizeof(T), alignof(T))),
+                             std::forward<Args>(args)...);
+  }
+
+  // Makes all memory handed out so far available again. Destructors are not run.
+  auto reset() noexcept -> void {
+    current_ = 0;
+    if (!blocks_.empty()) {
+      cursor_ = blocks_.front().data.get();
+      end_ = cursor_ + blocks_.front().size;
+    }
+  }
+
+  auto capacity() const noexcept -> std::size_t {
+    std::size_t total = 0;
+    for (auto const &block : blocks_) {
+      total += block.size;
+    }
+    return total;
+  }
+
+private:
+  struct block {
+    std::unique_ptr<std::byte[]> data;
+    std::size_t size;
+  };
+
+  auto do_allocate(std::size_t bytes, std::size_t alignment) -> void * override {
+    while (true) {
+      void *ptr = cursor_;
+      std::size_t space = static_cast<std::size_t>(end_ - cursor_);
+      if (cursor_ != nullptr && std::align(alignment, bytes, ptr, space) != nullptr) {
+        cursor_ = static_cast<std::byte *>(ptr) + bytes;
+        return ptr;
+      }
+      next_block(bytes + alignment);
+    }
+  }
+
+  auto do_deallocate(void *, std::size_t, std::size_t) -> void override {}
+
+  auto do_is_equal(const std::pmr::memory_resource &other) const noexcept -> bool override {
+    return this == &other;
+  }
+
+  // Moves on to the next block that fits `min_size`, allocating one if none is left.
+  auto next_block(std::size_t min_size) -> void {
+    std::size_t next = cursor_ == nullptr ? 0 : current_ + 1;
+    while (next < blocks_.size() && blocks_[next].size < min_size) {
+      ++next;
+    }
+    if (next == blocks_.size()) {
+      std::size_t size = std::max(block_size_, min_size);
+      blocks_.push_back(block{std::make_unique_for_overwrite<std::byte[]>(size), size});
+    }
+    current_ = next;
+    cursor_ = blocks_[next].data.get();
+    end_ = cursor_ + blocks_[next].size;
+  }
+
+  std::size_t const block_size_;
+  std::vector<block> blocks_;
+  std::size_t current_{0};
+  std::byte *cursor_{nullptr};
+  std::byte *end_{nullptr};
+};
+
+} // namespace coverbs_rpc::utils
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+namespace coverbs_rpc::utils {
+
+/**
+ * @brief Tells from how long requests waited in a queue whether to turn new ones away, CoDel
+ * style.
+ *
+ * A queue that is merely bursty drains now and then, so some request in every `interval`
+ * waits less than `target`. Once even the shortest wait of an interval exceeds `target`, the
+ * queue is standing and the load is more than can be served. Until an interval shows the
+ * queue drained again, arriving requests are rejected before they join it, which costs them
+ * no wait and lets the queue drain. An interval in which no request left the queue counts as
+ * drained.
+ *
+ * Every call is a few relaxed atomics, so one instance can be shared by all the threads that
+ * put requests on the queue or take them off.
+ */
+class codel {
+public:
+  codel(std::chrono::nanoseconds target, std::chrono::nanoseconds interval) noexcept
+      : target_ns_(target.count())
+      , interval_ns_(interval.count()) {}
+
+  // Called as a request leaves the queue after waiting `sojourn`.
+  auto record(std::chrono::nanoseconds sojourn, std::chrono::steady_clock::time_point now) noexcept
+      -> void {
+    int64_t const wait_ns = sojourn.count();
+    int64_t min = min_ns_.load(std::memory_order_relaxed);
+    while (wait_ns < min &&
+           !min_ns_.compare_exchange_weak(min, wait_ns, std::memory_order_relaxed)) {
+    }
+    roll(now);
+  }
+
+  // Called as a request arrives. Returns whether to reject it, i.e. whether the last complete
+  // interval saw a standing queue.
+  auto overloaded(std::chrono::steady_clock::time_point now) noexcept -> bool {
+    roll(now);
+    return overloaded_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Ends the current interval if `now` is past it.
+  auto roll(std::chrono::steady_clock::time_point now) noexcept -> void {
+    int64_t const now_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    int64_t end = window_end_ns_.load(std::memory_order_relaxed);
+    if (now_ns >= end && window_end_ns_.compare_exchange_strong(end, now_ns + interval_ns_,
+                                                                std::memory_order_relaxed)) {
+      // Waits recorded between the two exchanges count towards the next interval instead.
+      int64_t const window_min =
+          min_ns_.exchange(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+      // The very first interval has no history and ends right away without a verdict. One
+      // without any wait recorded had no queue to speak of.
+      overloaded_.store(end != 0 && window_min != std::numeric_limits<int64_t>::max() &&
+                            window_min > target_ns_,
+                        std::memory_order_relaxed);
+    }
+  }
+
+  int64_t const target_ns_;
+  int64_t const interval_ns_;
+
+  std::atomic<int64_t> min_ns_{std::numeric_limits<int64_t>::max()};
+  std::atomic<int64_t> window_end_ns_{0};
+  std::atomic<bool> overloaded_{false};
+};
+
+} // namespace coverbs_rpc::utils
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace coverbs_rpc::utils {
+
+/**
+ * @brief A log-linear histogram in the style of HdrHistogram.
+ *
+ * Values below 2^SubBucketBits are counted exactly; above that every power of two is split
+ * into 2^(SubBucketBits - 1) equal buckets, so any recorded value is reported within
+ * 1/2^(SubBucketBits - 1) of itself over the whole uint64_t range. Recording is a couple of bit
+ * operations and an increment, merging is a loop of additions. Not thread safe, keep one per
+ * writer and merge.
+ */
+template <unsigned SubBucketBits>
+class basic_latency_histogram {
+  static_assert(SubBucketBits >= 2 && SubBucketBits < 32);
+
+public:
+  static constexpr unsigned kSubBucketBits = SubBucketBits;
+  static constexpr std::size_t kSubBucketCount = std::size_t{1} << kSubBucketBits;
+  static constexpr std::size_t kSubBucketHalf = kSubBucketCount / 2;
+  static constexpr std::size_t kBucketCount =
+      kSubBucketCount + (64 - kSubBucketBits) * kSubBucketHalf;
+
+  basic_latency_histogram()
+      : counts_(kBucketCount, 0) {}
+
+  // Rebuilds a histogram from per-bucket counts kept elsewhere, e.g. in atomics.
+  basic_latency_histogram(std::vector<uint64_t> counts, uint64_t sum, uint64_t min, uint64_t max)
+      : counts_(std::move(counts))
+      , sum_(sum)
+      , min_(min)
+      , max_(max) {
+    counts_.resize(kBucketCount, 0);
+    for (uint64_t n : counts_) {
+      count_ += n;
+    }
+  }
+
+  auto record(uint64_t value) noexcept -> void { record_n(value, 1); }
+
+  auto record_n(uint64_t value, uint64_t n) noexcept -> void {
+    counts_[index_of(value)] += n;
+    count_ += n;
+    sum_ += value * n;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  auto merge(const basic_latency_histogram &other) noexcept -> void {
+    for (std::size_t i = 0; i < kBucketCount; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  auto reset() noexcept -> void {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+    sum_ = 0;
+    min_ = std::numeric_limits<uint64_t>::max();
+    max_ = 0;
+  }
+
+  auto count() const noexcept -> uint64_t { return count_; }
+  auto min() const noexcept -> uint64_t { return count_ == 0 ? 0 : min_; }
+  auto max() const noexcept -> uint64_t { return max_; }
+  auto mean() const noexcept -> double {
+    return count_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(count_);
+  }
+
+  // The smallest recorded-equivalent value that at least `percentile` percent of the samples do
+  // not exceed, e.g. value_at_percentile(99.9).
+  auto value_at_percentile(double percentile) const noexcept -> uint64_t {
+    if (count_ == 0) {
+      return 0;
+    }
+    double const clamped = std::clamp(percentile, 0.0, 100.0);
+    auto target = static_cast<uint64_t>(std::ceil(clamped / 100.0 * static_cast<double>(count_)));
+    target = std::max<uint64_t>(target, 1);
+
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBucketCount; ++i) {
+      seen += counts_[i];
+      if (seen >= target) {
+        return std::min(highest_equivalent(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  static constexpr auto index_of(uint64_t value) noexcept -> std::size_t {
+    if (value < kSubBucketCount) {
+      return static_cast<std::size_t>(value);
+    }
+    unsigned const msb = static_cast<unsigned>(std::bit_width(value)) - 1;
+    unsigned const shift = msb - kSubBucketBits + 1;
+    std::size_t const sub = static_cast<std::size_t>(value >> shift) - kSubBucketHalf;
+    return kSubBucketCount + (shift - 1) * kSubBucketHalf + sub;
+  }
+
+  static constexpr auto highest_equivalent(std::size_t index) noexcept -> uint64_t {
+    if (index < kSubBucketCount) {
+      return index;
+    }
+    std::size_t const shift = (index - kSubBucketCount) / kSubBucketHalf + 1;
+    std::size_t const sub = (index - kSubBucketCount) % kSubBucketHalf;
+    uint64_t const lowest = static_cast<uint64_t>(sub + kSubBucketHalf) << shift;
+    return lowest + ((uint64_t{1} << shift) - 1);
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t count_{0};
+  uint64_t sum_{0};
+  uint64_t min_{std::numeric_limits<uint64_t>::max()};
+  uint64_t max_{0};
+};
+
+using latency_histogram = basic_latency_histogram<7>;
+
+} // namespace coverbs_rpc::utils
@@ -2,29 +2,106 @@
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <coroutine>
 #include <cppcoro/awaitable_traits.hpp>
+#include <cstdint>
 #include <exception>
+#include <limits>
+#include <tuple>
 #include <type_traits>
 #include <utility>
+#include <variant>
+#include <vector>
 
 namespace coverbs_rpc::utils {
 
+/**
+ * @brief How a spin_wait waits for its awaitable.
+ *
+ * It spins for up to `max_spins` iterations or `max_spin_time`, whichever runs out first, and
+ * then parks the thread on a futex until the result is in. Spinning catches fast completions
+ * without a wakeup; parking keeps slow ones from holding a core, which matters once there are
+ * more waiting threads than cores.
+ */
+struct wait_policy {
+  uint32_t max_spins = 1 << 14;
+  // Zero puts no time bound on spinning.
+  std::chrono::nanoseconds max_spin_time = std::chrono::microseconds(20);
+
+  // Never parks, the lowest latency when every waiter has a core of its own.
+  static constexpr auto spin() noexcept -> wait_policy {
+    return wait_policy{.max_spins = std::numeric_limits<uint32_t>::max(), .max_spin_time = {}};
+  }
+
+  // Parks right away.
+  static constexpr auto park() noexcept -> wait_policy {
+    return wait_policy{.max_spins = 0, .max_spin_time = {}};
+  }
+};
+
 namespace detail {
 
 inline void cpu_relax() noexcept { __builtin_ia32_pause(); }
 
 struct SpinEvent {
-  std::atomic<bool> ready_{false};
-  void notify() noexcept { ready_.store(true, std::memory_order_release); }
-  void wait() noexcept {
-    if (ready_.load(std::memory_order_acquire))
+  static constexpr uint32_t kEmpty = 0;
+  static constexpr uint32_t kReady = 1;
+  static constexpr uint32_t kParked = 2;
+  // Ready, and the notifier is done touching the event after waking a parked waiter.
+  static constexpr uint32_t kReadyNotified = 3;
+
+  std::atomic<uint32_t> state_{kEmpty};
+
+  void notify() noexcept {
+    if (state_.exchange(kReady, std::memory_order_acq_rel) == kParked) {
+      state_.notify_one();
+      state_.store(kReadyNotified, std::memory_order_release);
+    }
+  }
+
+  void wait(wait_policy policy = {}) noexcept {
+    if (spin(policy)) {
       return;
-    while (!ready_.load(std::memory_order_acquire)) {
+    }
+    uint32_t expected = kEmpty;
+    if (!state_.compare_exchange_strong(expected, kParked, std::memory_order_acq_rel)) {
+      return; // became ready meanwhile
+    }
+    state_.wait(kParked, std::memory_order_acquire);
+    // The event may be destroyed as soon as we return, wait until notify() let go of it.
+    while (state_.load(std::memory_order_acquire) != kReadyNotified) {
+      if (state_.load(std::memory_order_acquire) == kParked) {
+        state_.wait(kParked, std::memory_order_acquire);
+      } else {
+        cpu_relax();
+      }
+    }
+  }
+
+  bool is_ready() const noexcept {
+    uint32_t const state = state_.load(std::memory_order_acquire);
+    return state == kReady || state == kReadyNotified;
+  }
+
+private:
+  // Returns true once ready, false when the policy says to park.
+  auto spin(wait_policy policy) const noexcept -> bool {
+    constexpr uint32_t kClockEvery = 64;
+    auto const deadline = policy.max_spin_time.count() > 0
+                              ? std::chrono::steady_clock::now() + policy.max_spin_time
+                              : std::chrono::steady_clock::time_point::max();
+    for (uint32_t i = 0; i < policy.max_spins; ++i) {
+      if (is_ready()) {
+        return true;
+      }
+      if (i % kClockEvery == kClockEvery - 1 && std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
       cpu_relax();
     }
+    return is_ready();
   }
-  bool is_ready() const noexcept { return ready_.load(std::memory_order_acquire); }
 };
 
 template <typename T>
@@ -156,8 +233,20 @@ struct spin_wait_task {
 
   void start() { h_.resume(); }
 
-  decltype(auto) get() {
-    h_.promise().event_.wait();
+  void wait(wait_policy policy) noexcept { h_.promise().event_.wait(policy); }
+
+  decltype(auto) get(wait_policy policy = {}) {
+    h_.promise().event_.wait(policy);
+    return h_.promise().get_result();
+  }
+
+  template <typename Poll>
+  decltype(auto) get_polling(Poll &poll) {
+    while (!h_.promise().event_.is_ready()) {
+      if (poll() == 0) {
+        cpu_relax();
+      }
+    }
     return h_.promise().get_result();
   }
 };
@@ -198,11 +287,39 @@ struct safe_spin_result<T &&> {
 template <typename T>
 using safe_spin_result_t = typename safe_spin_result<T>::type;
 
+template <typename Awaitable>
+using spin_result_t =
+    safe_spin_result_t<typename cppcoro::awaitable_traits<Awaitable>::await_result_t>;
+
+// What spin_wait_all keeps per awaitable, void results become std::monostate.
+template <typename Awaitable>
+using spin_all_element_t = std::conditional_t<std::is_void_v<spin_result_t<Awaitable>>,
+                                              std::monostate, spin_result_t<Awaitable>>;
+
+template <typename Awaitable>
+auto start_spin_wait_task(Awaitable &&awaitable) {
+  using result_type = typename cppcoro::awaitable_traits<Awaitable>::await_result_t;
+  auto task =
+      make_spin_wait_task<Awaitable, result_type>(std::forward<Awaitable>(awaitable));
+  task.start();
+  return task;
+}
+
+template <typename Task>
+auto spin_all_element(Task &task, wait_policy policy) {
+  if constexpr (std::is_void_v<decltype(task.get(policy))>) {
+    task.get(policy);
+    return std::monostate{};
+  } else {
+    return task.get(policy);
+  }
+}
+
 } // namespace detail
 
 template <typename Awaitable>
-auto spin_wait(Awaitable &&awaitable)
-    -> detail::safe_spin_result_t<typename cppcoro::awaitable_traits<Awaitable>::await_result_t> {
+auto spin_wait(Awaitable &&awaitable, wait_policy policy = {})
+    -> detail::spin_result_t<Awaitable> {
   using result_type = typename cppcoro::awaitable_traits<Awaitable>::await_result_t;
 
   auto task =
@@ -212,7 +329,69 @@ auto spin_wait(Awaitable &&awaitable)
   // 但是函数的返回类型已经被我们强制指定为 safe_spin_result_t
   // 如果 task.get() 返回 T&&，这里会隐式执行 T(T&&) 移动构造，
   // 在 task 析构之前完成数据的转移。
-  return task.get();
+  return task.get(policy);
+}
+
+/**
+ * @brief Like spin_wait, but calls `poll()` instead of idling until the awaitable completes.
+ *
+ * For awaitables that only make progress when the waiting thread drives them, e.g. calls on a
+ * client with caller polling: `poll_wait(client.call<f>(req), [&] { return client.poll(); })`.
+ * `poll` returns how much work it did, zero makes the waiter back off briefly.
+ */
+template <typename Awaitable, typename Poll>
+auto poll_wait(Awaitable &&awaitable, Poll &&poll) -> detail::spin_result_t<Awaitable> {
+  auto task = detail::start_spin_wait_task(std::forward<Awaitable>(awaitable));
+  return task.get_polling(poll);
+}
+
+/**
+ * @brief Starts every awaitable, then waits for all of them.
+ *
+ * Returns a tuple of the results in argument order, with std::monostate for void ones. Every
+ * awaitable runs to completion before the first exception, if any, is rethrown.
+ */
+template <typename... Awaitables>
+auto spin_wait_all(wait_policy policy, Awaitables &&...awaitables)
+    -> std::tuple<detail::spin_all_element_t<Awaitables>...> {
+  auto tasks =
+      std::make_tuple(detail::start_spin_wait_task(std::forward<Awaitables>(awaitables))...);
+  std::apply([&](auto &...task) { (task.wait(policy), ...); }, tasks);
+  return std::apply(
+      [&](auto &...task) {
+        return std::tuple<detail::spin_all_element_t<Awaitables>...>{
+            detail::spin_all_element(task, policy)...};
+      },
+      tasks);
+}
+
+template <typename... Awaitables>
+  requires(sizeof...(Awaitables) > 0 && (!std::is_same_v<std::decay_t<Awaitables>, wait_policy> &&
+                                         ...))
+auto spin_wait_all(Awaitables &&...awaitables)
+    -> std::tuple<detail::spin_all_element_t<Awaitables>...> {
+  return spin_wait_all(wait_policy{}, std::forward<Awaitables>(awaitables)...);
+}
+
+// Same for a run-time number of awaitables of one type, returning the results in order.
+template <typename Awaitable>
+auto spin_wait_all(std::vector<Awaitable> awaitables, wait_policy policy = {})
+    -> std::vector<detail::spin_all_element_t<Awaitable>> {
+  using task_t = decltype(detail::start_spin_wait_task(std::move(awaitables.front())));
+  std::vector<task_t> tasks;
+  tasks.reserve(awaitables.size());
+  for (auto &awaitable : awaitables) {
+    tasks.push_back(detail::start_spin_wait_task(std::move(awaitable)));
+  }
+  for (auto &task : tasks) {
+    task.wait(policy);
+  }
+  std::vector<detail::spin_all_element_t<Awaitable>> results;
+  results.reserve(tasks.size());
+  for (auto &task : tasks) {
+    results.push_back(detail::spin_all_element(task, policy));
+  }
+  return results;
 }
 
 } // namespace coverbs_rpc::utils
\ No newline at end of file
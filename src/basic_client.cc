@@ -1,183 +1,1080 @@
 #include "coverbs_rpc/basic_client.hpp"
+#include "coverbs_rpc/detail/credit_gate.hpp"
 #include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <concepts>
 #include <concurrentqueue.h>
+#include <condition_variable>
 #include <cppcoro/async_scope.hpp>
+#include <cppcoro/cancellation_registration.hpp>
 #include <cppcoro/sync_wait.hpp>
+#include <cppcoro/when_all_ready.hpp>
+#include <exception>
 #include <memory>
-#include <rdmapp/qp.h>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace coverbs_rpc {
-using detail::get_logger;
 
 namespace detail {
 
+struct RpcStream {
+  // Sizes the ring for `window` chunks of up to `chunk_size` bytes. Only allocates the first
+  // time, the buffers are reused by every later stream on the slot.
+  auto prepare(std::size_t window, std::size_t chunk_size) -> void {
+    if (buffers.size() != window) {
+      buffers.assign(window, std::vector<std::byte>(chunk_size));
+      lengths.assign(window, 0);
+    }
+    head = 0;
+    count = 0;
+  }
+
+  // Returns false if the ring is full, i.e. the server ran past its credits.
+  auto push(std::span<std::byte const> chunk) noexcept -> bool {
+    if (count == buffers.size()) {
+      return false;
+    }
+    std::size_t const idx = (head + count) % buffers.size();
+    std::size_t const len = std::min(chunk.size(), buffers[idx].size());
+    std::copy_n(chunk.begin(), len, buffers[idx].begin());
+    lengths[idx] = len;
+    ++count;
+    return true;
+  }
+
+  auto front() const noexcept -> std::span<const std::byte> {
+    return {buffers[head].data(), lengths[head]};
+  }
+
+  auto pop() noexcept -> void {
+    head = (head + 1) % buffers.size();
+    --count;
+  }
+
+  auto clear() noexcept -> void { count = 0; }
+
+  std::mutex mutex;
+  // Chunks received and not consumed yet. The server sends at most stream_window chunks ahead
+  // of the consumer, and the chunk being consumed stays in the ring until the consumer is done
+  // with it, so a ring of stream_window buffers never overflows.
+  std::vector<std::vector<std::byte>> buffers;
+  std::vector<std::size_t> lengths;
+  std::size_t head = 0;
+  std::size_t count = 0;
+  std::coroutine_handle<> waiter{};
+  bool finished = false;
+  // The consumer went away before the end of the stream, drop chunks until it arrives.
+  bool abandoned = false;
+  // Chunks granted to the server and not received yet, each holding one of the client's
+  // chunk receives.
+  uint32_t granted = 0;
+};
+
 struct RpcSlot {
   std::atomic<uintptr_t> waiter{kWaiterEmpty};
   std::span<std::byte> user_resp_buffer{};
   std::size_t actual_len{};
-  uint64_t expected_req_id{};
+  // Whoever swaps the req_id out for one of the kReqId* outcomes owns the completion, so a
+  // response racing with the deadline is either delivered or dropped, never both.
+  std::atomic<uint64_t> expected_req_id{kReqIdIdle};
+  // Steady clock deadline in ns, zero for none. Stored before expected_req_id.
+  std::atomic<int64_t> deadline_ns{0};
+  std::atomic<bool> cancel_requested{false};
+  // Taken by a bulk call and counted against RpcConfig::bulk_slots, set by its owner.
+  bool bulk = false;
+  // Where the call resumes if the reaper completes it, set by its owner.
+  resume_scheduler resume_on{};
+  RpcStream stream;
 };
 
 struct RpcResponseAwaitable {
   RpcSlot &slot;
+  auto await_ready() const noexcept -> bool {
+    return slot.waiter.load(std::memory_order_acquire) == kWaiterDone;
+  }
+  auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+    return slot.waiter.exchange(uintptr_t(h.address()), std::memory_order_acq_rel) != kWaiterDone;
+  }
+  auto await_resume() const -> std::size_t {
+    switch (slot.expected_req_id.load(std::memory_order_acquire)) {
+      case kReqIdTimedOut:
+        throw rpc_error(rpc_status::timeout);
+      case kReqIdCancelled:
+        throw rpc_error(rpc_status::cancelled);
+      case kReqIdOverloaded:
+        throw rpc_error(rpc_status::overloaded);
+      default:
+        return slot.actual_len;
+    }
+  }
+};
+
+// Called by the owner of a slot's completion once the outcome is in place.
+static auto complete_slot(RpcSlot &slot) -> void {
+  uintptr_t w = slot.waiter.exchange(kWaiterDone, std::memory_order_acq_rel);
+  if (w != kWaiterEmpty) {
+    std::coroutine_handle<>::from_address(reinterpret_cast<void *>(w)).resume();
+  }
+}
+
+// Returns whether the consumer suspended, i.e. whether it resumed on another thread.
+struct RpcStreamAwaitable {
+  RpcStream &stream;
+  bool suspended = false;
   constexpr auto await_ready() const noexcept -> bool { return false; }
-  void await_suspend(std::coroutine_handle<> h) noexcept {
-    slot.waiter.store(uintptr_t(h.address()));
+  auto await_suspend(std::coroutine_handle<> h) noexcept -> bool {
+    std::scoped_lock lock(stream.mutex);
+    if (stream.count > 0 || stream.finished) {
+      return false;
+    }
+    stream.waiter = h;
+    suspended = true;
+    return true;
   }
-  auto await_resume() noexcept -> std::size_t { return slot.actual_len; }
+  constexpr auto await_resume() const noexcept -> bool { return suspended; }
 };
 
 static auto pause() noexcept -> void { __builtin_ia32_pause(); }
 
+static auto now_ns() noexcept -> int64_t {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// How often the reaper looks for expired calls while any call has a deadline or can be
+// cancelled. Otherwise it sleeps until one is made.
+constexpr auto kReapInterval = std::chrono::microseconds(100);
+
+// How long closing waits for the server's close messages, and then for cancelled receives.
+constexpr auto kCloseTimeout = std::chrono::seconds(1);
+
+// Never more than max_inflight, which client_receives() covers.
+static auto negotiated_credits(transport const &transport, RpcConfig const &config) noexcept
+    -> uint32_t {
+  auto const own = static_cast<uint32_t>(config.max_inflight);
+  auto peer_credits = parse_credit_hello(transport.peer_data());
+  return peer_credits ? std::min(*peer_credits, own) : own;
+}
+
+// Credits only stream grants and cancels may take, see Impl::acquire_control_credit().
+static auto control_reserve(uint32_t credits) noexcept -> uint32_t { return credits > 1 ? 1 : 0; }
+
 } // namespace detail
 
 struct basic_client::Impl {
-  Impl(std::shared_ptr<rdmapp::qp> qp, RpcConfig config)
+  Impl(std::shared_ptr<transport> transport, RpcConfig config,
+       std::shared_ptr<rpc_metrics> metrics)
       : config_(config)
       , send_buffer_size_(config_.max_req_payload + sizeof(detail::RpcHeader))
       , recv_buffer_size_(config_.max_resp_payload + sizeof(detail::RpcHeader))
-      , qp_(qp)
-      , send_buffer_pool_(config_.max_inflight * send_buffer_size_)
-      , send_mr_(qp->pd_ptr()->reg_mr(send_buffer_pool_.data(), send_buffer_pool_.size()))
-      , recv_buffer_pool_(config_.max_inflight * recv_buffer_size_)
-      , recv_mr_(qp->pd_ptr()->reg_mr(recv_buffer_pool_.data(), recv_buffer_pool_.size()))
+      , caller_polling_(enable_caller_polling(*transport, config_))
+      , transport_(setup_transport(std::move(transport), config_.max_inflight * send_buffer_size_,
+                                   detail::client_receives(config_) * recv_buffer_size_))
+      , send_buffer_pool_(transport_->send_pool())
+      , recv_buffer_pool_(transport_->recv_pool())
       , slots_(config_.max_inflight)
       , free_slots_(config_.max_inflight * 2)
-      , worker_(&basic_client::Impl::start_recv_workers, this) {
+      , credits_(detail::negotiated_credits(*transport_, config_) -
+                 detail::control_reserve(detail::negotiated_credits(*transport_, config_)))
+      , control_credits_(
+            detail::control_reserve(detail::negotiated_credits(*transport_, config_)))
+      , chunk_receives_(static_cast<int64_t>(config_.max_inflight))
+      , live_recv_workers_(detail::client_receives(config_))
+      , metrics_(std::move(metrics))
+      , worker_(&basic_client::Impl::start_recv_workers, this)
+      , reaper_([this](std::stop_token stop) { reap_expired(stop); }) {
     for (uint32_t i = 0; i < config_.max_inflight; ++i) {
       free_slots_.enqueue(i);
     }
+    if (config_.bulk_slots > 0) {
+      bulk_gate_.emplace(static_cast<int64_t>(config_.bulk_slots));
+    }
 
-    get_logger()->info("Client initialized with {} slots, send_buf={}, recv_buf={}",
-                       config_.max_inflight, send_buffer_size_, recv_buffer_size_);
+    COVERBS_RPC_LOG_INFO("Client initialized with {} slots, {} credits, send_buf={}, recv_buf={}",
+                         config_.max_inflight, detail::negotiated_credits(*transport_, config_),
+                         send_buffer_size_, recv_buffer_size_);
+  }
+
+  /**
+   * Ends the connection so that everything can be destroyed. The server is asked to complete
+   * every posted receive. Receives that are still pending after a while are cancelled on the
+   * transport. Returns false if some receive still cannot complete, in which case the
+   * connection must be left alone.
+   */
+  auto close() -> bool {
+    cppcoro::sync_wait(control_scope_.join());
+    bool sent = false;
+    // The server answers close on every receive, which leaves none for anything else it might
+    // still be sending.
+    if (wait_quiet(detail::kCloseTimeout)) {
+      try {
+        sent = cppcoro::sync_wait(send_close());
+      } catch (const std::exception &e) {
+        COVERBS_RPC_LOG_WARN("Client: sending close failed: {}", e.what());
+      }
+    }
+    if (!sent) {
+      COVERBS_RPC_LOG_DEBUG("Client: close not sent, cancelling receives");
+    } else if (wait_recv_workers(detail::kCloseTimeout)) {
+      return true;
+    }
+    transport_->shutdown();
+    return wait_recv_workers(detail::kCloseTimeout);
+  }
+
+  // Returns false without sending if no slot or credit is free right away. A server that is
+  // gone never hands credits back, and waiting for one would keep close() from returning.
+  auto send_close() -> cppcoro::task<bool> {
+    uint32_t slot_idx;
+    if (!free_slots_.try_dequeue(slot_idx)) {
+      co_return false;
+    }
+    if (!credits_.try_acquire() && !control_credits_.try_acquire()) {
+      free_slot(slot_idx);
+      co_return false;
+    }
+    std::size_t len = write_request(slot_idx, 0, 0, kNoPayload, detail::kFlagClose, 0);
+    co_await send_slot(slot_idx, len);
+    free_slot(slot_idx);
+    co_return true;
+  }
+
+  // Waits until every credit and chunk receive is back, i.e. nothing the server sends to this
+  // client is on its way. Returns false if that takes longer than `timeout`.
+  auto wait_quiet(std::chrono::nanoseconds timeout) -> bool {
+    uint32_t const credits = detail::negotiated_credits(*transport_, config_);
+    uint32_t const reserve = detail::control_reserve(credits);
+    auto const deadline = std::chrono::steady_clock::now() + timeout;
+    while (credits_.available() != credits - reserve || control_credits_.available() != reserve ||
+           chunk_receives_.available() != static_cast<int64_t>(config_.max_inflight)) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
+      if (caller_polling_) {
+        transport_->poll(32);
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    return true;
+  }
+
+  auto wait_recv_workers(std::chrono::nanoseconds timeout) -> bool {
+    auto const deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock lock(close_mutex_);
+    while (live_recv_workers_ > 0 && std::chrono::steady_clock::now() < deadline) {
+      if (caller_polling_) {
+        // Nobody else delivers the close messages.
+        lock.unlock();
+        transport_->poll(32);
+        lock.lock();
+      } else {
+        close_cv_.wait_until(lock, deadline);
+      }
+    }
+    return live_recv_workers_ == 0;
+  }
+
+  // Falling back to a receive thread would leave poll() callers spinning on responses handled
+  // elsewhere, so a transport that cannot be polled by callers is an error.
+  static auto enable_caller_polling(transport &transport, RpcConfig const &config) -> bool {
+    if (!config.caller_polling) {
+      return false;
+    }
+    if (!transport.set_caller_polling()) {
+      throw std::invalid_argument("caller_polling: transport cannot be polled by callers");
+    }
+    return true;
+  }
+
+  static auto setup_transport(std::shared_ptr<transport> transport, std::size_t send_bytes,
+                              std::size_t recv_bytes) -> std::shared_ptr<transport> {
+    transport->setup_buffers(send_bytes, recv_bytes);
+    return transport;
   }
 
   void start_recv_workers() {
     cppcoro::async_scope scope;
-    for (std::size_t i = 0; i < config_.max_inflight; ++i) {
+    for (std::size_t i = 0; i < detail::client_receives(config_); ++i) {
       scope.spawn(recv_worker(i));
     }
     cppcoro::sync_wait(scope.join());
   }
 
+  // What a receive worker owes for the message it just took in. Settled only once the worker
+  // has posted its receive again, so nothing the settlement lets the server send can arrive
+  // before there is a receive for it.
+  struct settlement {
+    uint32_t credits = 0;
+    // Chunk receives given back to chunk_receives_.
+    uint32_t chunk_receives = 0;
+    // A unary call to complete.
+    detail::RpcSlot *completed = nullptr;
+    // A stream consumer to resume.
+    std::coroutine_handle<> waiter{};
+    // The slot of an abandoned stream to give back.
+    std::optional<uint32_t> recycled;
+
+    auto empty() const noexcept -> bool {
+      return credits == 0 && chunk_receives == 0 && completed == nullptr && !waiter &&
+             !recycled;
+    }
+  };
+
+  auto settle(settlement owed) -> cppcoro::task<void> {
+    release_credits(owed.credits);
+    if (owed.chunk_receives > 0) {
+      chunk_receives_.release(owed.chunk_receives);
+    }
+    if (owed.recycled) {
+      free_slot(*owed.recycled);
+    }
+    if (owed.completed) {
+      detail::complete_slot(*owed.completed);
+    }
+    if (owed.waiter) {
+      owed.waiter.resume();
+    }
+    co_return;
+  }
+
+  // Posts the receive at `offset`, then settles what the previous message left owed.
+  auto recv_settled(std::size_t offset, settlement owed) -> cppcoro::task<std::size_t> {
+    if (owed.empty()) {
+      co_return co_await transport_->recv(offset, recv_buffer_size_);
+    }
+    auto [received, settled] = co_await cppcoro::when_all_ready(
+        transport_->recv(offset, recv_buffer_size_), settle(owed));
+    settled.result();
+    co_return received.result();
+  }
+
   auto recv_worker(std::size_t worker_idx) -> cppcoro::task<void> {
-    get_logger()->debug("Client: recv_worker[{}] started", worker_idx);
+    COVERBS_RPC_LOG_DEBUG("Client: recv_worker[{}] started", worker_idx);
     std::size_t offset = worker_idx * recv_buffer_size_;
+    settlement owed;
     while (true) {
-      auto recv_slice_mr = rdmapp::mr_view(recv_mr_, offset, recv_buffer_size_);
       try {
-        auto [nbytes, _] = co_await qp_->recv(recv_slice_mr, rdmapp::use_native_awaitable);
+        std::size_t nbytes = co_await recv_settled(offset, std::exchange(owed, {}));
 
         if (nbytes < sizeof(detail::RpcHeader)) [[unlikely]] {
-          get_logger()->warn("Client: received too small packet: {}", nbytes);
+          static detail::rate_limit limit;
+          COVERBS_RPC_LOG_WARN(limit, "Client: received too small packet: {}", nbytes);
           continue;
         }
 
         auto buffer_ptr = recv_buffer_pool_.data() + offset;
         auto header = reinterpret_cast<detail::RpcHeader *>(buffer_ptr);
 
+        if (header->flags & detail::kFlagClose) {
+          break;
+        }
+
+        // Whatever else happens to the message, the credits it returns are settled with it.
+        owed.credits = header->credits;
+        if (header->flags & detail::kFlagCredit) {
+          continue;
+        }
+
         uint64_t recv_id = header->req_id;
         uint32_t slot_idx = detail::parse_slot_idx(recv_id);
 
         if (slot_idx >= config_.max_inflight) [[unlikely]] {
-          get_logger()->error("Client: invalid slot_idx decoded: {}", slot_idx);
+          static detail::rate_limit limit;
+          COVERBS_RPC_LOG_ERROR(limit, "Client: invalid slot_idx decoded: {}", slot_idx);
           continue;
         }
 
         detail::RpcSlot &slot = slots_[slot_idx];
+        std::size_t payload_len = header->payload_len;
+
+        if (header->flags & detail::kFlagStream) {
+          if (slot.expected_req_id.load(std::memory_order_acquire) != recv_id) [[unlikely]] {
+            static detail::rate_limit limit;
+            COVERBS_RPC_LOG_DEBUG(limit, "Client: drop stream message: req_id={}", recv_id);
+            continue;
+          }
+          on_stream_message(slot_idx, *header,
+                            std::span{buffer_ptr + sizeof(detail::RpcHeader), payload_len}, owed);
+          continue;
+        }
 
-        if (slot.expected_req_id != recv_id) [[unlikely]] {
-          get_logger()->error("Client: mismatch req_id: expected={} get={}", slot.expected_req_id,
-                              recv_id);
-          std::terminate();
+        uint64_t expected = recv_id;
+        uint64_t const outcome = (header->flags & detail::kFlagOverloaded)
+                                     ? detail::kReqIdOverloaded
+                                     : detail::kReqIdDone;
+        if (!slot.expected_req_id.compare_exchange_strong(expected, outcome,
+                                                          std::memory_order_acq_rel))
+            [[unlikely]] {
+          // The call expired, its slot moved on but its credit comes back only now.
+          static detail::rate_limit limit;
+          COVERBS_RPC_LOG_DEBUG(limit, "Client: drop late response: req_id={} expected={}",
+                                recv_id, expected);
+          continue;
         }
 
-        std::size_t payload_len = header->payload_len;
         std::size_t copy_len = std::min((std::size_t)payload_len, slot.user_resp_buffer.size());
 
         std::copy_n(buffer_ptr + sizeof(detail::RpcHeader), copy_len, slot.user_resp_buffer.data());
 
         slot.actual_len = copy_len;
-
-        uintptr_t w;
-        while ((w = slot.waiter.load()) == detail::kWaiterEmpty) {
-          detail::pause();
-        }
-        auto h = std::coroutine_handle<>::from_address(reinterpret_cast<void *>(w));
-        h.resume();
+        owed.completed = &slot;
 
       } catch (const std::exception &e) {
-        get_logger()->error("Client: recv worker error: {}", e.what());
+        COVERBS_RPC_LOG_ERROR("Client: recv worker error: {}", e.what());
         break;
       }
     }
+    std::scoped_lock lock(close_mutex_);
+    if (--live_recv_workers_ == 0) {
+      close_cv_.notify_all();
+    }
+  }
+
+  // Takes the chunk into the stream's ring. Resuming the consumer or recycling the slot is
+  // left to `owed`.
+  auto on_stream_message(uint32_t slot_idx, detail::RpcHeader const &header,
+                         std::span<std::byte const> payload, settlement &owed) -> void {
+    auto &stream = slots_[slot_idx].stream;
+    bool const end = header.flags & detail::kFlagStreamEnd;
+    std::scoped_lock lock(stream.mutex);
+    // A chunk gives its receive back, the end gives back those of chunks never sent.
+    uint32_t const done = end ? stream.granted : std::min<uint32_t>(stream.granted, 1);
+    stream.granted -= done;
+    owed.chunk_receives += done;
+    if (stream.abandoned) {
+      if (!end) {
+        return;
+      }
+      stream.abandoned = false;
+      stream.clear();
+      slots_[slot_idx].expected_req_id.store(detail::kReqIdIdle, std::memory_order_release);
+      owed.recycled = slot_idx;
+    } else if (end) {
+      stream.finished = true;
+      owed.waiter = std::exchange(stream.waiter, {});
+    } else if (stream.push(payload)) [[likely]] {
+      owed.waiter = std::exchange(stream.waiter, {});
+    } else {
+      static detail::rate_limit limit;
+      COVERBS_RPC_LOG_ERROR(limit, "Client: stream chunk beyond the window dropped: req_id={}",
+                            header.req_id);
+    }
+  }
+
+  // Takes between one and `most` chunk receives, waiting only for the first.
+  auto take_chunk_receives(uint32_t most) -> cppcoro::task<uint32_t> {
+    co_await chunk_receives_.acquire();
+    uint32_t taken = 1;
+    while (taken < most && chunk_receives_.try_acquire()) {
+      ++taken;
+    }
+    co_return taken;
+  }
+
+  // Yields a free slot. Bulk calls first wait for one of RpcConfig::bulk_slots, suspended
+  // rather than spinning, as long as the other calls keep them all.
+  struct SlotAwaitable {
+    Impl &impl;
+    bool bulk;
+    auto await_ready() noexcept -> bool {
+      return !bulk || detail::CreditGate::Awaitable{*impl.bulk_gate_}.await_ready();
+    }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      return detail::CreditGate::Awaitable{*impl.bulk_gate_}.await_suspend(h);
+    }
+    auto await_resume() noexcept -> uint32_t {
+      uint32_t slot_idx;
+      while (!impl.free_slots_.try_dequeue(slot_idx)) {
+        detail::pause();
+      }
+      impl.slots_[slot_idx].bulk = bulk;
+      return slot_idx;
+    }
+  };
+
+  auto acquire_slot(rpc_priority priority = rpc_priority::normal) noexcept -> SlotAwaitable {
+    return SlotAwaitable{*this, priority == rpc_priority::bulk && bulk_gate_.has_value()};
+  }
+
+  // Never call with a stream's mutex held, a bulk call waiting for the slot may resume inline.
+  auto free_slot(uint32_t slot_idx) noexcept -> void {
+    bool const bulk = std::exchange(slots_[slot_idx].bulk, false);
+    free_slots_.enqueue(slot_idx);
+    if (bulk) {
+      bulk_gate_->release(1);
+    }
+  }
+
+  static constexpr std::span<const std::byte> kNoPayload{};
+
+  // Prepares `slot_idx` for a unary call and returns the req_id to send.
+  auto arm_slot(uint32_t slot_idx, std::span<std::byte> resp_buffer, int64_t deadline_ns,
+                resume_scheduler resume_on) noexcept -> uint64_t {
+    uint64_t seq = global_seq_.fetch_add(1);
+    uint64_t req_id = detail::make_req_id(seq, slot_idx);
+
+    detail::RpcSlot &slot = slots_[slot_idx];
+    slot.waiter.store(detail::kWaiterEmpty, std::memory_order_relaxed);
+    slot.user_resp_buffer = resp_buffer;
+    slot.resume_on = resume_on;
+    slot.deadline_ns.store(deadline_ns, std::memory_order_relaxed);
+    slot.expected_req_id.store(req_id, std::memory_order_release);
+    return req_id;
+  }
+
+  auto release_slot(uint32_t slot_idx) noexcept -> void {
+    detail::RpcSlot &slot = slots_[slot_idx];
+    slot.deadline_ns.store(0, std::memory_order_relaxed);
+    slot.cancel_requested.store(false, std::memory_order_relaxed);
+    slot.expected_req_id.store(detail::kReqIdIdle, std::memory_order_release);
+    free_slot(slot_idx);
+  }
+
+  template <typename Parts>
+  auto round_trip(uint32_t fn_id, Parts req_parts, std::span<std::byte> resp_buffer,
+                  call_options opts) -> cppcoro::task<std::size_t> {
+    if (opts.cancel_token.is_cancellation_requested()) {
+      throw rpc_error(rpc_status::cancelled);
+    }
+
+    int64_t const wait_start_ns = metrics_ ? detail::now_ns() : 0;
+    uint32_t slot_idx = co_await acquire_slot(opts.priority);
+    co_await credits_.acquire();
+    int64_t const send_start_ns = metrics_ ? detail::now_ns() : 0;
+
+    auto const timeout = opts.timeout.count() != 0 ? opts.timeout : config_.call_timeout;
+    int64_t const deadline_ns = timeout.count() > 0 ? detail::now_ns() + timeout.count() : 0;
+    bool const watched = deadline_ns != 0 || opts.cancel_token.can_be_cancelled();
+
+    auto const scheduler = opts.resume_on ? opts.resume_on : resume_on_;
+    detail::RpcSlot &slot = slots_[slot_idx];
+    uint64_t req_id = arm_slot(slot_idx, resp_buffer, deadline_ns, scheduler);
+    if (watched && watched_calls_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+      std::scoped_lock lock(reap_mutex_);
+      reap_cv_.notify_one();
+    }
+
+    std::size_t nbytes = 0;
+    std::exception_ptr error;
+    bool send_failed = false;
+    {
+      std::optional<cppcoro::cancellation_registration> on_cancel;
+      if (opts.cancel_token.can_be_cancelled()) {
+        // This may run on any thread, leave the wakeup to the reaper.
+        on_cancel.emplace(opts.cancel_token, [&slot] {
+          slot.cancel_requested.store(true, std::memory_order_release);
+        });
+      }
+
+      try {
+        // Only a call that ends with the reply knows the server has read what was gathered.
+        if (watched || !send_gathered(slot_idx, req_id, fn_id, req_parts)) {
+          co_await send_slot(slot_idx, write_request(slot_idx, req_id, fn_id, req_parts, 0, 0));
+        }
+      } catch (const std::exception &e) {
+        COVERBS_RPC_LOG_ERROR("Client: RPC failed: {}", e.what());
+        send_failed = true;
+      }
+
+      uint64_t expected = req_id;
+      if (send_failed && slot.expected_req_id.compare_exchange_strong(
+                             expected, detail::kReqIdIdle, std::memory_order_acq_rel)) {
+        release_credits(1);
+      } else {
+        // Wait for whoever completes the call, even after a failed send the reaper may have
+        // claimed it already.
+        try {
+          nbytes = co_await detail::RpcResponseAwaitable{slot};
+        } catch (const rpc_error &) {
+          if (!send_failed) {
+            error = std::current_exception();
+          }
+        }
+        if (send_failed) {
+          // Nothing reached the server, so no late reply will return the credit.
+          release_credits(1);
+        }
+      }
+    }
+
+    if (watched) {
+      watched_calls_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    // The reaper already resumed an expired call on the scheduler.
+    uint64_t const outcome = slot.expected_req_id.load(std::memory_order_acquire);
+    bool const on_scheduler = !caller_polling_ && (outcome == detail::kReqIdTimedOut ||
+                                                   outcome == detail::kReqIdCancelled);
+    release_slot(slot_idx);
+    if (metrics_) {
+      std::size_t req_len = 0;
+      for (auto const &part : req_parts) {
+        req_len += part_bytes(part).size();
+      }
+      metrics_->record(rpc_metrics::sample{
+          .fn_id = fn_id,
+          .error = send_failed || error != nullptr,
+          .req_bytes = req_len,
+          .resp_bytes = nbytes,
+          .slot_wait_ns = send_start_ns - wait_start_ns,
+          .wire_ns = detail::now_ns() - send_start_ns,
+      });
+    }
+    // Hop even if nothing suspended, any wait above may have resumed on another thread.
+    if (scheduler && !on_scheduler) {
+      co_await scheduler.schedule();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    co_return send_failed ? 0 : nbytes;
   }
 
+  // Completes calls that passed their deadline or were cancelled. Runs on its own thread so
+  // that a server that never answers cannot hold a slot forever.
+  void reap_expired(std::stop_token stop) {
+    while (true) {
+      {
+        std::unique_lock lock(reap_mutex_);
+        if (!reap_cv_.wait(lock, stop, [this] {
+              return watched_calls_.load(std::memory_order_acquire) != 0;
+            })) {
+          return;
+        }
+      }
+      std::this_thread::sleep_for(detail::kReapInterval);
+
+      int64_t const now = detail::now_ns();
+      for (auto &slot : slots_) {
+        uint64_t req_id = slot.expected_req_id.load(std::memory_order_acquire);
+        if (req_id <= detail::kReqIdOverloaded) {
+          continue;
+        }
+        bool const cancelled = slot.cancel_requested.load(std::memory_order_acquire);
+        int64_t const deadline = slot.deadline_ns.load(std::memory_order_acquire);
+        if (!cancelled && (deadline == 0 || now < deadline)) {
+          continue;
+        }
+        uint64_t const outcome = cancelled ? detail::kReqIdCancelled : detail::kReqIdTimedOut;
+        // The request keeps its credit: the server still holds a receive for it until it
+        // replies, and the late reply hands the credit back.
+        if (slot.expected_req_id.compare_exchange_strong(req_id, outcome,
+                                                         std::memory_order_acq_rel)) {
+          hand_off_expired(static_cast<uint32_t>(&slot - slots_.data()));
+        }
+      }
+    }
+  }
+
+  // Expired calls resume where a response would have resumed them, so that their
+  // continuations do not hold up the reaper and with it the deadlines of other calls. Only
+  // calls with neither caller polling nor a scheduler resume on the reaper itself.
+  auto hand_off_expired(uint32_t slot_idx) -> void {
+    detail::RpcSlot &slot = slots_[slot_idx];
+    if (caller_polling_) {
+      reaped_.enqueue(slot_idx);
+    } else if (slot.resume_on) {
+      control_scope_.spawn(
+          [](resume_scheduler scheduler, detail::RpcSlot &slot) -> cppcoro::task<void> {
+            co_await scheduler.schedule();
+            detail::complete_slot(slot);
+          }(slot.resume_on, slot));
+    } else {
+      detail::complete_slot(slot);
+    }
+  }
+
+  // With caller polling, completes up to `max` calls the reaper has expired.
+  auto complete_reaped(std::size_t max) -> std::size_t {
+    std::size_t done = 0;
+    uint32_t slot_idx;
+    while (done < max && reaped_.try_dequeue(slot_idx)) {
+      detail::complete_slot(slots_[slot_idx]);
+      ++done;
+    }
+    return done;
+  }
+
+  static auto part_bytes(std::span<const std::byte> part) noexcept -> std::span<const std::byte> {
+    return part;
+  }
+  static auto part_bytes(send_part const &part) noexcept -> std::span<const std::byte> {
+    return part.bytes;
+  }
+
+  static auto write_header(std::byte *buffer, uint64_t req_id, uint32_t fn_id,
+                           std::size_t payload_len, uint32_t flags, uint32_t credits) noexcept
+      -> void {
+    auto *header = reinterpret_cast<detail::RpcHeader *>(buffer);
+    header->req_id = req_id;
+    header->payload_len = static_cast<uint32_t>(payload_len);
+    header->fn_id = fn_id;
+    header->flags = flags;
+    header->credits = credits;
+  }
+
+  // Gathers `req_parts` into the send buffer of `slot_idx` behind the header and returns the
+  // number of bytes to send.
+  template <typename Parts>
+  auto write_request(uint32_t slot_idx, uint64_t req_id, uint32_t fn_id, Parts const &req_parts,
+                     uint32_t flags, uint32_t credits) noexcept -> std::size_t {
+    std::byte *buffer = send_buffer_pool_.data() + slot_idx * send_buffer_size_;
+    std::byte *payload = buffer + sizeof(detail::RpcHeader);
+    std::size_t payload_len = 0;
+    for (auto const &part : req_parts) {
+      auto bytes = part_bytes(part);
+      std::copy_n(bytes.data(), bytes.size(), payload + payload_len);
+      payload_len += bytes.size();
+    }
+    write_header(buffer, req_id, fn_id, payload_len, flags, credits);
+    return sizeof(detail::RpcHeader) + payload_len;
+  }
+
+  static constexpr std::size_t kMaxGatheredParts = 8;
+
+  // Posts the request with the parts that carry an lkey sent from where they are, the header
+  // and the other parts from the slot. Returns false, having sent nothing, if no part is
+  // registered or the transport cannot gather them, write_request() copies them all then.
+  template <typename Parts>
+  auto send_gathered(uint32_t slot_idx, uint64_t req_id, uint32_t fn_id, Parts const &req_parts)
+      -> bool {
+    if constexpr (!std::same_as<std::ranges::range_value_t<Parts>, send_part>) {
+      return false;
+    } else {
+      if (req_parts.size() > kMaxGatheredParts ||
+          std::ranges::none_of(req_parts, [](send_part const &p) { return p.lkey.has_value(); })) {
+        return false;
+      }
+      std::byte *buffer = send_buffer_pool_.data() + slot_idx * send_buffer_size_;
+      std::array<send_part, kMaxGatheredParts + 1> segments;
+      segments[0] = send_part{.bytes = std::span{buffer, sizeof(detail::RpcHeader)}};
+      std::size_t count = 1;
+      std::size_t used = sizeof(detail::RpcHeader);
+      for (auto const &part : req_parts) {
+        if (part.lkey) {
+          segments[count++] = part;
+          continue;
+        }
+        std::copy_n(part.bytes.data(), part.bytes.size(), buffer + used);
+        // Copied parts follow each other in the slot, so they extend a slot segment before them.
+        if (auto &last = segments[count - 1]; !last.lkey) {
+          last.bytes = std::span{last.bytes.data(), last.bytes.size() + part.bytes.size()};
+        } else {
+          segments[count++] = send_part{.bytes = std::span{buffer + used, part.bytes.size()}};
+        }
+        used += part.bytes.size();
+      }
+      std::size_t payload_len = 0;
+      for (auto const &part : req_parts) {
+        payload_len += part.bytes.size();
+      }
+      write_header(buffer, req_id, fn_id, payload_len, 0, 0);
+      return transport_->send_gathered(std::span{segments.data(), count});
+    }
+  }
+
+  auto write_request(uint32_t slot_idx, uint64_t req_id, uint32_t fn_id,
+                     std::span<const std::byte> req_data, uint32_t flags,
+                     uint32_t credits) noexcept -> std::size_t {
+    return write_request(slot_idx, req_id, fn_id, std::span{&req_data, 1}, flags, credits);
+  }
+
+  auto send_slot(uint32_t slot_idx, std::size_t len) -> cppcoro::task<void> {
+    co_await transport_->send(slot_idx * send_buffer_size_, len);
+  }
+
+  /**
+   * Every live stream keeps one of the server's receives busy until it ends, and it needs
+   * another receive for each grant that keeps it going. With all receives held by streams
+   * none could be granted more chunks, so requests leave the last credit to grants and
+   * cancels. Those still use a request credit when one is free, so that grants of many
+   * streams need not take turns on the reserve.
+   */
+  auto acquire_control_credit() -> cppcoro::task<void> {
+    if (credits_.try_acquire()) {
+      co_return;
+    }
+    co_await control_credits_.acquire();
+    control_credits_out_.fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  // Credits handed back by the server refill the control reserve first, whichever message
+  // they were returned for.
+  auto release_credits(int64_t n) -> void {
+    int64_t out = control_credits_out_.load(std::memory_order_acquire);
+    while (n > 0 && out > 0) {
+      if (control_credits_out_.compare_exchange_weak(out, out - 1, std::memory_order_acq_rel)) {
+        control_credits_.release(1);
+        --n;
+        out = control_credits_out_.load(std::memory_order_acquire);
+      }
+    }
+    if (n > 0) {
+      credits_.release(n);
+    }
+  }
+
+  auto send_stream_control(uint32_t slot_idx, uint64_t req_id, uint32_t fn_id, uint32_t flags,
+                           uint32_t credits) -> cppcoro::task<void> {
+    try {
+      co_await acquire_control_credit();
+      std::size_t len = write_request(slot_idx, req_id, fn_id, kNoPayload, flags, credits);
+      co_await send_slot(slot_idx, len);
+    } catch (const std::exception &e) {
+      COVERBS_RPC_LOG_ERROR("Client: send stream control failed: {}", e.what());
+    }
+  }
+
+  // Gives the slot of a stream back when its consumer is done with it. A consumer that leaves
+  // early cancels the stream, and the slot is recycled once the server acknowledges the end.
+  struct StreamGuard {
+    Impl &impl;
+    uint32_t slot_idx;
+    uint64_t req_id;
+    uint32_t fn_id;
+    bool sent = false;
+
+    ~StreamGuard() {
+      auto &stream = impl.slots_[slot_idx].stream;
+      bool abandon = false;
+      uint32_t unused = 0;
+      {
+        std::scoped_lock lock(stream.mutex);
+        stream.clear();
+        stream.waiter = {};
+        abandon = sent && !stream.finished;
+        stream.abandoned = abandon;
+        stream.finished = false;
+        // An abandoned stream keeps its grants until the end arrives.
+        if (!abandon) {
+          unused = std::exchange(stream.granted, 0);
+        }
+      }
+      if (unused > 0) {
+        impl.chunk_receives_.release(unused);
+      }
+      if (abandon) {
+        impl.control_scope_.spawn(impl.send_stream_control(
+            slot_idx, req_id, fn_id, detail::kFlagCredit | detail::kFlagCancel, 0));
+      } else {
+        impl.release_slot(slot_idx);
+      }
+    }
+  };
+
   RpcConfig const config_;
   std::size_t const send_buffer_size_;
   std::size_t const recv_buffer_size_;
+  bool const caller_polling_;
 
-  std::shared_ptr<rdmapp::qp> qp_;
-
-  std::vector<std::byte> send_buffer_pool_;
-  rdmapp::local_mr send_mr_;
-  std::vector<std::byte> recv_buffer_pool_;
-  rdmapp::local_mr recv_mr_;
+  std::shared_ptr<transport> transport_;
+  std::span<std::byte> const send_buffer_pool_;
+  std::span<std::byte> const recv_buffer_pool_;
 
   std::vector<detail::RpcSlot> slots_;
   moodycamel::ConcurrentQueue<uint32_t> free_slots_;
+  // Counts the slots bulk calls may still take, see RpcConfig::bulk_slots.
+  std::optional<detail::CreditGate> bulk_gate_;
+
+  detail::CreditGate credits_;
+  detail::CreditGate control_credits_;
+  // Control credits taken and not yet given back to control_credits_.
+  std::atomic<int64_t> control_credits_out_{0};
+  // The receives posted beyond one per credit, which is what stream chunks arrive on. A
+  // stream grants the server only chunks it holds one of these for.
+  detail::CreditGate chunk_receives_;
+
+  // Sequence numbers start at 1 so that no req_id collides with the kReqId* values.
+  std::atomic<uint64_t> global_seq_{1};
+  std::atomic<uint32_t> watched_calls_{0};
+  // The reaper sleeps on reap_cv_ while watched_calls_ is zero.
+  std::mutex reap_mutex_;
+  std::condition_variable_any reap_cv_;
+  // Expired calls for poll() to complete, with caller polling.
+  moodycamel::ConcurrentQueue<uint32_t> reaped_;
+
+  std::mutex close_mutex_;
+  std::condition_variable close_cv_;
+  std::size_t live_recv_workers_;
 
-  std::atomic<uint64_t> global_seq_{0};
+  std::shared_ptr<rpc_metrics> metrics_;
+  resume_scheduler resume_on_;
+  cppcoro::async_scope control_scope_;
   std::jthread worker_;
+  std::jthread reaper_;
 };
 
-basic_client::basic_client(std::shared_ptr<rdmapp::qp> qp, RpcConfig config)
-    : impl_(std::make_unique<Impl>(qp, config)) {}
+basic_client::basic_client(std::shared_ptr<transport> transport, RpcConfig config,
+                           std::shared_ptr<rpc_metrics> metrics)
+    : impl_(std::make_unique<Impl>(std::move(transport), config, std::move(metrics))) {}
+
+basic_client::basic_client(std::shared_ptr<rdmapp::qp> qp, RpcConfig config,
+                           std::shared_ptr<rpc_metrics> metrics)
+    : basic_client(std::make_shared<rdma_transport>(std::move(qp)), config, std::move(metrics)) {}
+
+basic_client::~basic_client() {
+  if (!impl_->close()) {
+    // Destroying the client now would leave receives that may still complete pointing at it.
+    COVERBS_RPC_LOG_ERROR("Client: connection did not close, leaking it");
+    static_cast<void>(impl_.release());
+  }
+}
+
+auto basic_client::resume_on(resume_scheduler scheduler) noexcept -> void {
+  impl_->resume_on_ = scheduler;
+}
+
+auto basic_client::caller_polling() const noexcept -> bool { return impl_->caller_polling_; }
 
-basic_client::~basic_client() = default;
+auto basic_client::poll(std::size_t max) -> std::size_t {
+  if (!impl_->caller_polling_) {
+    return 0;
+  }
+  std::size_t const reaped = impl_->complete_reaped(max);
+  return reaped < max ? reaped + impl_->transport_->poll(max - reaped) : reaped;
+}
+
+auto basic_client::inflight() const noexcept -> std::size_t {
+  std::size_t const free = impl_->free_slots_.size_approx();
+  return free < impl_->config_.max_inflight ? impl_->config_.max_inflight - free : 0;
+}
 
 auto basic_client::call(uint32_t fn_id, std::span<const std::byte> req_data,
-                        std::span<std::byte> resp_buffer) -> cppcoro::task<std::size_t> {
+                        std::span<std::byte> resp_buffer, call_options opts)
+    -> cppcoro::task<std::size_t> {
+  if (req_data.size() > impl_->config_.max_req_payload) {
+    throw std::runtime_error("request payload too large");
+  }
+  co_return co_await impl_->round_trip(fn_id, std::span{&req_data, 1}, resp_buffer,
+                                       std::move(opts));
+}
+
+auto basic_client::call(uint32_t fn_id, std::span<const std::span<const std::byte>> req_parts,
+                        std::span<std::byte> resp_buffer, call_options opts)
+    -> cppcoro::task<std::size_t> {
+  std::size_t req_size = 0;
+  for (auto part : req_parts) {
+    req_size += part.size();
+  }
+  if (req_size > impl_->config_.max_req_payload) {
+    throw std::runtime_error("request payload too large");
+  }
+  co_return co_await impl_->round_trip(fn_id, req_parts, resp_buffer, std::move(opts));
+}
+
+auto basic_client::call(uint32_t fn_id, std::span<const send_part> req_parts,
+                        std::span<std::byte> resp_buffer, call_options opts)
+    -> cppcoro::task<std::size_t> {
+  std::size_t req_size = 0;
+  for (auto const &part : req_parts) {
+    req_size += part.bytes.size();
+  }
+  if (req_size > impl_->config_.max_req_payload) {
+    throw std::runtime_error("request payload too large");
+  }
+  co_return co_await impl_->round_trip(fn_id, req_parts, resp_buffer, std::move(opts));
+}
+
+auto basic_client::notify(uint32_t fn_id, std::span<const std::byte> req_data,
+                          rpc_priority priority) -> cppcoro::task<void> {
   if (req_data.size() > impl_->config_.max_req_payload) {
     throw std::runtime_error("request payload too large");
   }
 
-  uint32_t slot_idx;
-  while (!impl_->free_slots_.try_dequeue(slot_idx)) {
-    detail::pause();
+  uint32_t slot_idx = co_await impl_->acquire_slot(priority);
+  co_await impl_->credits_.acquire();
+  uint64_t req_id = detail::make_req_id(impl_->global_seq_.fetch_add(1), slot_idx);
+  std::size_t send_len =
+      impl_->write_request(slot_idx, req_id, fn_id, req_data, detail::kFlagOneWay, 0);
+
+  try {
+    co_await impl_->send_slot(slot_idx, send_len);
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_ERROR("Client: notify failed: {}", e.what());
+  }
+
+  impl_->free_slot(slot_idx);
+}
+
+auto basic_client::call_stream(uint32_t fn_id, std::span<const std::byte> req_data,
+                               rpc_priority priority)
+    -> cppcoro::async_generator<std::span<const std::byte>> {
+  if (req_data.size() > impl_->config_.max_req_payload) {
+    throw std::runtime_error("request payload too large");
   }
 
+  uint32_t const window = std::max<uint32_t>(impl_->config_.stream_window, 1);
+  uint32_t const grant_batch = std::max<uint32_t>(window / 2, 1);
+
+  uint32_t slot_idx = co_await impl_->acquire_slot(priority);
   uint64_t seq = impl_->global_seq_.fetch_add(1);
   uint64_t req_id = detail::make_req_id(seq, slot_idx);
 
   detail::RpcSlot &slot = impl_->slots_[slot_idx];
-  slot.waiter.store(detail::kWaiterEmpty);
-  slot.user_resp_buffer = resp_buffer;
-  slot.expected_req_id = req_id;
+  {
+    std::scoped_lock lock(slot.stream.mutex);
+    slot.stream.prepare(window, impl_->config_.max_resp_payload);
+  }
+  slot.expected_req_id.store(req_id, std::memory_order_release);
+  Impl::StreamGuard guard{*impl_, slot_idx, req_id, fn_id};
 
-  std::size_t send_offset = slot_idx * impl_->send_buffer_size_;
-  auto send_slice_mr =
-      rdmapp::mr_view(impl_->send_mr_, send_offset, sizeof(detail::RpcHeader) + req_data.size());
+  uint32_t const initial = co_await impl_->take_chunk_receives(window);
+  {
+    std::scoped_lock lock(slot.stream.mutex);
+    slot.stream.granted = initial;
+  }
+  co_await impl_->credits_.acquire();
+  co_await impl_->send_slot(
+      slot_idx,
+      impl_->write_request(slot_idx, req_id, fn_id, req_data, detail::kFlagStream, initial));
+  guard.sent = true;
 
-  detail::RpcHeader *header = reinterpret_cast<detail::RpcHeader *>(send_slice_mr.span().data());
-  header->req_id = req_id;
-  header->payload_len = static_cast<uint32_t>(req_data.size());
-  header->fn_id = fn_id;
+  uint32_t consumed = 0;
+  while (true) {
+    if (co_await detail::RpcStreamAwaitable{slot.stream} && impl_->resume_on_) {
+      co_await impl_->resume_on_.schedule();
+    }
+    std::span<const std::byte> chunk;
+    {
+      std::scoped_lock lock(slot.stream.mutex);
+      if (slot.stream.count == 0) {
+        break; // finished
+      }
+      chunk = slot.stream.front();
+    }
 
-  std::copy_n(req_data.data(), req_data.size(),
-              send_slice_mr.span().data() + sizeof(detail::RpcHeader));
+    // Yielded in place, the ring buffer is only reused once the consumer resumes us.
+    co_yield chunk;
 
-  std::size_t nbytes = 0;
-  try {
-    co_await impl_->qp_->send(send_slice_mr, rdmapp::use_native_awaitable);
-    nbytes = co_await detail::RpcResponseAwaitable{slot};
-  } catch (const std::exception &e) {
-    get_logger()->error("Client: RPC failed: {}", e.what());
-  }
+    {
+      std::scoped_lock lock(slot.stream.mutex);
+      slot.stream.pop();
+    }
 
-  impl_->free_slots_.enqueue(slot_idx);
-  co_return nbytes;
+    if (++consumed >= grant_batch) {
+      uint32_t const grant = co_await impl_->take_chunk_receives(consumed);
+      {
+        std::scoped_lock lock(slot.stream.mutex);
+        slot.stream.granted += grant;
+      }
+      co_await impl_->acquire_control_credit();
+      co_await impl_->send_slot(slot_idx, impl_->write_request(slot_idx, req_id, fn_id,
+                                                               Impl::kNoPayload,
+                                                               detail::kFlagCredit, grant));
+      consumed -= grant;
+    }
+  }
 }
 
 } // namespace coverbs_rpc
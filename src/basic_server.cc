@@ -1,29 +1,79 @@
 #include "coverbs_rpc/basic_server.hpp"
 #include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cppcoro/async_scope.hpp>
 #include <cppcoro/when_all.hpp>
+#include <cppcoro/when_all_ready.hpp>
 #include <exception>
+#include <utility>
 
 namespace coverbs_rpc {
-using detail::get_logger;
 
-basic_server::basic_server(std::shared_ptr<rdmapp::qp> qp, const basic_mux &mux, RpcConfig config,
-                           std::uint32_t thread_count)
+namespace {
+
+auto setup_transport(std::shared_ptr<transport> transport, std::size_t send_bytes,
+                     std::size_t recv_bytes) -> std::shared_ptr<transport> {
+  transport->setup_buffers(send_bytes, recv_bytes);
+  return transport;
+}
+
+// Gives a bulk request's credit back once the request is done.
+struct gate_permit {
+  detail::CreditGate *gate = nullptr;
+
+  ~gate_permit() {
+    if (gate != nullptr) {
+      gate->release(1);
+    }
+  }
+};
+
+auto now_ns() noexcept -> int64_t {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+auto steady_time(int64_t ns) noexcept -> std::chrono::steady_clock::time_point {
+  return std::chrono::steady_clock::time_point(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::nanoseconds(ns)));
+}
+
+} // namespace
+
+basic_server::basic_server(std::shared_ptr<transport> transport, const basic_mux &mux,
+                           RpcConfig config, std::uint32_t thread_count,
+                           std::shared_ptr<rpc_metrics> metrics)
     : mux_(mux)
     , config_(config)
     , send_buffer_size_(config_.max_resp_payload + sizeof(detail::RpcHeader))
     , recv_buffer_size_(config_.max_req_payload + sizeof(detail::RpcHeader))
-    , qp_(qp)
+    , credit_batch_(std::max<uint32_t>(config_.max_inflight / 4, 1))
+    , transport_(setup_transport(std::move(transport), config_.max_inflight * send_buffer_size_,
+                                 config_.max_inflight * recv_buffer_size_))
+    , metrics_(std::move(metrics))
     , tp_(thread_count)
-    , recv_buffer_pool_(config_.max_inflight * recv_buffer_size_)
-    , recv_mr_(qp->pd_ptr()->reg_mr(recv_buffer_pool_.data(), recv_buffer_pool_.size()))
-    , send_buffer_pool_(config_.max_inflight * send_buffer_size_)
-    , send_mr_(qp->pd_ptr()->reg_mr(send_buffer_pool_.data(), send_buffer_pool_.size())) {
-  get_logger()->info("Server initialized with {} slots, thread_count={}", config_.max_inflight,
-                     thread_count);
+    , recv_buffer_pool_(transport_->recv_pool())
+    , send_buffer_pool_(transport_->send_pool()) {
+  if (config_.shed_target.count() > 0) {
+    shedder_.emplace(config_.shed_target, config_.shed_interval);
+  }
+  if (config_.bulk_concurrency > 0) {
+    bulk_gate_.emplace(static_cast<int64_t>(config_.bulk_concurrency));
+  }
+  COVERBS_RPC_LOG_INFO("Server initialized with {} slots, thread_count={}", config_.max_inflight,
+                       thread_count);
 }
 
+basic_server::basic_server(std::shared_ptr<rdmapp::qp> qp, const basic_mux &mux, RpcConfig config,
+                           std::uint32_t thread_count, std::shared_ptr<rpc_metrics> metrics)
+    : basic_server(std::make_shared<rdma_transport>(std::move(qp)), mux, config, thread_count,
+                   std::move(metrics)) {}
+
 auto basic_server::run() -> cppcoro::task<void> {
   cppcoro::async_scope scope;
   for (std::size_t i = 0; i < config_.max_inflight; ++i) {
@@ -36,41 +86,317 @@ auto basic_server::server_worker(std::size_t idx) -> cppcoro::task<void> {
   std::size_t const recv_offset = idx * recv_buffer_size_;
   std::size_t const send_offset = idx * send_buffer_size_;
 
-  auto recv_mr = rdmapp::mr_view(recv_mr_, recv_offset, recv_buffer_size_);
-  auto send_mr = rdmapp::mr_view(send_mr_, send_offset, send_buffer_size_);
+  std::byte *const recv_buffer = recv_buffer_pool_.data() + recv_offset;
+  std::byte *const send_buffer = send_buffer_pool_.data() + send_offset;
 
   auto const resp_payload_span =
-      std::span<std::byte>(static_cast<std::byte *>(send_mr.addr()) + sizeof(detail::RpcHeader),
-                           config_.max_resp_payload);
+      std::span<std::byte>(send_buffer + sizeof(detail::RpcHeader), config_.max_resp_payload);
 
+  settlement owed;
   while (true) {
-    auto [nbytes, _] = co_await qp_->recv(recv_mr, rdmapp::use_native_awaitable);
+    std::size_t nbytes = 0;
+    try {
+      nbytes = co_await recv_settled(recv_offset, send_offset, std::exchange(owed, {}));
+    } catch (const std::exception &e) {
+      disconnect(e.what());
+      co_return;
+    }
 
     if (nbytes < sizeof(detail::RpcHeader)) [[unlikely]] {
-      get_logger()->warn("Server: received too small packet: {}", nbytes);
+      static detail::rate_limit limit;
+      COVERBS_RPC_LOG_WARN(limit, "Server: received too small packet: {}", nbytes);
       continue;
     }
 
+    auto *header = reinterpret_cast<detail::RpcHeader *>(recv_buffer);
+    if (header->flags & detail::kFlagClose) {
+      co_await answer_close(send_offset);
+      disconnect("client closed");
+      co_return;
+    }
+    if (header->flags & detail::kFlagCredit) {
+      grant_stream_credits(*header);
+      owed = settlement{.what = settlement::kind::stream_credit, .req_id = header->req_id};
+      continue;
+    }
+
+    bool const timed = metrics_ || shedder_;
+    int64_t const recv_ns = timed ? now_ns() : 0;
+    // Turned away before joining a standing queue, rather than after waiting in it. Streams are
+    // not shed, their chunks are already paced by the client's credits.
+    if (!(header->flags & detail::kFlagStream) && overloaded(recv_ns)) {
+      owed = reject(*header, send_offset);
+      continue;
+    }
+    // Bulk requests beyond the limit wait here rather than in the pool's FIFO queue, so a
+    // normal request finds at most bulk_concurrency of them ahead of it.
+    gate_permit permit;
+    if (bulk_gate_ && mux_.priority(header->fn_id) == rpc_priority::bulk) {
+      co_await bulk_gate_->acquire();
+      permit.gate = &*bulk_gate_;
+    }
     co_await tp_.schedule();
+    int64_t const start_ns = timed ? now_ns() : 0;
+    if (shedder_) {
+      shedder_->record(std::chrono::nanoseconds(start_ns - recv_ns), steady_time(start_ns));
+    }
+
+    auto payload =
+        std::span<std::byte>(recv_buffer + sizeof(detail::RpcHeader), header->payload_len);
+
+    if (header->flags & detail::kFlagStream) {
+      if (metrics_) {
+        metrics_->record(rpc_metrics::sample{.fn_id = header->fn_id,
+                                             .req_bytes = payload.size(),
+                                             .queue_ns = start_ns - recv_ns});
+      }
+      owed = co_await serve_stream(*header, payload, send_offset);
+      continue;
+    }
+
+    if (header->flags & detail::kFlagOneWay) {
+      dispatch_recorded(*header, recv_ns, start_ns, [&] {
+        mux_.dispatch_oneway(header->fn_id, payload);
+        return std::size_t{0};
+      });
+      owed = settlement{.what = settlement::kind::credit};
+      continue;
+    }
 
-    auto *header = reinterpret_cast<detail::RpcHeader *>(recv_mr.addr());
-    auto payload = std::span<std::byte>(
-        static_cast<std::byte *>(recv_mr.addr()) + sizeof(detail::RpcHeader), header->payload_len);
-    auto *resp_header = reinterpret_cast<detail::RpcHeader *>(send_mr.addr());
+    auto *resp_header = reinterpret_cast<detail::RpcHeader *>(send_buffer);
 
-    std::size_t resp_payload_len = mux_.dispatch(header->fn_id, payload, resp_payload_span);
+    std::size_t resp_payload_len = dispatch_recorded(*header, recv_ns, start_ns, [&] {
+      return mux_.dispatch(header->fn_id, payload, resp_payload_span);
+    });
 
     resp_header->req_id = header->req_id;
     resp_header->payload_len = static_cast<uint32_t>(resp_payload_len);
+    resp_header->fn_id = header->fn_id;
+    resp_header->flags = 0;
+    resp_header->credits = 0;
+    owed = settlement{.what = settlement::kind::reply,
+                      .reply_len = sizeof(detail::RpcHeader) + resp_payload_len};
+  }
+}
 
-    std::size_t resp_len = sizeof(detail::RpcHeader) + resp_payload_len;
-    auto send_view = rdmapp::mr_view(send_mr_, send_offset, resp_len);
+auto basic_server::recv_settled(std::size_t recv_offset, std::size_t send_offset,
+                                settlement owed) -> cppcoro::task<std::size_t> {
+  if (owed.what == settlement::kind::none) {
+    co_return co_await transport_->recv(recv_offset, recv_buffer_size_);
+  }
+  // when_all_ready starts the receive first, and it is posted by the time it suspends.
+  auto [received, settled] = co_await cppcoro::when_all_ready(
+      transport_->recv(recv_offset, recv_buffer_size_), settle(owed, send_offset));
+  settled.result();
+  co_return received.result();
+}
 
-    try {
-      co_await qp_->send(send_view, rdmapp::use_native_awaitable);
-    } catch (const std::exception &e) {
-      get_logger()->error("Server: send reply failed: {}", e.what());
+auto basic_server::settle(settlement owed, std::size_t send_offset) -> cppcoro::task<void> {
+  switch (owed.what) {
+    case settlement::kind::none:
+      break;
+    case settlement::kind::reply: {
+      auto *header =
+          reinterpret_cast<detail::RpcHeader *>(send_buffer_pool_.data() + send_offset);
+      header->credits += 1 + pending_credits_.exchange(0, std::memory_order_acq_rel);
+      try {
+        co_await transport_->send(send_offset, owed.reply_len);
+      } catch (const std::exception &e) {
+        COVERBS_RPC_LOG_ERROR("Server: send reply failed: {}", e.what());
+        disconnect(e.what());
+      }
+      break;
+    }
+    case settlement::kind::credit:
+      // Nothing goes back for a one-way request, so its credit rides on a later reply. Flush
+      // them explicitly once a batch piles up, in case the client only sends one-way calls.
+      if (pending_credits_.fetch_add(1, std::memory_order_acq_rel) + 1 >= credit_batch_) {
+        if (uint32_t credits = pending_credits_.exchange(0, std::memory_order_acq_rel)) {
+          co_await return_credits(send_offset, credits);
+        }
+      }
+      break;
+    case settlement::kind::stream_credit: {
+      bool returned = false;
+      {
+        std::scoped_lock lock(streams_mutex_);
+        if (auto it = streams_.find(owed.req_id); it != streams_.end()) {
+          it->second->returned_credits.fetch_add(1, std::memory_order_acq_rel);
+          returned = true;
+        }
+      }
+      if (!returned) {
+        co_await return_credits(send_offset, 1);
+      }
+      break;
+    }
+  }
+}
+
+auto basic_server::overloaded(int64_t recv_ns) noexcept -> bool {
+  return shedder_ && shedder_->overloaded(steady_time(recv_ns));
+}
+
+auto basic_server::reject(detail::RpcHeader const &header, std::size_t send_offset)
+    -> settlement {
+  static detail::rate_limit limit;
+  COVERBS_RPC_LOG_WARN(limit, "Server: overloaded, shedding fn_id={}", header.fn_id);
+  if (metrics_) {
+    metrics_->record(rpc_metrics::sample{
+        .fn_id = header.fn_id, .error = true, .req_bytes = header.payload_len});
+  }
+
+  if (header.flags & detail::kFlagOneWay) {
+    // Nobody waits for a one-way call, it is dropped and only its credit goes back.
+    return settlement{.what = settlement::kind::credit};
+  }
+
+  auto *resp_header = reinterpret_cast<detail::RpcHeader *>(send_buffer_pool_.data() + send_offset);
+  resp_header->req_id = header.req_id;
+  resp_header->payload_len = 0;
+  resp_header->fn_id = header.fn_id;
+  resp_header->flags = detail::kFlagOverloaded;
+  resp_header->credits = 0;
+  return settlement{.what = settlement::kind::reply, .reply_len = sizeof(detail::RpcHeader)};
+}
+
+template <typename Dispatch>
+auto basic_server::dispatch_recorded(detail::RpcHeader const &header, int64_t recv_ns,
+                                     int64_t start_ns, Dispatch &&dispatch) -> std::size_t {
+  if (!metrics_) {
+    return dispatch();
+  }
+  rpc_metrics::sample sample{.fn_id = header.fn_id,
+                             .req_bytes = header.payload_len,
+                             .queue_ns = start_ns - recv_ns};
+  try {
+    std::size_t resp_len = dispatch();
+    sample.resp_bytes = resp_len;
+    sample.handler_ns = now_ns() - start_ns;
+    metrics_->record(sample);
+    return resp_len;
+  } catch (...) {
+    sample.error = true;
+    sample.handler_ns = now_ns() - start_ns;
+    metrics_->record(sample);
+    throw;
+  }
+}
+
+auto basic_server::serve_stream(detail::RpcHeader header, std::span<std::byte> payload,
+                                std::size_t send_offset) -> cppcoro::task<settlement> {
+  stream_state state;
+  state.credits.store(std::max<uint32_t>(header.credits, 1), std::memory_order_relaxed);
+  {
+    std::scoped_lock lock(streams_mutex_);
+    streams_[header.req_id] = &state;
+  }
+
+  auto *resp_header = reinterpret_cast<detail::RpcHeader *>(send_buffer_pool_.data() + send_offset);
+  auto const resp_payload_span = std::span<std::byte>(
+      send_buffer_pool_.data() + send_offset + sizeof(detail::RpcHeader), config_.max_resp_payload);
+  resp_header->req_id = header.req_id;
+  resp_header->fn_id = header.fn_id;
+
+  try {
+    auto chunks = mux_.dispatch_stream(header.fn_id, payload, resp_payload_span);
+    for (auto it = co_await chunks.begin(); it != chunks.end(); co_await ++it) {
+      while (state.credits.load(std::memory_order_acquire) <= 0 &&
+             !state.cancelled.load(std::memory_order_acquire) &&
+             !disconnected_.load(std::memory_order_acquire)) {
+        // set() resumes us under streams_mutex_, hop off before doing anything else.
+        co_await state.credit_event;
+        co_await tp_.schedule();
+      }
+      if (state.cancelled.load(std::memory_order_acquire) ||
+          disconnected_.load(std::memory_order_acquire)) {
+        break;
+      }
+      state.credits.fetch_sub(1, std::memory_order_acq_rel);
+
+      resp_header->payload_len = static_cast<uint32_t>(*it);
+      resp_header->flags = detail::kFlagStream;
+      resp_header->credits = state.returned_credits.exchange(0, std::memory_order_acq_rel);
+      co_await transport_->send(send_offset, sizeof(detail::RpcHeader) + *it);
+      co_await tp_.schedule();
+    }
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_ERROR("Server: stream fn_id={} failed: {}", header.fn_id, e.what());
+  }
+
+  {
+    std::scoped_lock lock(streams_mutex_);
+    streams_.erase(header.req_id);
+  }
+
+  // The end marker also hands back the credit of the stream request itself, added when the
+  // worker settles it. Nothing adds to returned_credits once the stream is erased.
+  resp_header->payload_len = 0;
+  resp_header->flags = detail::kFlagStream | detail::kFlagStreamEnd;
+  resp_header->credits = state.returned_credits.exchange(0, std::memory_order_acq_rel);
+  co_return settlement{.what = settlement::kind::reply, .reply_len = sizeof(detail::RpcHeader)};
+}
+
+auto basic_server::grant_stream_credits(detail::RpcHeader const &header) -> void {
+  std::scoped_lock lock(streams_mutex_);
+  auto it = streams_.find(header.req_id);
+  if (it == streams_.end()) {
+    static detail::rate_limit limit;
+    COVERBS_RPC_LOG_DEBUG(limit, "Server: credits for finished stream: req_id={}", header.req_id);
+    return;
+  }
+  if (header.flags & detail::kFlagCancel) {
+    it->second->cancelled.store(true, std::memory_order_release);
+  }
+  it->second->credits.fetch_add(header.credits, std::memory_order_acq_rel);
+  it->second->credit_event.set();
+}
+
+auto basic_server::return_credits(std::size_t send_offset, uint32_t credits)
+    -> cppcoro::task<void> {
+  auto *header = reinterpret_cast<detail::RpcHeader *>(send_buffer_pool_.data() + send_offset);
+  header->req_id = 0;
+  header->payload_len = 0;
+  header->fn_id = 0;
+  header->flags = detail::kFlagCredit;
+  header->credits = credits;
+  try {
+    co_await transport_->send(send_offset, sizeof(detail::RpcHeader));
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_ERROR("Server: return credits failed: {}", e.what());
+    disconnect(e.what());
+  }
+}
+
+auto basic_server::answer_close(std::size_t send_offset) -> cppcoro::task<void> {
+  // Clients without a hello are assumed to be configured like the server.
+  uint32_t const receives = detail::parse_credit_hello(transport_->peer_data())
+                                .value_or(detail::client_receives(config_));
+  auto *header = reinterpret_cast<detail::RpcHeader *>(send_buffer_pool_.data() + send_offset);
+  header->req_id = 0;
+  header->payload_len = 0;
+  header->fn_id = 0;
+  header->flags = detail::kFlagClose;
+  header->credits = 0;
+  try {
+    for (uint32_t i = 0; i < receives; ++i) {
+      co_await transport_->send(send_offset, sizeof(detail::RpcHeader));
     }
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_ERROR("Server: answering close failed: {}", e.what());
+  }
+}
+
+auto basic_server::disconnect(std::string_view reason) noexcept -> void {
+  if (disconnected_.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  COVERBS_RPC_LOG_INFO("Server: connection closed: {}", reason);
+  transport_->shutdown();
+  std::scoped_lock lock(streams_mutex_);
+  for (auto &[req_id, state] : streams_) {
+    state->cancelled.store(true, std::memory_order_release);
+    state->credit_event.set();
   }
 }
 
@@ -0,0 +1,144 @@
+#include "coverbs_rpc/client_pool.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cppcoro/shared_task.hpp>
+#include <format>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace coverbs_rpc {
+
+struct client_pool::impl {
+  struct entry {
+    std::shared_ptr<typed_client> client;
+    // Set while connecting, until `client` is.
+    std::optional<cppcoro::shared_task<std::shared_ptr<typed_client>>> connecting;
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  impl(cppcoro::io_service &io_service, rdma_context *context, TypedRpcConfig config,
+       options opts)
+      : io_service(io_service)
+      , context(context)
+      , config(config)
+      , opts(opts)
+      , reaper([this](std::stop_token stop) { run_reaper(stop); }) {}
+
+  auto connect(std::string hostname, uint16_t port)
+      -> cppcoro::shared_task<std::shared_ptr<typed_client>> {
+    if (context != nullptr) {
+      co_return co_await typed_client::connect(*context, std::move(hostname), port, config);
+    }
+    co_return co_await typed_client::connect(io_service, std::move(hostname), port, config);
+  }
+
+  auto reap_idle() -> std::size_t {
+    // Closing a client waits for its server, so it is done outside the lock.
+    std::vector<std::shared_ptr<typed_client>> idle;
+    {
+      auto const now = std::chrono::steady_clock::now();
+      std::scoped_lock lock(mutex);
+      for (auto it = entries.begin(); it != entries.end();) {
+        entry &e = it->second;
+        if (!e.client || e.client.use_count() > 1 || now - e.last_used < opts.idle_timeout) {
+          ++it;
+          continue;
+        }
+        COVERBS_RPC_LOG_DEBUG("Pool: closing idle client of {}", it->first);
+        idle.push_back(std::move(e.client));
+        it = entries.erase(it);
+      }
+    }
+    return idle.size();
+  }
+
+  auto run_reaper(std::stop_token stop) -> void {
+    auto const interval = std::clamp<std::chrono::nanoseconds>(
+        opts.idle_timeout / 4, std::chrono::milliseconds(10), std::chrono::seconds(1));
+    std::mutex wait_mutex;
+    std::condition_variable_any cv;
+    std::unique_lock lock(wait_mutex);
+    while (!cv.wait_for(lock, stop, interval, [&stop] { return stop.stop_requested(); })) {
+      reap_idle();
+    }
+  }
+
+  cppcoro::io_service &io_service;
+  rdma_context *const context;
+  TypedRpcConfig const config;
+  options const opts;
+
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, entry> entries;
+
+  // Declared last so it is stopped before the clients are closed.
+  std::jthread reaper;
+};
+
+client_pool::client_pool(cppcoro::io_service &io_service, TypedRpcConfig config, options opts)
+    : impl_(std::make_unique<impl>(io_service, nullptr, config, opts)) {}
+
+client_pool::client_pool(cppcoro::io_service &io_service, TypedRpcConfig config)
+    : client_pool(io_service, config, options{}) {}
+
+client_pool::client_pool(rdma_context &context, TypedRpcConfig config, options opts)
+    : impl_(std::make_unique<impl>(context.io_service(), &context, config, opts)) {}
+
+client_pool::client_pool(rdma_context &context, TypedRpcConfig config)
+    : client_pool(context, config, options{}) {}
+
+client_pool::~client_pool() = default;
+
+auto client_pool::get(std::string hostname, uint16_t port)
+    -> cppcoro::task<std::shared_ptr<typed_client>> {
+  auto key = std::format("{}:{}", hostname, port);
+  cppcoro::shared_task<std::shared_ptr<typed_client>> connecting;
+  {
+    std::scoped_lock lock(impl_->mutex);
+    auto &e = impl_->entries[key];
+    e.last_used = std::chrono::steady_clock::now();
+    if (e.client) {
+      co_return e.client;
+    }
+    if (!e.connecting) {
+      e.connecting = impl_->connect(std::move(hostname), port);
+    }
+    connecting = *e.connecting;
+  }
+
+  std::shared_ptr<typed_client> client;
+  try {
+    client = co_await connecting;
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_WARN("Pool: connecting to {} failed: {}", key, e.what());
+    std::scoped_lock lock(impl_->mutex);
+    auto it = impl_->entries.find(key);
+    if (it != impl_->entries.end() && it->second.connecting == connecting) {
+      impl_->entries.erase(it);
+    }
+    throw;
+  }
+
+  std::scoped_lock lock(impl_->mutex);
+  auto it = impl_->entries.find(key);
+  if (it != impl_->entries.end() && it->second.connecting == connecting) {
+    it->second.client = client;
+    it->second.connecting.reset();
+  }
+  co_return client;
+}
+
+auto client_pool::reap_idle() -> std::size_t { return impl_->reap_idle(); }
+
+auto client_pool::size() const -> std::size_t {
+  std::scoped_lock lock(impl_->mutex);
+  return impl_->entries.size();
+}
+
+} // namespace coverbs_rpc
@@ -11,8 +11,6 @@
 
 namespace coverbs_rpc {
 
-using detail::get_logger;
-
 static auto config_socket(cppcoro::net::socket &socket) {
   int fd = socket.native_handle();
   int opt = 1;
@@ -29,67 +27,95 @@ qp_acceptor::qp_acceptor(cppcoro::io_service &io_service, uint16_t port, std::sh
     , port_(port)
     , io_service_(io_service)
     , config_(std::move(config)) {
+  if (config_.qp_pool_size > 0) {
+    qp_pool_ = std::make_unique<qp_pool>(
+        pd_, srq_, [this] { return cqs_for_qp(); }, config_.qp_config, config_.qp_pool_size);
+  }
   try {
     config_socket(acceptor_socket_);
     acceptor_socket_.bind(cppcoro::net::ipv4_endpoint(cppcoro::net::ipv4_address(), port));
     acceptor_socket_.listen();
-    get_logger()->info("qp_acceptor: bind and listen: port={}", port_);
+    COVERBS_RPC_LOG_INFO("qp_acceptor: bind and listen: port={}", port_);
   } catch (std::exception &e) {
-    get_logger()->error("qp_acceptor: failed to bind and listen: error={}", e.what());
+    COVERBS_RPC_LOG_ERROR("qp_acceptor: failed to bind and listen: error={}", e.what());
     std::terminate();
   }
 }
 
-auto qp_acceptor::accept_qp(cppcoro::net::socket &socket, std::shared_ptr<rdmapp::cq> send_cq,
-                            std::shared_ptr<rdmapp::cq> recv_cq)
+auto qp_acceptor::accept_qp(cppcoro::net::socket &socket, std::shared_ptr<qp_t> local_qp)
     -> cppcoro::task<std::shared_ptr<qp_t>> {
   auto remote_qp = co_await recv_qp(socket);
-  auto local_qp =
-      std::make_shared<qp_t>(remote_qp.header.lid, remote_qp.header.qp_num, remote_qp.header.sq_psn,
-                             remote_qp.header.gid, pd_, recv_cq, send_cq, srq_, config_.qp_config);
-  local_qp->user_data() = std::move(remote_qp.user_data);
+  local_qp->rtr(remote_qp.header.lid, remote_qp.header.qp_num, remote_qp.header.sq_psn,
+                remote_qp.header.gid);
+  local_qp->rts();
+  local_qp->user_data().assign(user_data_.begin(), user_data_.end());
   co_await send_qp(*local_qp, socket);
+  local_qp->user_data() = std::move(remote_qp.user_data);
   co_return local_qp;
 }
 
 auto qp_acceptor::accept() -> cppcoro::task<std::shared_ptr<qp_t>> {
+  auto exchange = co_await accept_handshake();
+  co_return co_await std::move(exchange);
+}
+
+auto qp_acceptor::accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<qp_t>>> {
   cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
   co_await acceptor_socket_.accept(socket);
-  co_return co_await accept_qp(socket, alloc_cq(), alloc_cq());
+  co_return exchange_qp(std::move(socket));
+}
+
+auto qp_acceptor::exchange_qp(cppcoro::net::socket socket)
+    -> cppcoro::task<std::shared_ptr<qp_t>> {
+  std::shared_ptr<qp_t> local_qp = qp_pool_ ? qp_pool_->take(config_.qp_config) : nullptr;
+  if (!local_qp) {
+    auto [send_cq, recv_cq] = cqs_for_qp();
+    local_qp = std::make_shared<qp_t>(pd_, send_cq, recv_cq, srq_, config_.qp_config);
+  }
+  co_return co_await with_timeout(io_service_, socket, kHandshakeTimeout,
+                                  accept_qp(socket, std::move(local_qp)));
 }
 
 auto qp_acceptor::accept_multiple(qp_handshake &handshake)
     -> cppcoro::task<std::vector<std::shared_ptr<qp_t>>> {
   cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
   co_await acceptor_socket_.accept(socket);
-  get_logger()->info("qp_acceptor: accept client handshake: remote={}",
-                     socket.remote_endpoint().to_string());
+  COVERBS_RPC_LOG_INFO("qp_acceptor: accept client handshake: remote={}",
+                       socket.remote_endpoint().to_string());
 
   handshake = co_await recv_handshake(socket);
-  get_logger()->info("qp_acceptor: handshake nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
+  COVERBS_RPC_LOG_INFO("qp_acceptor: handshake nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
 
   std::vector<std::shared_ptr<qp_t>> result;
   result.reserve(handshake.nr_qp);
   for (unsigned int i = 0; i < handshake.nr_qp; i++) {
     auto cq = alloc_cq();
-    result.emplace_back(co_await accept_qp(socket, cq, cq));
+    result.emplace_back(
+        co_await accept_qp(socket, std::make_shared<qp_t>(pd_, cq, cq, srq_, config_.qp_config)));
   }
-  get_logger()->info("qp_acceptor: accept nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
+  COVERBS_RPC_LOG_INFO("qp_acceptor: accept nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
   co_return result;
 }
 
 auto qp_acceptor::alloc_cq() -> std::shared_ptr<rdmapp::cq> {
-  auto cq = std::make_shared<rdmapp::cq>(pd_->device_ptr(), config_.cq_size);
-  pollers_.emplace_back(cq);
-  return cq;
+  return cqs_.alloc(pd_->device_ptr(), config_.cq_size);
+}
+
+auto qp_acceptor::cqs_for_qp() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>> {
+  auto send_cq = alloc_cq();
+  return {send_cq, alloc_cq()};
+}
+
+auto qp_acceptor::set_user_data(std::span<const std::byte> data) -> void {
+  user_data_.assign(data.begin(), data.end());
 }
 
 auto qp_acceptor::close() noexcept -> void {
   try {
     acceptor_socket_.close();
-    get_logger()->warn("qp_acceptor: closed");
+    COVERBS_RPC_LOG_WARN("qp_acceptor: closed");
   } catch (std::exception &e) {
-    get_logger()->error("qp_acceptor: error close, msg={}", e.what());
+    COVERBS_RPC_LOG_ERROR("qp_acceptor: error close, msg={}", e.what());
   }
 }
 
@@ -9,26 +9,53 @@
 
 namespace coverbs_rpc {
 
-using detail::get_logger;
-
 qp_connector::qp_connector(cppcoro::io_service &io_service, std::shared_ptr<pd> pd,
                            std::shared_ptr<srq> srq, ConnConfig config)
     : pd_(pd)
     , srq_(srq)
     , io_service_(io_service)
-    , config_(std::move(config)) {}
+    , config_(std::move(config)) {
+  if (config_.qp_pool_size > 0) {
+    qp_pool_ = std::make_unique<qp_pool>(
+        pd_, srq_, [this] { return cqs_for_qp(); }, config_.qp_config, config_.qp_pool_size);
+  }
+}
 
 auto qp_connector::alloc_cq() noexcept -> std::shared_ptr<cq> {
-  auto cq = std::make_shared<rdmapp::cq>(this->pd_->device_ptr(), config_.cq_size);
-  pollers_.emplace_back(cq);
-  return cq;
+  return cqs_.alloc(this->pd_->device_ptr(), config_.cq_size);
+}
+
+auto qp_connector::cqs_for_qp() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>> {
+  if (config_.share_cqs) {
+    return shared_cqs();
+  }
+  auto send_cq = alloc_cq();
+  return {send_cq, alloc_cq()};
+}
+
+auto qp_connector::shared_cqs() -> std::pair<std::shared_ptr<cq>, std::shared_ptr<cq>> {
+  std::scoped_lock lock(cq_mutex_);
+  if (!shared_send_cq_) {
+    shared_send_cq_ = alloc_cq();
+    shared_recv_cq_ = alloc_cq();
+  }
+  return {shared_send_cq_, shared_recv_cq_};
 }
 
-auto qp_connector::from_socket(cppcoro::net::socket &socket, std::span<std::byte const> userdata)
+auto qp_connector::make_qp(rdmapp::qp_config const &qp_config) -> std::shared_ptr<qp_t> {
+  if (qp_pool_) {
+    if (auto qp = qp_pool_->take(qp_config)) {
+      return qp;
+    }
+  }
+  auto [cq1, cq2] = cqs_for_qp();
+  return std::make_shared<qp_t>(this->pd_, cq1, cq2, srq_, qp_config);
+}
+
+auto qp_connector::from_socket(cppcoro::net::socket &socket, std::span<std::byte const> userdata,
+                               rdmapp::qp_config const &qp_config)
     -> cppcoro::task<std::shared_ptr<qp_t>> {
-  auto cq1 = alloc_cq();
-  auto cq2 = alloc_cq();
-  auto qp_ptr = std::make_shared<qp_t>(this->pd_, cq1, cq2, srq_, config_.qp_config);
+  auto qp_ptr = make_qp(qp_config);
   qp_ptr->user_data().assign(userdata.begin(), userdata.end());
   co_await send_qp(*qp_ptr, socket);
 
@@ -36,17 +63,23 @@ auto qp_connector::from_socket(cppcoro::net::socket &socket, std::span<std::byte
 
   qp_ptr->rtr(remote_qp.header.lid, remote_qp.header.qp_num, remote_qp.header.sq_psn,
               remote_qp.header.gid);
-  get_logger()->trace("qp: rtr");
+  COVERBS_RPC_LOG_TRACE("qp: rtr");
   qp_ptr->user_data() = std::move(remote_qp.user_data);
-  get_logger()->trace("qp: user_data: size={}", qp_ptr->user_data().size());
+  COVERBS_RPC_LOG_TRACE("qp: user_data: size={}", qp_ptr->user_data().size());
   qp_ptr->rts();
-  get_logger()->trace("qp: rts");
+  COVERBS_RPC_LOG_TRACE("qp: rts");
   co_return qp_ptr;
 }
 
 auto qp_connector::connect(std::string_view hostname, uint16_t port,
                            std::span<const std::byte> userdata)
     -> cppcoro::task<std::shared_ptr<qp_t>> {
+  co_return co_await connect(hostname, port, userdata, config_.qp_config);
+}
+
+auto qp_connector::connect(std::string_view hostname, uint16_t port,
+                           std::span<const std::byte> userdata, rdmapp::qp_config const &qp_config)
+    -> cppcoro::task<std::shared_ptr<qp_t>> {
   auto addr = cppcoro::net::ipv4_address::from_string(hostname);
   if (!addr) {
     throw std::runtime_error("failed to parse hostname as ipv4 address");
@@ -55,9 +88,9 @@ auto qp_connector::connect(std::string_view hostname, uint16_t port,
   cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
   co_await socket.connect(cppcoro::net::ipv4_endpoint(*addr, port));
 
-  get_logger()->info("connector: tcp connected to: {}:{}", hostname, port);
-  auto qp = co_await from_socket(socket, userdata);
-  get_logger()->info("connector: created qp from tcp connection");
+  COVERBS_RPC_LOG_INFO("connector: tcp connected to: {}:{}", hostname, port);
+  auto qp = co_await from_socket(socket, userdata, qp_config);
+  COVERBS_RPC_LOG_INFO("connector: created qp from tcp connection");
   co_return qp;
 }
 
@@ -71,17 +104,27 @@ auto qp_connector::connect(std::string_view hostname, uint16_t port, qp_handshak
   cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
   co_await socket.connect(cppcoro::net::ipv4_endpoint(*addr, port));
 
-  get_logger()->info("connector: tcp connected to: {}:{}", hostname, port);
+  COVERBS_RPC_LOG_INFO("connector: tcp connected to: {}:{}", hostname, port);
 
   co_await send_handshake(handshake, socket);
-  get_logger()->debug("connector: sent handshake");
+  COVERBS_RPC_LOG_DEBUG("connector: sent handshake");
 
+  // All qps go out before any reply is read. The acceptor answers them in order as they come
+  // in, so the exchange takes one round trip rather than one per qp.
   std::vector<std::shared_ptr<qp_t>> result;
   result.reserve(handshake.nr_qp);
   for (unsigned int i = 0; i < handshake.nr_qp; i++) {
-    result.emplace_back(co_await from_socket(socket, {}));
+    auto &qp = result.emplace_back(make_qp(config_.qp_config));
+    co_await send_qp(*qp, socket);
+  }
+  for (auto &qp : result) {
+    auto remote_qp = co_await recv_qp(socket);
+    qp->rtr(remote_qp.header.lid, remote_qp.header.qp_num, remote_qp.header.sq_psn,
+            remote_qp.header.gid);
+    qp->user_data() = std::move(remote_qp.user_data);
+    qp->rts();
   }
-  get_logger()->info("connector: connect with nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
+  COVERBS_RPC_LOG_INFO("connector: connect with nr_qp={} sid={}", handshake.nr_qp, handshake.sid);
   co_return result;
 }
 
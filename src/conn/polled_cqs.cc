@@ -0,0 +1,68 @@
+#include "coverbs_rpc/conn/polled_cqs.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+
+namespace coverbs_rpc {
+
+polled_cqs::polled_cqs()
+    : state_(std::make_shared<state>())
+    , reclaimer_([this](std::stop_token stop) { reclaim(std::move(stop)); }) {}
+
+polled_cqs::~polled_cqs() {
+  reclaimer_.request_stop();
+  reclaimer_.join();
+  std::list<entry> remaining;
+  {
+    std::scoped_lock lock(state_->mutex);
+    state_->closed = true;
+    remaining.splice(remaining.end(), state_->entries);
+    remaining.splice(remaining.end(), state_->unused);
+  }
+}
+
+auto polled_cqs::alloc(std::shared_ptr<rdmapp::device> device, uint32_t cq_size)
+    -> std::shared_ptr<rdmapp::cq> {
+  auto cq = std::make_shared<rdmapp::cq>(std::move(device), cq_size);
+  std::list<entry>::iterator it;
+  {
+    std::scoped_lock lock(state_->mutex);
+    it = state_->entries.emplace(state_->entries.end(), cq);
+  }
+  // Users get their own reference, whose release hands the poller to the reclaimer. The
+  // poller's copy keeps the CQ itself alive until the poller is stopped.
+  return std::shared_ptr<rdmapp::cq>(
+      cq.get(), [cq, it, weak = std::weak_ptr<state>(state_)](rdmapp::cq *) {
+        auto s = weak.lock();
+        if (!s) {
+          return;
+        }
+        {
+          std::scoped_lock lock(s->mutex);
+          if (s->closed) {
+            return;
+          }
+          s->unused.splice(s->unused.end(), s->entries, it);
+        }
+        s->unused_cv.notify_one();
+      });
+}
+
+auto polled_cqs::reclaim(std::stop_token stop) -> void {
+  while (true) {
+    std::list<entry> unused;
+    {
+      std::unique_lock lock(state_->mutex);
+      if (!state_->unused_cv.wait(lock, stop, [this] { return !state_->unused.empty(); })) {
+        return;
+      }
+      unused.splice(unused.end(), state_->unused);
+    }
+    COVERBS_RPC_LOG_DEBUG("polled_cqs: stopping {} pollers of unused CQs", unused.size());
+  }
+}
+
+auto polled_cqs::size() const -> std::size_t {
+  std::scoped_lock lock(state_->mutex);
+  return state_->entries.size() + state_->unused.size();
+}
+
+} // namespace coverbs_rpc
@@ -0,0 +1,110 @@
+#include "coverbs_rpc/conn/qp_pool.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <concepts>
+#include <cstring>
+#include <exception>
+#include <type_traits>
+
+namespace coverbs_rpc {
+
+namespace {
+
+// Every field counts, a qp handed to a connection that wanted different limits may overrun
+// them. Without an operator== the bytes are compared, which padding can at worst turn into a
+// miss, never into a match.
+template <typename Config>
+auto same_qp_config(Config const &a, Config const &b) noexcept -> bool {
+  if constexpr (std::equality_comparable<Config>) {
+    return a == b;
+  } else {
+    static_assert(std::is_trivially_copyable_v<Config>);
+    return std::memcmp(&a, &b, sizeof(Config)) == 0;
+  }
+}
+
+} // namespace
+
+qp_pool::qp_pool(std::shared_ptr<rdmapp::pd> pd, std::shared_ptr<rdmapp::srq> srq,
+                 cq_factory cqs, rdmapp::qp_config const &config, std::size_t size)
+    : pd_(std::move(pd))
+    , srq_(std::move(srq))
+    , cqs_(std::move(cqs))
+    , size_(size)
+    , config_(config)
+    , thread_([this](std::stop_token stop) { run(stop); }) {}
+
+qp_pool::~qp_pool() = default;
+
+auto qp_pool::take(rdmapp::qp_config const &config) -> std::shared_ptr<qp_t> {
+  std::shared_ptr<qp_t> qp;
+  {
+    std::scoped_lock lock(mutex_);
+    auto it = std::ranges::find_if(
+        qps_, [&](pooled const &p) { return same_qp_config(p.config, config); });
+    if (it != qps_.end()) {
+      qp = std::move(it->qp);
+      qps_.erase(it);
+    }
+    config_ = config;
+  }
+  cv_.notify_one();
+  if (!qp) {
+    static detail::rate_limit limit;
+    COVERBS_RPC_LOG_DEBUG(limit, "qp_pool: no qp ready, creating one on the spot");
+  }
+  return qp;
+}
+
+auto qp_pool::ready() const -> std::size_t {
+  return static_cast<std::size_t>(std::ranges::count_if(
+      qps_, [this](pooled const &p) { return same_qp_config(p.config, config_); }));
+}
+
+auto qp_pool::run(std::stop_token stop) -> void {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait(lock, stop, [this] { return ready() < size_; });
+    if (stop.stop_requested()) {
+      return;
+    }
+    auto const config = config_;
+    lock.unlock();
+    std::shared_ptr<qp_t> qp;
+    try {
+      auto [cq1, cq2] = cqs_();
+      qp = std::make_shared<qp_t>(pd_, cq1, cq2, srq_, config);
+    } catch (const std::exception &e) {
+      COVERBS_RPC_LOG_ERROR("qp_pool: creating a qp failed: {}", e.what());
+      lock.lock();
+      // Retry later rather than spin on a device that is out of resources.
+      cv_.wait_for(lock, stop, std::chrono::seconds(1), [] { return false; });
+      continue;
+    }
+    std::shared_ptr<qp_t> evicted;
+    lock.lock();
+    // A take() may have switched the config meanwhile.
+    if (!same_qp_config(config, config_)) {
+      lock.unlock();
+      qp.reset();
+      lock.lock();
+      continue;
+    }
+    if (qps_.size() >= size_) {
+      // Full with qps of other configs, the oldest of them makes room.
+      auto it = std::ranges::find_if(
+          qps_, [this](pooled const &p) { return !same_qp_config(p.config, config_); });
+      evicted = std::move(it->qp);
+      qps_.erase(it);
+    }
+    qps_.push_back(pooled{.config = config, .qp = std::move(qp)});
+    // Destroying a qp takes verbs calls as well, not to be made under the lock.
+    lock.unlock();
+    evicted.reset();
+    lock.lock();
+  }
+}
+
+} // namespace coverbs_rpc
@@ -5,10 +5,12 @@
 #include <cassert>
 #include <cppcoro/net/socket.hpp>
 #include <cppcoro/task.hpp>
+#include <cstdint>
 #include <span>
+#include <stdexcept>
+#include <vector>
 
 namespace coverbs_rpc {
-using detail::get_logger;
 
 namespace {
 
@@ -33,6 +35,9 @@ auto read_exactly(cppcoro::net::socket &socket, std::span<std::byte> buffer)
   }
 }
 
+// Anything longer is a peer speaking some other protocol.
+constexpr uint32_t kMaxBlobSize = 1 << 20;
+
 } // namespace
 
 auto send_handshake(qp_handshake const &handshake, cppcoro::net::socket &socket)
@@ -50,7 +55,7 @@ auto send_qp(rdmapp::qp const &qp, cppcoro::net::socket &socket) -> cppcoro::tas
   auto local_qp_data = qp.serialize();
   assert(!local_qp_data.empty());
   co_await write_exactly(socket, std::as_bytes(std::span{local_qp_data}));
-  get_logger()->debug("send qp: bytes={}", local_qp_data.size());
+  COVERBS_RPC_LOG_DEBUG("send qp: bytes={}", local_qp_data.size());
 }
 
 auto recv_qp(cppcoro::net::socket &socket) -> cppcoro::task<rdmapp::deserialized_qp> {
@@ -58,17 +63,38 @@ auto recv_qp(cppcoro::net::socket &socket) -> cppcoro::task<rdmapp::deserialized
   co_await read_exactly(socket, header_buffer);
 
   auto remote_qp = rdmapp::deserialized_qp::deserialize(header_buffer.data());
-  auto const remote_gid_str = rdmapp::device::gid_hex_string(remote_qp.header.gid);
-  get_logger()->debug("received header gid={} lid={} qpn={} psn={} user_data_size={}",
-                      remote_gid_str.c_str(), remote_qp.header.lid, remote_qp.header.qp_num,
-                      remote_qp.header.sq_psn, remote_qp.header.user_data_size);
+  COVERBS_RPC_LOG_DEBUG("received header gid={} lid={} qpn={} psn={} user_data_size={}",
+                        rdmapp::device::gid_hex_string(remote_qp.header.gid),
+                        remote_qp.header.lid, remote_qp.header.qp_num, remote_qp.header.sq_psn,
+                        remote_qp.header.user_data_size);
 
   remote_qp.user_data.resize(remote_qp.header.user_data_size);
   if (remote_qp.header.user_data_size > 0) {
     co_await read_exactly(socket, std::as_writable_bytes(std::span{remote_qp.user_data}));
   }
-  get_logger()->debug("received user data: bytes={}", remote_qp.header.user_data_size);
+  COVERBS_RPC_LOG_DEBUG("received user data: bytes={}", remote_qp.header.user_data_size);
   co_return remote_qp;
 }
 
+auto send_blob(std::span<const std::byte> blob, cppcoro::net::socket &socket)
+    -> cppcoro::task<void> {
+  if (blob.size() > kMaxBlobSize) {
+    throw std::runtime_error("blob too large");
+  }
+  uint32_t const size = static_cast<uint32_t>(blob.size());
+  co_await write_exactly(socket, std::as_bytes(std::span{&size, 1}));
+  co_await write_exactly(socket, blob);
+}
+
+auto recv_blob(cppcoro::net::socket &socket) -> cppcoro::task<std::vector<std::byte>> {
+  uint32_t size = 0;
+  co_await read_exactly(socket, std::as_writable_bytes(std::span{&size, 1}));
+  if (size > kMaxBlobSize) {
+    throw std::runtime_error("blob too large");
+  }
+  std::vector<std::byte> blob(size);
+  co_await read_exactly(socket, blob);
+  co_return blob;
+}
+
 } // namespace coverbs_rpc
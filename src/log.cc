@@ -5,4 +5,6 @@ namespace coverbs_rpc {
 
 void set_log_level(log_level level) { detail::get_logger()->set_level(level); }
 
+void set_log_sink(log_sink sink) { detail::get_logger()->set_sink(sink); }
+
 } // namespace coverbs_rpc
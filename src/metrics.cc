@@ -0,0 +1,207 @@
+#include "coverbs_rpc/metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace coverbs_rpc {
+
+namespace {
+
+std::atomic<uint64_t> next_metrics_id{1};
+
+// Registries are numbered densely so that a thread finds its shard by index. The numbers of
+// destroyed registries are handed out again, which keeps the per-thread caches as small as the
+// most registries ever alive at once.
+class registry_indices {
+public:
+  static auto instance() -> registry_indices & {
+    // Never destroyed, registries with static storage may outlive it otherwise.
+    static auto *indices = new registry_indices;
+    return *indices;
+  }
+
+  auto acquire() -> uint32_t {
+    std::scoped_lock lock(mutex_);
+    if (free_.empty()) {
+      return next_++;
+    }
+    uint32_t const index = free_.back();
+    free_.pop_back();
+    return index;
+  }
+
+  auto release(uint32_t index) -> void {
+    std::scoped_lock lock(mutex_);
+    free_.push_back(index);
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<uint32_t> free_;
+  uint32_t next_ = 0;
+};
+
+// Shards have a single writer, so a relaxed load and store is enough and cheaper than an RMW.
+auto bump(std::atomic<uint64_t> &counter, uint64_t n) noexcept -> void {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct atomic_histogram {
+  std::array<std::atomic<uint64_t>, metrics_histogram::kBucketCount> counts{};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> min{std::numeric_limits<uint64_t>::max()};
+  std::atomic<uint64_t> max{0};
+
+  auto record(int64_t ns) noexcept -> void {
+    if (ns < 0) {
+      return;
+    }
+    auto const value = static_cast<uint64_t>(ns);
+    bump(counts[metrics_histogram::index_of(value)], 1);
+    bump(sum, value);
+    if (value < min.load(std::memory_order_relaxed)) {
+      min.store(value, std::memory_order_relaxed);
+    }
+    if (value > max.load(std::memory_order_relaxed)) {
+      max.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  auto load() const -> metrics_histogram {
+    std::vector<uint64_t> snapshot(counts.size());
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+      snapshot[i] = counts[i].load(std::memory_order_relaxed);
+    }
+    return metrics_histogram(std::move(snapshot), sum.load(std::memory_order_relaxed),
+                             min.load(std::memory_order_relaxed),
+                             max.load(std::memory_order_relaxed));
+  }
+};
+
+struct atomic_fn_metrics {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> req_bytes{0};
+  std::atomic<uint64_t> resp_bytes{0};
+  atomic_histogram slot_wait_ns;
+  atomic_histogram wire_ns;
+  atomic_histogram queue_ns;
+  atomic_histogram handler_ns;
+
+  auto record(const rpc_metrics::sample &s) noexcept -> void {
+    bump(calls, 1);
+    bump(errors, s.error ? 1 : 0);
+    bump(req_bytes, s.req_bytes);
+    bump(resp_bytes, s.resp_bytes);
+    slot_wait_ns.record(s.slot_wait_ns);
+    wire_ns.record(s.wire_ns);
+    queue_ns.record(s.queue_ns);
+    handler_ns.record(s.handler_ns);
+  }
+
+  auto load() const -> fn_metrics {
+    return fn_metrics{
+        .calls = calls.load(std::memory_order_relaxed),
+        .errors = errors.load(std::memory_order_relaxed),
+        .req_bytes = req_bytes.load(std::memory_order_relaxed),
+        .resp_bytes = resp_bytes.load(std::memory_order_relaxed),
+        .slot_wait_ns = slot_wait_ns.load(),
+        .wire_ns = wire_ns.load(),
+        .queue_ns = queue_ns.load(),
+        .handler_ns = handler_ns.load(),
+    };
+  }
+};
+
+} // namespace
+
+struct rpc_metrics::shard {
+  // Only taken to add a fn_id and by snapshots; the owning thread looks fn_ids up without it.
+  std::mutex mutex;
+  std::vector<std::pair<uint32_t, std::unique_ptr<atomic_fn_metrics>>> fns;
+  std::size_t last_hit{0};
+
+  auto find(uint32_t fn_id) -> atomic_fn_metrics & {
+    if (last_hit < fns.size() && fns[last_hit].first == fn_id) [[likely]] {
+      return *fns[last_hit].second;
+    }
+    for (std::size_t i = 0; i < fns.size(); ++i) {
+      if (fns[i].first == fn_id) {
+        last_hit = i;
+        return *fns[i].second;
+      }
+    }
+    std::scoped_lock lock(mutex);
+    fns.emplace_back(fn_id, std::make_unique<atomic_fn_metrics>());
+    last_hit = fns.size() - 1;
+    return *fns.back().second;
+  }
+};
+
+auto fn_metrics::merge(const fn_metrics &other) -> void {
+  calls += other.calls;
+  errors += other.errors;
+  req_bytes += other.req_bytes;
+  resp_bytes += other.resp_bytes;
+  slot_wait_ns.merge(other.slot_wait_ns);
+  wire_ns.merge(other.wire_ns);
+  queue_ns.merge(other.queue_ns);
+  handler_ns.merge(other.handler_ns);
+}
+
+auto metrics_snapshot::merge(const metrics_snapshot &other) -> void {
+  for (auto const &[fn_id, stats] : other.by_fn) {
+    by_fn[fn_id].merge(stats);
+  }
+}
+
+auto metrics_snapshot::total() const -> fn_metrics {
+  fn_metrics sum;
+  for (auto const &[fn_id, stats] : by_fn) {
+    sum.merge(stats);
+  }
+  return sum;
+}
+
+rpc_metrics::rpc_metrics()
+    : id_(next_metrics_id.fetch_add(1, std::memory_order_relaxed))
+    , index_(registry_indices::instance().acquire()) {}
+
+rpc_metrics::~rpc_metrics() { registry_indices::instance().release(index_); }
+
+auto rpc_metrics::local_shard() -> shard & {
+  // An entry left by a destroyed registry is replaced once its index is reused, the id tells
+  // the two apart.
+  thread_local std::vector<std::pair<uint64_t, shard *>> cache;
+  if (index_ < cache.size() && cache[index_].first == id_) [[likely]] {
+    return *cache[index_].second;
+  }
+  std::scoped_lock lock(shards_mutex_);
+  shards_.push_back(std::make_unique<shard>());
+  if (index_ >= cache.size()) {
+    cache.resize(index_ + 1);
+  }
+  cache[index_] = {id_, shards_.back().get()};
+  return *shards_.back();
+}
+
+auto rpc_metrics::record(const sample &s) -> void { local_shard().find(s.fn_id).record(s); }
+
+auto rpc_metrics::snapshot() const -> metrics_snapshot {
+  metrics_snapshot result;
+  std::scoped_lock lock(shards_mutex_);
+  for (auto const &s : shards_) {
+    std::scoped_lock shard_lock(s->mutex);
+    for (auto const &[fn_id, stats] : s->fns) {
+      result.by_fn[fn_id].merge(stats->load());
+    }
+  }
+  return result;
+}
+
+} // namespace coverbs_rpc
@@ -0,0 +1,113 @@
+#include "coverbs_rpc/replica_set.hpp"
+
+#include <algorithm>
+#include <cppcoro/sync_wait.hpp>
+#include <random>
+#include <stdexcept>
+
+namespace coverbs_rpc {
+
+namespace {
+
+// call_hedged() latencies per refresh of the hedge delay.
+constexpr uint64_t kLatencyWindow = 256;
+
+// Hedges are budgeted in thousandths, and at most this many can be saved up for a burst.
+constexpr int64_t kHedgeCost = 1000;
+constexpr int64_t kMaxHedgeBudget = 10 * kHedgeCost;
+
+} // namespace
+
+replica_set::replica_set(std::vector<std::shared_ptr<typed_client>> replicas, options opts)
+    : opts_(opts) {
+  if (replicas.empty()) {
+    throw std::invalid_argument("replica_set: no replicas");
+  }
+  replicas_.reserve(replicas.size());
+  for (auto &client : replicas) {
+    replicas_.push_back(std::make_unique<replica>(std::move(client)));
+  }
+}
+
+replica_set::replica_set(std::vector<std::shared_ptr<typed_client>> replicas)
+    : replica_set(std::move(replicas), options{}) {}
+
+replica_set::~replica_set() { cppcoro::sync_wait(scope_.join()); }
+
+auto replica_set::replica::observe(std::chrono::nanoseconds elapsed) noexcept -> void {
+  int64_t const sample = elapsed.count();
+  int64_t const old = ewma_ns.load(std::memory_order_relaxed);
+  // Concurrent updates may overwrite each other, which only drops a sample.
+  ewma_ns.store(old == 0 ? sample : old + (sample - old) / 8, std::memory_order_relaxed);
+}
+
+auto replica_set::cost(replica const &r) const noexcept -> double {
+  auto const inflight = static_cast<double>(r.client->inflight());
+  if (opts_.policy == balance_policy::least_inflight) {
+    return inflight;
+  }
+  // Replicas without a measurement yet cost nothing, so each gets tried.
+  return static_cast<double>(r.ewma_ns.load(std::memory_order_relaxed)) * (inflight + 1);
+}
+
+auto replica_set::pick(replica const *exclude) noexcept -> replica & {
+  std::size_t const n = replicas_.size();
+  if (n == 1) {
+    return *replicas_[0];
+  }
+  thread_local std::minstd_rand rng{std::random_device{}()};
+  std::size_t a = rng() % n;
+  std::size_t b = (a + 1 + rng() % (n - 1)) % n;
+  if (replicas_[a].get() == exclude) {
+    return *replicas_[b];
+  }
+  if (replicas_[b].get() == exclude) {
+    return *replicas_[a];
+  }
+  return cost(*replicas_[b]) < cost(*replicas_[a]) ? *replicas_[b] : *replicas_[a];
+}
+
+auto replica_set::record_latency(std::chrono::nanoseconds elapsed) -> void {
+  if (opts_.hedge.percentile <= 0) {
+    return;
+  }
+  std::scoped_lock lock(latency_mutex_);
+  latency_window_.record(static_cast<uint64_t>(std::max<int64_t>(elapsed.count(), 0)));
+  if (latency_window_.count() < kLatencyWindow) {
+    return;
+  }
+  // A fresh window each time, so the delay follows the replicas as they speed up or slow down.
+  auto const delay = latency_window_.value_at_percentile(opts_.hedge.percentile);
+  hedge_delay_ns_.store(static_cast<int64_t>(std::max<uint64_t>(delay, 1)),
+                        std::memory_order_relaxed);
+  latency_window_.reset();
+}
+
+auto replica_set::hedge_delay() const noexcept -> std::chrono::nanoseconds {
+  return std::chrono::nanoseconds(hedge_delay_ns_.load(std::memory_order_relaxed));
+}
+
+auto replica_set::earn_hedge_budget() noexcept -> void {
+  auto const earned = static_cast<int64_t>(opts_.hedge.budget * kHedgeCost);
+  if (earned <= 0) {
+    return;
+  }
+  int64_t budget = hedge_budget_.load(std::memory_order_relaxed);
+  while (budget < kMaxHedgeBudget &&
+         !hedge_budget_.compare_exchange_weak(budget, std::min(budget + earned, kMaxHedgeBudget),
+                                              std::memory_order_relaxed)) {
+  }
+}
+
+auto replica_set::take_hedge_budget() noexcept -> bool {
+  int64_t budget = hedge_budget_.load(std::memory_order_relaxed);
+  while (budget >= kHedgeCost) {
+    if (hedge_budget_.compare_exchange_weak(budget, budget - kHedgeCost,
+                                            std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace coverbs_rpc
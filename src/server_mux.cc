@@ -2,25 +2,91 @@
 #include "coverbs_rpc/detail/logger.hpp"
 
 namespace coverbs_rpc {
-using detail::get_logger;
 
-auto basic_mux::register_handler(uint32_t fn_id, std::string_view fn_name, Handler h) -> void {
-  if (handlers_.find(fn_id) != handlers_.end()) [[unlikely]] {
-    get_logger()->critical("server_mux: register the same handler for fn_id {}", fn_id);
+namespace {
+
+auto empty_stream() -> cppcoro::async_generator<std::size_t> { co_return; }
+
+} // namespace
+
+auto basic_mux::check_unique(uint32_t fn_id) const -> void {
+  if (handlers_.contains(fn_id) || stream_handlers_.contains(fn_id) ||
+      oneway_handlers_.contains(fn_id)) [[unlikely]] {
+    COVERBS_RPC_LOG_CRITICAL("server_mux: register the same handler for fn_id {}", fn_id);
     std::terminate();
   }
-  get_logger()->info("server_mux: register: id={} name={}", fn_id, fn_name);
+}
+
+auto basic_mux::set_priority(uint32_t fn_id, rpc_priority priority) -> void {
+  if (priority != rpc_priority::normal) {
+    COVERBS_RPC_LOG_INFO("server_mux: id={} is bulk", fn_id);
+    priorities_[fn_id] = priority;
+  }
+}
+
+auto basic_mux::register_handler(uint32_t fn_id, std::string_view fn_name, Handler h,
+                                 rpc_priority priority) -> void {
+  check_unique(fn_id);
+  COVERBS_RPC_LOG_INFO("server_mux: register: id={} name={}", fn_id, fn_name);
   handlers_[fn_id] = std::move(h);
+  set_priority(fn_id, priority);
+}
+
+auto basic_mux::register_stream_handler(uint32_t fn_id, std::string_view fn_name,
+                                        StreamHandler h, rpc_priority priority) -> void {
+  check_unique(fn_id);
+  COVERBS_RPC_LOG_INFO("server_mux: register stream: id={} name={}", fn_id, fn_name);
+  stream_handlers_[fn_id] = std::move(h);
+  set_priority(fn_id, priority);
+}
+
+auto basic_mux::register_oneway_handler(uint32_t fn_id, std::string_view fn_name,
+                                        OneWayHandler h, rpc_priority priority) -> void {
+  check_unique(fn_id);
+  COVERBS_RPC_LOG_INFO("server_mux: register one-way: id={} name={}", fn_id, fn_name);
+  oneway_handlers_[fn_id] = std::move(h);
+  set_priority(fn_id, priority);
+}
+
+auto basic_mux::priority(uint32_t fn_id) const -> rpc_priority {
+  if (priorities_.empty()) {
+    return rpc_priority::normal;
+  }
+  auto it = priorities_.find(fn_id);
+  return it == priorities_.end() ? rpc_priority::normal : it->second;
 }
 
 auto basic_mux::dispatch(uint32_t fn_id, std::span<std::byte> payload,
                          std::span<std::byte> resp) const -> std::size_t {
   auto it = handlers_.find(fn_id);
   if (it == handlers_.end()) [[unlikely]] {
-    get_logger()->error("server_mux: handler not found for fn_id={}", fn_id);
+    static detail::rate_limit limit;
+    COVERBS_RPC_LOG_ERROR(limit, "server_mux: handler not found for fn_id={}", fn_id);
     return 0;
   }
   return it->second(payload, resp);
 }
 
+auto basic_mux::dispatch_oneway(uint32_t fn_id, std::span<std::byte> payload) const -> void {
+  auto it = oneway_handlers_.find(fn_id);
+  if (it == oneway_handlers_.end()) [[unlikely]] {
+    static detail::rate_limit limit;
+    COVERBS_RPC_LOG_ERROR(limit, "server_mux: one-way handler not found for fn_id={}", fn_id);
+    return;
+  }
+  it->second(payload);
+}
+
+auto basic_mux::dispatch_stream(uint32_t fn_id, std::span<std::byte> payload,
+                                std::span<std::byte> resp) const
+    -> cppcoro::async_generator<std::size_t> {
+  auto it = stream_handlers_.find(fn_id);
+  if (it == stream_handlers_.end()) [[unlikely]] {
+    static detail::rate_limit limit;
+    COVERBS_RPC_LOG_ERROR(limit, "server_mux: stream handler not found for fn_id={}", fn_id);
+    return empty_stream();
+  }
+  return it->second(payload, resp);
+}
+
 } // namespace coverbs_rpc
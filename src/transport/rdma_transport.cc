@@ -0,0 +1,274 @@
+#include "coverbs_rpc/transport/rdma_transport.hpp"
+#include "coverbs_rpc/conn/acceptor.hpp"
+#include "coverbs_rpc/conn/connector.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+
+#include <algorithm>
+#include <array>
+#include <infiniband/verbs.h>
+#include <list>
+#include <mutex>
+#include <rdmapp/device.h>
+#include <rdmapp/pd.h>
+#include <system_error>
+#include <unordered_map>
+
+namespace coverbs_rpc {
+
+/**
+ * Registered memory shared by the connections of an rdma_context. It grows in chunks that are
+ * registered once each and hands out page-aligned buffers. A released buffer goes on a free
+ * list for its size, which is usually the next connection's size as well.
+ */
+class rdma_memory {
+public:
+  rdma_memory(std::shared_ptr<rdmapp::pd> pd, std::size_t chunk_bytes)
+      : pd_(std::move(pd))
+      , chunk_bytes_(chunk_bytes) {}
+
+  auto allocate(std::size_t bytes) -> rdma_buffer {
+    bytes = (std::max<std::size_t>(bytes, 1) + kAlign - 1) / kAlign * kAlign;
+    std::scoped_lock lock(mutex_);
+    if (auto it = free_.find(bytes); it != free_.end() && !it->second.empty()) {
+      auto buffer = it->second.back();
+      it->second.pop_back();
+      return buffer;
+    }
+    if (chunks_.empty() || chunks_.back().size - chunks_.back().used < bytes) {
+      auto &c = chunks_.emplace_back();
+      c.size = std::max(chunk_bytes_, bytes);
+      c.data = std::make_unique_for_overwrite<std::byte[]>(c.size);
+      c.mr.emplace(pd_->reg_mr(c.data.get(), c.size));
+    }
+    auto &c = chunks_.back();
+    rdma_buffer buffer{.bytes = std::span{c.data.get() + c.used, bytes},
+                       .mr = &*c.mr,
+                       .mr_offset = c.used};
+    c.used += bytes;
+    return buffer;
+  }
+
+  auto release(rdma_buffer buffer) -> void {
+    std::scoped_lock lock(mutex_);
+    free_[buffer.bytes.size()].push_back(buffer);
+  }
+
+private:
+  static constexpr std::size_t kAlign = 4096;
+
+  struct chunk {
+    std::unique_ptr<std::byte[]> data;
+    std::size_t size = 0;
+    std::size_t used = 0;
+    std::optional<rdmapp::local_mr> mr;
+  };
+
+  std::shared_ptr<rdmapp::pd> pd_;
+  std::size_t const chunk_bytes_;
+  std::mutex mutex_;
+  // A list, so that buffers can keep pointing at a chunk's mr.
+  std::list<chunk> chunks_;
+  std::unordered_map<std::size_t, std::vector<rdma_buffer>> free_;
+};
+
+struct rdma_context::impl {
+  impl(cppcoro::io_service &io_service, options const &opts)
+      : device(std::make_shared<rdmapp::device>(opts.device_nr, opts.port_nr))
+      , pd(std::make_shared<rdmapp::pd>(device))
+      , memory(std::make_shared<rdma_memory>(pd, opts.chunk_bytes))
+      , connector(io_service, pd, nullptr,
+                  ConnConfig{.cq_size = opts.cq_size,
+                             .qp_config = rdmapp::default_qp_config(),
+                             .share_cqs = true,
+                             .qp_pool_size = opts.qp_pool_size})
+      , io_service(io_service) {}
+
+  std::shared_ptr<rdmapp::device> device;
+  std::shared_ptr<rdmapp::pd> pd;
+  std::shared_ptr<rdma_memory> memory;
+  qp_connector connector;
+  cppcoro::io_service &io_service;
+};
+
+namespace {
+
+auto listener_conn_config(TypedRpcConfig const &config) -> ConnConfig {
+  auto conn_config = config.to_conn_config();
+  conn_config.qp_pool_size = config.qp_pool_size;
+  return conn_config;
+}
+
+class rdma_listener final : public transport_listener {
+public:
+  rdma_listener(cppcoro::io_service &io_service, uint16_t port, TypedRpcConfig const &config,
+                std::span<const std::byte> user_data)
+      : device_(std::make_shared<rdmapp::device>(config.device_nr, config.port_nr))
+      , pd_(std::make_shared<rdmapp::pd>(device_))
+      , acceptor_(io_service, port, pd_, nullptr, listener_conn_config(config)) {
+    acceptor_.set_user_data(user_data);
+  }
+
+  auto accept() -> cppcoro::task<std::shared_ptr<transport>> override {
+    auto qp = co_await acceptor_.accept();
+    co_return std::make_shared<rdma_transport>(std::move(qp));
+  }
+
+  auto accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<transport>>> override {
+    auto exchange = co_await acceptor_.accept_handshake();
+    co_return [](cppcoro::task<std::shared_ptr<qp_acceptor::qp_t>> exchange)
+                  -> cppcoro::task<std::shared_ptr<transport>> {
+      co_return std::make_shared<rdma_transport>(co_await std::move(exchange));
+    }(std::move(exchange));
+  }
+
+  auto close() noexcept -> void override { acceptor_.close(); }
+
+private:
+  std::shared_ptr<rdmapp::device> device_;
+  std::shared_ptr<rdmapp::pd> pd_;
+  qp_acceptor acceptor_;
+};
+
+// Everything a connected qp needs to stay usable, the connector polls its CQs.
+struct rdma_endpoint {
+  rdma_endpoint(cppcoro::io_service &io_service, TypedRpcConfig const &config)
+      : device(std::make_shared<rdmapp::device>(config.device_nr, config.port_nr))
+      , pd(std::make_shared<rdmapp::pd>(device))
+      , connector(io_service, pd, nullptr, config.to_conn_config()) {}
+
+  std::shared_ptr<rdmapp::device> device;
+  std::shared_ptr<rdmapp::pd> pd;
+  qp_connector connector;
+};
+
+} // namespace
+
+rdma_transport::rdma_transport(std::shared_ptr<rdmapp::qp> qp, std::shared_ptr<void> keepalive,
+                               std::shared_ptr<rdma_memory> memory)
+    : keepalive_(std::move(keepalive))
+    , memory_(std::move(memory))
+    , qp_(std::move(qp)) {}
+
+rdma_transport::~rdma_transport() {
+  // The buffers may only be handed out again once no work can be posted to them anymore.
+  qp_.reset();
+  if (memory_ && send_.mr != nullptr) {
+    memory_->release(send_);
+    memory_->release(recv_);
+  }
+}
+
+auto rdma_transport::setup_buffers(std::size_t send_bytes, std::size_t recv_bytes) -> void {
+  ibv_qp_attr attr{};
+  ibv_qp_init_attr init_attr{};
+  if (::ibv_query_qp(qp_->qp(), &attr, IBV_QP_CAP, &init_attr) == 0) {
+    max_send_sge_ = attr.cap.max_send_sge;
+  }
+  if (memory_) {
+    send_ = memory_->allocate(send_bytes);
+    recv_ = memory_->allocate(recv_bytes);
+    return;
+  }
+  send_pool_.resize(send_bytes);
+  send_mr_.emplace(qp_->pd_ptr()->reg_mr(send_pool_.data(), send_pool_.size()));
+  send_ = rdma_buffer{.bytes = send_pool_, .mr = &*send_mr_};
+  recv_pool_.resize(recv_bytes);
+  recv_mr_.emplace(qp_->pd_ptr()->reg_mr(recv_pool_.data(), recv_pool_.size()));
+  recv_ = rdma_buffer{.bytes = recv_pool_, .mr = &*recv_mr_};
+}
+
+auto rdma_transport::send(std::size_t offset, std::size_t len) -> cppcoro::task<void> {
+  // Sends complete in order, so this one also retires the gathered sends posted before it.
+  uint64_t const gathered = gathered_.load(std::memory_order_acquire);
+  co_await qp_->send(rdmapp::mr_view(*send_.mr, send_.mr_offset + offset, len),
+                     rdmapp::use_native_awaitable);
+  uint64_t retired = retired_.load(std::memory_order_acquire);
+  while (retired < gathered &&
+         !retired_.compare_exchange_weak(retired, gathered, std::memory_order_acq_rel)) {
+  }
+}
+
+auto rdma_transport::send_gathered(std::span<const send_part> parts) -> bool {
+  if (parts.size() > std::min<std::size_t>(max_send_sge_, kMaxGatheredSges) ||
+      gathered_.load(std::memory_order_acquire) - retired_.load(std::memory_order_acquire) >=
+          kMaxUnretired) {
+    return false;
+  }
+  std::array<ibv_sge, kMaxGatheredSges> sges;
+  for (std::size_t i = 0; i < parts.size(); ++i) {
+    sges[i] = ibv_sge{.addr = reinterpret_cast<uintptr_t>(parts[i].bytes.data()),
+                      .length = static_cast<uint32_t>(parts[i].bytes.size()),
+                      .lkey = parts[i].lkey.value_or(send_.mr->lkey())};
+  }
+  // Unsignaled, it completes without a work completion for the poller, whose wr_ids are
+  // rdmapp's own.
+  ibv_send_wr wr{};
+  wr.sg_list = sges.data();
+  wr.num_sge = static_cast<int>(parts.size());
+  wr.opcode = IBV_WR_SEND;
+  ibv_send_wr *bad_wr = nullptr;
+  if (int const err = ::ibv_post_send(qp_->qp(), &wr, &bad_wr); err != 0) {
+    throw std::system_error(err, std::generic_category(), "rdma_transport: post gathered send");
+  }
+  gathered_.fetch_add(1, std::memory_order_acq_rel);
+  return true;
+}
+
+auto rdma_transport::recv(std::size_t offset, std::size_t len) -> cppcoro::task<std::size_t> {
+  auto [nbytes, _] = co_await qp_->recv(
+      rdmapp::mr_view(*recv_.mr, recv_.mr_offset + offset, len), rdmapp::use_native_awaitable);
+  co_return nbytes;
+}
+
+auto rdma_transport::peer_data() const noexcept -> std::span<const std::byte> {
+  return qp_->user_data();
+}
+
+auto rdma_transport::shutdown() noexcept -> void {
+  if (shut_down_.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  // A peer that is gone sends nothing, so the receives would never complete otherwise. In the
+  // error state every outstanding work request completes with a flush error instead.
+  ibv_qp_attr attr{};
+  attr.qp_state = IBV_QPS_ERR;
+  if (int const err = ::ibv_modify_qp(qp_->qp(), &attr, IBV_QP_STATE); err != 0) {
+    COVERBS_RPC_LOG_WARN("rdma_transport: failed to move qp to error state: errno={}", err);
+  }
+}
+
+auto make_rdma_listener(cppcoro::io_service &io_service, uint16_t port,
+                        TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener> {
+  return std::make_unique<rdma_listener>(io_service, port, config, user_data);
+}
+
+auto connect_rdma(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                  TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>> {
+  auto endpoint = std::make_shared<rdma_endpoint>(io_service, config);
+  auto qp = co_await endpoint->connector.connect(hostname, port, user_data);
+  co_return std::make_shared<rdma_transport>(std::move(qp), std::move(endpoint));
+}
+
+rdma_context::rdma_context(cppcoro::io_service &io_service, options opts)
+    : impl_(std::make_shared<impl>(io_service, opts)) {}
+
+rdma_context::rdma_context(cppcoro::io_service &io_service)
+    : rdma_context(io_service, options{}) {}
+
+auto rdma_context::connect(std::string_view hostname, uint16_t port, RpcConfig const &config,
+                           std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>> {
+  // Holding impl rather than this lets connections outlive the context object.
+  auto impl = impl_;
+  auto qp = co_await impl->connector.connect(hostname, port, user_data,
+                                             config.to_conn_config().qp_config);
+  co_return std::make_shared<rdma_transport>(std::move(qp), impl, impl->memory);
+}
+
+auto rdma_context::io_service() const noexcept -> cppcoro::io_service & {
+  return impl_->io_service;
+}
+
+} // namespace coverbs_rpc
@@ -0,0 +1,577 @@
+#include "coverbs_rpc/transport/shm_transport.hpp"
+#include "coverbs_rpc/conn/transmission.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/net/ipv4_address.hpp>
+#include <cppcoro/net/ipv4_endpoint.hpp>
+#include <cppcoro/net/socket.hpp>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace coverbs_rpc {
+
+namespace {
+
+constexpr uint64_t kShmMagic = 0x31'4d'48'53'56'4f'43; // "COVSHM1"
+constexpr std::size_t kCacheLine = 64;
+constexpr std::size_t kMinRingBytes = 4096;
+constexpr std::string_view kSegmentPrefix = "/coverbs-";
+// Most receives completed by one pass over the incoming ring.
+constexpr std::size_t kDeliverBatch = 32;
+
+// Every message is a u64 length followed by the payload, padded to 8 bytes so that lengths
+// never wrap around the end of the ring.
+constexpr uint64_t kFrameAlign = sizeof(uint64_t);
+
+constexpr auto frame_size(uint64_t len) noexcept -> uint64_t {
+  return sizeof(uint64_t) + (len + kFrameAlign - 1) / kFrameAlign * kFrameAlign;
+}
+
+struct ring_control {
+  // Both positions only grow, the byte at position p lives at data[p & (ring_bytes - 1)].
+  alignas(kCacheLine) std::atomic<uint64_t> head{0};
+  alignas(kCacheLine) std::atomic<uint64_t> tail{0};
+  // Set by the producer when it goes away.
+  alignas(kCacheLine) std::atomic<uint32_t> closed{0};
+};
+
+// Ring 0 carries messages from the connecting side, ring 1 the replies. The ring data follows
+// the header.
+struct segment_header {
+  uint64_t magic;
+  uint64_t ring_bytes;
+  ring_control rings[2];
+};
+
+// Shared between processes, so the atomics must not fall back to a lock.
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+auto next_segment_id() noexcept -> uint64_t {
+  static std::atomic<uint64_t> next{0};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+auto throw_errno(char const *what) -> void {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+class shm_segment {
+public:
+  static auto create(std::string name, std::size_t ring_bytes) -> std::shared_ptr<shm_segment> {
+    if (!std::has_single_bit(ring_bytes) || ring_bytes < kMinRingBytes) {
+      throw std::runtime_error("shm ring size must be a power of two of at least 4KiB");
+    }
+    int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+      throw_errno("shm_open");
+    }
+    auto segment = std::shared_ptr<shm_segment>(new shm_segment(std::move(name), true));
+    std::size_t const size = sizeof(segment_header) + 2 * ring_bytes;
+    if (::ftruncate(fd, static_cast<off_t>(size)) < 0) {
+      ::close(fd);
+      throw_errno("ftruncate");
+    }
+    segment->map(fd, size);
+    new (segment->addr_) segment_header{.magic = kShmMagic, .ring_bytes = ring_bytes, .rings = {}};
+    return segment;
+  }
+
+  static auto open(std::string name) -> std::shared_ptr<shm_segment> {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      throw_errno("shm_open");
+    }
+    auto segment = std::shared_ptr<shm_segment>(new shm_segment(std::move(name), false));
+    struct stat st {};
+    if (::fstat(fd, &st) < 0) {
+      ::close(fd);
+      throw_errno("fstat");
+    }
+    auto const size = static_cast<std::size_t>(st.st_size);
+    if (size < sizeof(segment_header)) {
+      ::close(fd);
+      throw std::runtime_error("shm segment too small");
+    }
+    segment->map(fd, size);
+    auto const &header = segment->header();
+    if (header.magic != kShmMagic || sizeof(segment_header) + 2 * header.ring_bytes != size) {
+      throw std::runtime_error("not a coverbs shm segment");
+    }
+    return segment;
+  }
+
+  shm_segment(const shm_segment &) = delete;
+  auto operator=(const shm_segment &) -> shm_segment & = delete;
+
+  ~shm_segment() {
+    if (addr_ != nullptr) {
+      ::munmap(addr_, size_);
+    }
+    unlink();
+  }
+
+  // Removes the name once both ends have the segment mapped, the memory lives on until both
+  // unmap it. Only the creator unlinks.
+  auto unlink() noexcept -> void {
+    if (owner_) {
+      ::shm_unlink(name_.c_str());
+      owner_ = false;
+    }
+  }
+
+  auto header() noexcept -> segment_header & { return *static_cast<segment_header *>(addr_); }
+
+  auto ring_data(unsigned ring) noexcept -> std::byte * {
+    return static_cast<std::byte *>(addr_) + sizeof(segment_header) + ring * header().ring_bytes;
+  }
+
+private:
+  shm_segment(std::string name, bool owner)
+      : name_(std::move(name))
+      , owner_(owner) {}
+
+  auto map(int fd, std::size_t size) -> void {
+    void *addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      throw_errno("mmap");
+    }
+    addr_ = addr;
+    size_ = size;
+  }
+
+  std::string name_;
+  bool owner_;
+  void *addr_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// Spins first, since the peer usually answers within microseconds, then backs off so an idle
+// connection does not burn a core.
+auto backoff(unsigned &idle) -> void {
+  constexpr unsigned kSpinRounds = 1024;
+  constexpr unsigned kYieldRounds = kSpinRounds + 64;
+  if (idle < kSpinRounds) {
+    __builtin_ia32_pause();
+  } else if (idle < kYieldRounds) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    return;
+  }
+  ++idle;
+}
+
+/**
+ * One end of a shared-memory connection. Sends copy into the outgoing ring under a lock. While
+ * it is full, which only happens when the ring is smaller than the credits allow, they queue up
+ * suspended. A poller thread copies incoming messages into the posted receives in order, and
+ * writes queued sends once the peer has consumed enough of the outgoing ring, resuming both on
+ * that thread as the CQ pollers do for RDMA. With caller polling there is no such thread and
+ * whoever calls poll() does the same.
+ */
+class shm_transport final : public transport {
+public:
+  shm_transport(std::shared_ptr<shm_segment> segment, unsigned side,
+                std::vector<std::byte> peer_data)
+      : segment_(std::move(segment))
+      , tx_(segment_->header().rings[side])
+      , rx_(segment_->header().rings[1 - side])
+      , tx_data_(segment_->ring_data(side))
+      , rx_data_(segment_->ring_data(1 - side))
+      , mask_(segment_->header().ring_bytes - 1)
+      , peer_data_(std::move(peer_data)) {}
+
+  ~shm_transport() override { tx_.closed.store(1, std::memory_order_release); }
+
+  auto setup_buffers(std::size_t send_bytes, std::size_t recv_bytes) -> void override {
+    send_pool_.resize(send_bytes);
+    recv_pool_.resize(recv_bytes);
+    if (!caller_polling_) {
+      poller_ = std::jthread([this](std::stop_token stop) { run_poller(stop); });
+    }
+  }
+
+  auto set_caller_polling() -> bool override {
+    caller_polling_ = true;
+    return true;
+  }
+
+  auto shutdown() noexcept -> void override { fail_pending(); }
+
+  auto poll(std::size_t max) -> std::size_t override {
+    std::size_t const delivered = deliver(max);
+    resume_sends();
+    if (delivered == 0 && peer_closed()) {
+      fail_pending();
+    }
+    return delivered;
+  }
+
+  auto send_pool() noexcept -> std::span<std::byte> override { return send_pool_; }
+  auto recv_pool() noexcept -> std::span<std::byte> override { return recv_pool_; }
+
+  auto send(std::size_t offset, std::size_t len) -> cppcoro::task<void> override {
+    if (frame_size(len) > mask_ + 1) {
+      throw std::runtime_error("shm transport: message larger than the ring");
+    }
+    pending_send op{.offset = offset, .len = len};
+    co_await send_awaitable{*this, op};
+    if (op.failed) {
+      throw std::runtime_error("shm transport: peer closed");
+    }
+  }
+
+  auto recv(std::size_t offset, std::size_t len) -> cppcoro::task<std::size_t> override {
+    pending_recv op{.offset = offset, .len = len};
+    co_await recv_awaitable{*this, op};
+    if (op.failed) {
+      throw std::runtime_error("shm transport: peer closed");
+    }
+    co_return op.result;
+  }
+
+  auto peer_data() const noexcept -> std::span<const std::byte> override { return peer_data_; }
+
+private:
+  struct pending_recv {
+    std::size_t offset;
+    std::size_t len;
+    std::size_t result = 0;
+    bool failed = false;
+    std::coroutine_handle<> handle{};
+  };
+
+  struct pending_send {
+    std::size_t offset;
+    std::size_t len;
+    bool failed = false;
+    std::coroutine_handle<> handle{};
+  };
+
+  // Writes the message right away if the ring has room and no earlier send is waiting for it,
+  // otherwise queues up behind them.
+  struct send_awaitable {
+    shm_transport &transport;
+    pending_send &op;
+    constexpr auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      op.handle = h;
+      std::scoped_lock lock(transport.send_mutex_);
+      if (transport.sends_closed_) {
+        op.failed = true;
+        return false;
+      }
+      if (transport.blocked_sends_.empty() && transport.try_write(op)) {
+        return false;
+      }
+      transport.blocked_sends_.push_back(&op);
+      transport.sends_blocked_.store(true, std::memory_order_release);
+      return true;
+    }
+    constexpr void await_resume() const noexcept {}
+  };
+
+  struct recv_awaitable {
+    shm_transport &transport;
+    pending_recv &op;
+    constexpr auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      op.handle = h;
+      std::scoped_lock lock(transport.recv_mutex_);
+      if (transport.closed_) {
+        op.failed = true;
+        return false;
+      }
+      transport.pending_.push_back(&op);
+      return true;
+    }
+    constexpr void await_resume() const noexcept {}
+  };
+
+  auto copy_in(uint64_t pos, std::span<const std::byte> src) noexcept -> void {
+    std::size_t const at = pos & mask_;
+    std::size_t const first = std::min(src.size(), mask_ + 1 - at);
+    std::memcpy(tx_data_ + at, src.data(), first);
+    std::memcpy(tx_data_, src.data() + first, src.size() - first);
+  }
+
+  // Copies the message of `op` into the outgoing ring if it fits. Call with send_mutex_ held.
+  auto try_write(pending_send const &op) noexcept -> bool {
+    uint64_t const frame = frame_size(op.len);
+    uint64_t const tail = tx_.tail.load(std::memory_order_relaxed);
+    if (tail + frame - tx_.head.load(std::memory_order_acquire) > mask_ + 1) {
+      return false;
+    }
+    uint64_t const len64 = op.len;
+    copy_in(tail, std::as_bytes(std::span{&len64, 1}));
+    copy_in(tail + sizeof(uint64_t), std::span{send_pool_}.subspan(op.offset, op.len));
+    tx_.tail.store(tail + frame, std::memory_order_release);
+    return true;
+  }
+
+  // Writes queued sends in order as far as the peer has made room for them, and resumes them.
+  // Not under the lock, a resumed sender may well send again.
+  auto resume_sends() -> std::size_t {
+    if (!sends_blocked_.load(std::memory_order_acquire)) {
+      return 0;
+    }
+    std::size_t count = 0;
+    while (true) {
+      pending_send *op = nullptr;
+      {
+        std::scoped_lock lock(send_mutex_);
+        if (blocked_sends_.empty() || !try_write(*blocked_sends_.front())) {
+          sends_blocked_.store(!blocked_sends_.empty(), std::memory_order_release);
+          return count;
+        }
+        op = blocked_sends_.front();
+        blocked_sends_.pop_front();
+      }
+      ++count;
+      op->handle.resume();
+    }
+  }
+
+  auto copy_out(uint64_t pos, std::span<std::byte> dst) const noexcept -> void {
+    std::size_t const at = pos & mask_;
+    std::size_t const first = std::min(dst.size(), mask_ + 1 - at);
+    std::memcpy(dst.data(), rx_data_ + at, first);
+    std::memcpy(dst.data() + first, rx_data_, dst.size() - first);
+  }
+
+  auto next_pending() -> pending_recv * {
+    std::scoped_lock lock(recv_mutex_);
+    if (pending_.empty()) {
+      return nullptr;
+    }
+    auto *op = pending_.front();
+    pending_.pop_front();
+    return op;
+  }
+
+  // True once the peer went away and everything it sent has been delivered.
+  auto peer_closed() const noexcept -> bool {
+    return rx_.closed.load(std::memory_order_acquire) &&
+           rx_.head.load(std::memory_order_relaxed) == rx_.tail.load(std::memory_order_acquire);
+  }
+
+  // Copies up to `max` arrived messages into the oldest posted receives and resumes them. Only
+  // one thread delivers at a time, so receives complete in message order; the others, and a
+  // receive resumed here that polls again, return 0 right away.
+  auto deliver(std::size_t max) -> std::size_t {
+    if (delivering_.test_and_set(std::memory_order_acquire)) {
+      return 0;
+    }
+    std::size_t count = 0;
+    uint64_t head = rx_.head.load(std::memory_order_relaxed);
+    while (count < max && head != rx_.tail.load(std::memory_order_acquire)) {
+      // The sender holds a credit for this message, so a receive is about to be posted.
+      pending_recv *op = next_pending();
+      if (op == nullptr) {
+        break;
+      }
+      uint64_t len = 0;
+      copy_out(head, std::as_writable_bytes(std::span{&len, 1}));
+      if (len > op->len) [[unlikely]] {
+        static detail::rate_limit limit;
+        COVERBS_RPC_LOG_WARN(limit, "shm transport: truncated message of {} bytes to {}", len,
+                             op->len);
+      }
+      op->result = std::min<std::size_t>(len, op->len);
+      copy_out(head + sizeof(uint64_t), std::span{recv_pool_}.subspan(op->offset, op->result));
+      head += frame_size(len);
+      rx_.head.store(head, std::memory_order_release);
+      ++count;
+      op->handle.resume();
+    }
+    delivering_.clear(std::memory_order_release);
+    return count;
+  }
+
+  auto run_poller(std::stop_token stop) -> void {
+    unsigned idle = 0;
+    while (!stop.stop_requested()) {
+      if (deliver(kDeliverBatch) + resume_sends() > 0) {
+        idle = 0;
+        continue;
+      }
+      if (peer_closed()) {
+        fail_pending();
+        return;
+      }
+      backoff(idle);
+    }
+  }
+
+  // Fails the pending receives and the sends waiting for ring space, which the peer is not
+  // going to make any more.
+  auto fail_pending() noexcept -> void {
+    std::deque<pending_recv *> pending;
+    {
+      std::scoped_lock lock(recv_mutex_);
+      closed_ = true;
+      pending.swap(pending_);
+    }
+    std::deque<pending_send *> blocked;
+    {
+      std::scoped_lock lock(send_mutex_);
+      sends_closed_ = true;
+      blocked.swap(blocked_sends_);
+      sends_blocked_.store(false, std::memory_order_release);
+    }
+    for (auto *op : pending) {
+      op->failed = true;
+      op->handle.resume();
+    }
+    for (auto *op : blocked) {
+      op->failed = true;
+      op->handle.resume();
+    }
+  }
+
+  std::shared_ptr<shm_segment> segment_;
+  ring_control &tx_;
+  ring_control &rx_;
+  std::byte *const tx_data_;
+  std::byte *const rx_data_;
+  std::size_t const mask_;
+  std::vector<std::byte> peer_data_;
+  std::vector<std::byte> send_pool_;
+  std::vector<std::byte> recv_pool_;
+
+  std::mutex send_mutex_;
+  // Sends waiting for the peer to make room in the outgoing ring, oldest first.
+  std::deque<pending_send *> blocked_sends_;
+  std::atomic<bool> sends_blocked_{false};
+  bool sends_closed_ = false;
+  std::mutex recv_mutex_;
+  std::deque<pending_recv *> pending_;
+  bool closed_ = false;
+  // Set while a thread is delivering from the incoming ring.
+  std::atomic_flag delivering_;
+  bool caller_polling_ = false;
+
+  // Declared last so it stops before anything it touches goes away.
+  std::jthread poller_;
+};
+
+auto valid_segment_name(std::string_view name) noexcept -> bool {
+  return name.starts_with(kSegmentPrefix) && name.size() < 256 &&
+         name.find('/', 1) == std::string_view::npos;
+}
+
+class shm_listener final : public transport_listener {
+public:
+  shm_listener(cppcoro::io_service &io_service, uint16_t port,
+               std::span<const std::byte> user_data)
+      : io_service_(io_service)
+      , socket_(cppcoro::net::socket::create_tcpv4(io_service))
+      , user_data_(user_data.begin(), user_data.end()) {
+    int opt = 1;
+    if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+      throw_errno("setsockopt");
+    }
+    socket_.bind(cppcoro::net::ipv4_endpoint(cppcoro::net::ipv4_address(), port));
+    socket_.listen();
+    COVERBS_RPC_LOG_INFO("shm_listener: bind and listen: port={}", port);
+  }
+
+  auto accept() -> cppcoro::task<std::shared_ptr<transport>> override {
+    auto handshake = co_await accept_handshake();
+    co_return co_await std::move(handshake);
+  }
+
+  auto accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<transport>>> override {
+    cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
+    co_await socket_.accept(socket);
+    co_return handshake(std::move(socket));
+  }
+
+  auto close() noexcept -> void override {
+    try {
+      socket_.close();
+    } catch (std::exception &e) {
+      COVERBS_RPC_LOG_ERROR("shm_listener: error close, msg={}", e.what());
+    }
+  }
+
+private:
+  auto handshake(cppcoro::net::socket socket) -> cppcoro::task<std::shared_ptr<transport>> {
+    co_return co_await with_timeout(io_service_, socket, kHandshakeTimeout, attach(socket));
+  }
+
+  auto attach(cppcoro::net::socket &socket) -> cppcoro::task<std::shared_ptr<transport>> {
+    auto name_bytes = co_await recv_blob(socket);
+    auto peer_data = co_await recv_blob(socket);
+    std::string name(reinterpret_cast<char const *>(name_bytes.data()), name_bytes.size());
+    if (!valid_segment_name(name)) {
+      throw std::runtime_error("shm_listener: bad segment name");
+    }
+
+    auto transport = std::make_shared<shm_transport>(shm_segment::open(name), 1,
+                                                     std::move(peer_data));
+    co_await send_blob(user_data_, socket);
+    COVERBS_RPC_LOG_INFO("shm_listener: attached segment {}", name);
+    co_return transport;
+  }
+
+  cppcoro::io_service &io_service_;
+  cppcoro::net::socket socket_;
+  std::vector<std::byte> const user_data_;
+};
+
+} // namespace
+
+auto make_shm_listener(cppcoro::io_service &io_service, uint16_t port,
+                       TypedRpcConfig const &config [[maybe_unused]],
+                       std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener> {
+  return std::make_unique<shm_listener>(io_service, port, user_data);
+}
+
+auto connect_shm(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                 TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>> {
+  auto addr = cppcoro::net::ipv4_address::from_string(hostname);
+  if (!addr) {
+    throw std::runtime_error("failed to parse hostname as ipv4 address");
+  }
+
+  cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service);
+  co_await socket.connect(cppcoro::net::ipv4_endpoint(*addr, port));
+
+  auto const name = std::format("{}{}-{}", kSegmentPrefix, ::getpid(), next_segment_id());
+  auto segment = shm_segment::create(name, config.shm_ring_bytes);
+  co_await send_blob(std::as_bytes(std::span{name}), socket);
+  co_await send_blob(user_data, socket);
+  auto peer_data = co_await recv_blob(socket);
+  // The server has mapped the segment by the time it answers.
+  segment->unlink();
+
+  COVERBS_RPC_LOG_INFO("connect_shm: connected to {}:{} through {}", hostname, port, name);
+  co_return std::make_shared<shm_transport>(std::move(segment), 0, std::move(peer_data));
+}
+
+} // namespace coverbs_rpc
@@ -0,0 +1,514 @@
+#include "coverbs_rpc/transport/tcp_transport.hpp"
+#include "coverbs_rpc/conn/transmission.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <coroutine>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/net/ipv4_address.hpp>
+#include <cppcoro/net/ipv4_endpoint.hpp>
+#include <cppcoro/net/socket.hpp>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace coverbs_rpc {
+
+namespace {
+
+// Large enough that small messages arrive many per read().
+constexpr std::size_t kReadBufferBytes = 256 * 1024;
+
+auto throw_errno(char const *what) -> void {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// The socket never blocks, the reader and the writer thread wait here until it is ready for
+// them. A shut down socket is ready for both, the next call then fails.
+auto wait_ready(int fd, short events) -> void {
+  pollfd pfd{.fd = fd, .events = events, .revents = 0};
+  while (::poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) {
+      throw_errno("poll");
+    }
+  }
+}
+
+// Returns false if the peer closed the connection first.
+auto read_all(int fd, std::span<std::byte> buffer) -> bool {
+  while (!buffer.empty()) {
+    ssize_t n = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        wait_ready(fd, POLLIN);
+        continue;
+      }
+      throw_errno("recv");
+    }
+    if (n == 0) {
+      return false;
+    }
+    buffer = buffer.subspan(static_cast<std::size_t>(n));
+  }
+  return true;
+}
+
+// Runs on the io_service, the transport's threads take over the socket after that.
+auto exchange_user_data(cppcoro::net::socket &socket, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::vector<std::byte>> {
+  co_await send_blob(user_data, socket);
+  co_return co_await recv_blob(socket);
+}
+
+// Readies a connected socket for the reader and writer threads, see wait_ready().
+auto prepare_socket(cppcoro::net::socket &socket) -> void {
+  int const fd = socket.native_handle();
+  int opt = 1;
+  if (::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+    throw_errno("setsockopt");
+  }
+  int const flags = ::fcntl(fd, F_GETFL);
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    throw_errno("fcntl");
+  }
+}
+
+class tcp_transport final : public transport {
+public:
+  tcp_transport(cppcoro::net::socket socket, std::vector<std::byte> peer_data)
+      : socket_(std::move(socket))
+      , fd_(socket_.native_handle())
+      , peer_data_(std::move(peer_data)) {}
+
+  ~tcp_transport() override {
+    stopping_.store(true, std::memory_order_release);
+    ::shutdown(fd_, SHUT_RDWR);
+    {
+      std::scoped_lock lock(recv_mutex_);
+      recv_closed_ = true;
+    }
+    recv_cv_.notify_all();
+    {
+      std::scoped_lock lock(send_mutex_);
+      send_closed_ = true;
+    }
+    send_cv_.notify_all();
+  }
+
+  auto setup_buffers(std::size_t send_bytes, std::size_t recv_bytes) -> void override {
+    send_pool_.resize(send_bytes);
+    recv_pool_.resize(recv_bytes);
+    reader_ = std::jthread([this] { read_loop(); });
+    writer_ = std::jthread([this] { write_loop(); });
+  }
+
+  auto send_pool() noexcept -> std::span<std::byte> override { return send_pool_; }
+  auto recv_pool() noexcept -> std::span<std::byte> override { return recv_pool_; }
+
+  auto send(std::size_t offset, std::size_t len) -> cppcoro::task<void> override {
+    send_op op{.offset = offset, .len = len};
+    co_await send_awaitable{*this, op};
+    if (op.failed) {
+      throw std::runtime_error("tcp transport: connection closed");
+    }
+  }
+
+  auto recv(std::size_t offset, std::size_t len) -> cppcoro::task<std::size_t> override {
+    recv_op op{.offset = offset, .len = len};
+    co_await recv_awaitable{*this, op};
+    if (op.failed) {
+      throw std::runtime_error("tcp transport: connection closed");
+    }
+    co_return op.result;
+  }
+
+  auto peer_data() const noexcept -> std::span<const std::byte> override { return peer_data_; }
+
+  auto shutdown() noexcept -> void override { fail_receives(); }
+
+private:
+  struct send_op {
+    std::size_t offset;
+    std::size_t len;
+    bool failed = false;
+    std::coroutine_handle<> handle{};
+  };
+
+  struct recv_op {
+    std::size_t offset;
+    std::size_t len;
+    std::size_t result = 0;
+    bool failed = false;
+    std::coroutine_handle<> handle{};
+  };
+
+  // Queues the message for the writer thread, which resumes the sender once it is out.
+  struct send_awaitable {
+    tcp_transport &transport;
+    send_op &op;
+    constexpr auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      op.handle = h;
+      bool first = false;
+      {
+        std::scoped_lock lock(transport.send_mutex_);
+        if (transport.send_closed_) {
+          op.failed = true;
+          return false;
+        }
+        first = transport.send_queue_.empty();
+        transport.send_queue_.push_back(&op);
+      }
+      // Otherwise the writer has yet to take the queue and will find this one in it.
+      if (first) {
+        transport.send_cv_.notify_one();
+      }
+      return true;
+    }
+    constexpr void await_resume() const noexcept {}
+  };
+
+  struct recv_awaitable {
+    tcp_transport &transport;
+    recv_op &op;
+    constexpr auto await_ready() const noexcept -> bool { return false; }
+    auto await_suspend(std::coroutine_handle<> h) -> bool {
+      op.handle = h;
+      {
+        std::scoped_lock lock(transport.recv_mutex_);
+        if (transport.recv_closed_) {
+          op.failed = true;
+          return false;
+        }
+        transport.pending_.push_back(&op);
+      }
+      transport.recv_cv_.notify_one();
+      return true;
+    }
+    constexpr void await_resume() const noexcept {}
+  };
+
+  // Takes everything queued as one batch, so messages queued while a batch is being written
+  // go out together with the next one.
+  auto write_loop() -> void {
+    std::vector<send_op *> batch;
+    while (true) {
+      {
+        std::unique_lock lock(send_mutex_);
+        send_cv_.wait(lock, [this] { return !send_queue_.empty() || send_closed_; });
+        // Only the destructor closes a queue the writer is still taking from.
+        if (send_closed_) {
+          return;
+        }
+        batch.swap(send_queue_);
+      }
+
+      bool const ok = write_batch(batch);
+      if (!ok) {
+        std::scoped_lock lock(send_mutex_);
+        send_closed_ = true;
+        batch.insert(batch.end(), send_queue_.begin(), send_queue_.end());
+        send_queue_.clear();
+      }
+      // Senders left over while the transport is being destroyed stay suspended, like
+      // receives.
+      if (stopping_.load(std::memory_order_acquire)) {
+        return;
+      }
+      for (auto *op : batch) {
+        op->failed = !ok;
+        op->handle.resume();
+      }
+      batch.clear();
+      if (!ok) {
+        return;
+      }
+    }
+  }
+
+  auto write_batch(std::span<send_op *const> batch) noexcept -> bool {
+    iov_.clear();
+    for (auto *op : batch) {
+      iov_.push_back(iovec{.iov_base = send_pool_.data() + op->offset, .iov_len = op->len});
+    }
+
+    std::span<iovec> pending{iov_};
+    while (!pending.empty()) {
+      msghdr msg{};
+      msg.msg_iov = pending.data();
+      msg.msg_iovlen = std::min<std::size_t>(pending.size(), IOV_MAX);
+      ssize_t n = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          try {
+            wait_ready(fd_, POLLOUT);
+          } catch (const std::system_error &e) {
+            COVERBS_RPC_LOG_ERROR("tcp transport: send failed: {}", e.what());
+            return false;
+          }
+          continue;
+        }
+        COVERBS_RPC_LOG_ERROR("tcp transport: send failed: {}", std::strerror(errno));
+        return false;
+      }
+      auto written = static_cast<std::size_t>(n);
+      while (!pending.empty() && written >= pending.front().iov_len) {
+        written -= pending.front().iov_len;
+        pending = pending.subspan(1);
+      }
+      if (written > 0) {
+        pending.front().iov_base = static_cast<std::byte *>(pending.front().iov_base) + written;
+        pending.front().iov_len -= written;
+      }
+    }
+    return true;
+  }
+
+  auto next_pending() -> recv_op * {
+    std::unique_lock lock(recv_mutex_);
+    // The sender holds a credit for this message, so a receive is about to be posted.
+    recv_cv_.wait(lock, [this] { return !pending_.empty() || recv_closed_; });
+    if (pending_.empty()) {
+      return nullptr;
+    }
+    auto *op = pending_.front();
+    pending_.pop_front();
+    return op;
+  }
+
+  // Reads into `read_buffer_` until at least `want` bytes are buffered.
+  auto fill(std::size_t want) -> bool {
+    if (read_end_ - read_begin_ >= want) {
+      return true;
+    }
+    if (read_buffer_.size() - read_begin_ < want) {
+      std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_,
+                   read_end_ - read_begin_);
+      read_end_ -= read_begin_;
+      read_begin_ = 0;
+    }
+    while (read_end_ - read_begin_ < want) {
+      ssize_t n = ::recv(fd_, read_buffer_.data() + read_end_,
+                         read_buffer_.size() - read_end_, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        try {
+          wait_ready(fd_, POLLIN);
+        } catch (const std::system_error &) {
+          return false;
+        }
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      read_end_ += static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+
+  auto read_message() -> bool {
+    if (!fill(sizeof(detail::RpcHeader))) {
+      return false;
+    }
+    detail::RpcHeader header;
+    std::memcpy(&header, read_buffer_.data() + read_begin_, sizeof(header));
+    std::size_t const frame = sizeof(detail::RpcHeader) + header.payload_len;
+
+    recv_op *op = next_pending();
+    if (op == nullptr) {
+      return false;
+    }
+    if (frame > op->len) [[unlikely]] {
+      COVERBS_RPC_LOG_ERROR("tcp transport: message of {} bytes exceeds the receive of {}", frame,
+                            op->len);
+      fail(op);
+      return false;
+    }
+
+    // Whatever is buffered is copied out, the rest of a large message is read in place.
+    std::byte *dst = recv_pool_.data() + op->offset;
+    std::size_t const buffered = std::min(frame, read_end_ - read_begin_);
+    std::memcpy(dst, read_buffer_.data() + read_begin_, buffered);
+    read_begin_ += buffered;
+    if (read_begin_ == read_end_) {
+      read_begin_ = read_end_ = 0;
+    }
+    bool ok = true;
+    try {
+      ok = read_all(fd_, std::span{dst + buffered, frame - buffered});
+    } catch (const std::system_error &) {
+      ok = false;
+    }
+    if (!ok) {
+      fail(op);
+      return false;
+    }
+    op->result = frame;
+    op->handle.resume();
+    return true;
+  }
+
+  auto read_loop() -> void {
+    read_buffer_.resize(kReadBufferBytes);
+    while (read_message()) {
+    }
+    if (stopping_.load(std::memory_order_acquire)) {
+      return;
+    }
+    COVERBS_RPC_LOG_INFO("tcp transport: connection closed");
+    fail_receives();
+  }
+
+  auto fail_receives() noexcept -> void {
+    std::deque<recv_op *> pending;
+    {
+      std::scoped_lock lock(recv_mutex_);
+      recv_closed_ = true;
+      pending.swap(pending_);
+    }
+    recv_cv_.notify_all();
+    for (auto *op : pending) {
+      fail(op);
+    }
+  }
+
+  // Receives left over while the transport is being destroyed stay suspended, their owner is
+  // going away with it.
+  auto fail(recv_op *op) noexcept -> void {
+    if (stopping_.load(std::memory_order_acquire)) {
+      return;
+    }
+    op->failed = true;
+    op->handle.resume();
+  }
+
+  cppcoro::net::socket socket_;
+  int const fd_;
+  std::vector<std::byte> peer_data_;
+  std::vector<std::byte> send_pool_;
+  std::vector<std::byte> recv_pool_;
+  std::atomic<bool> stopping_{false};
+
+  std::mutex send_mutex_;
+  std::condition_variable send_cv_;
+  std::vector<send_op *> send_queue_;
+  bool send_closed_ = false;
+  // Only touched by the writer thread.
+  std::vector<iovec> iov_;
+
+  std::mutex recv_mutex_;
+  std::condition_variable recv_cv_;
+  std::deque<recv_op *> pending_;
+  bool recv_closed_ = false;
+  // Only touched by the reader thread.
+  std::vector<std::byte> read_buffer_;
+  std::size_t read_begin_ = 0;
+  std::size_t read_end_ = 0;
+
+  // Declared last so they stop before anything they touch goes away.
+  std::jthread reader_;
+  std::jthread writer_;
+};
+
+class tcp_listener final : public transport_listener {
+public:
+  tcp_listener(cppcoro::io_service &io_service, uint16_t port,
+               std::span<const std::byte> user_data)
+      : io_service_(io_service)
+      , socket_(cppcoro::net::socket::create_tcpv4(io_service))
+      , user_data_(user_data.begin(), user_data.end()) {
+    int opt = 1;
+    if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+      throw_errno("setsockopt");
+    }
+    socket_.bind(cppcoro::net::ipv4_endpoint(cppcoro::net::ipv4_address(), port));
+    socket_.listen();
+    COVERBS_RPC_LOG_INFO("tcp_listener: bind and listen: port={}", port);
+  }
+
+  auto accept() -> cppcoro::task<std::shared_ptr<transport>> override {
+    auto handshake = co_await accept_handshake();
+    co_return co_await std::move(handshake);
+  }
+
+  auto accept_handshake() -> cppcoro::task<cppcoro::task<std::shared_ptr<transport>>> override {
+    cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service_);
+    co_await socket_.accept(socket);
+    co_return handshake(std::move(socket));
+  }
+
+  auto close() noexcept -> void override {
+    try {
+      socket_.close();
+      COVERBS_RPC_LOG_WARN("tcp_listener: closed");
+    } catch (std::exception &e) {
+      COVERBS_RPC_LOG_ERROR("tcp_listener: error close, msg={}", e.what());
+    }
+  }
+
+private:
+  auto handshake(cppcoro::net::socket socket) -> cppcoro::task<std::shared_ptr<transport>> {
+    auto peer_data = co_await with_timeout(io_service_, socket, kHandshakeTimeout,
+                                           exchange_user_data(socket, user_data_));
+    prepare_socket(socket);
+    co_return std::make_shared<tcp_transport>(std::move(socket), std::move(peer_data));
+  }
+
+  cppcoro::io_service &io_service_;
+  cppcoro::net::socket socket_;
+  std::vector<std::byte> const user_data_;
+};
+
+} // namespace
+
+auto make_tcp_listener(cppcoro::io_service &io_service, uint16_t port,
+                       TypedRpcConfig const &config [[maybe_unused]],
+                       std::span<const std::byte> user_data)
+    -> std::unique_ptr<transport_listener> {
+  return std::make_unique<tcp_listener>(io_service, port, user_data);
+}
+
+auto connect_tcp(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                 TypedRpcConfig const &config [[maybe_unused]],
+                 std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>> {
+  auto addr = cppcoro::net::ipv4_address::from_string(hostname);
+  if (!addr) {
+    throw std::runtime_error("failed to parse hostname as ipv4 address");
+  }
+
+  cppcoro::net::socket socket = cppcoro::net::socket::create_tcpv4(io_service);
+  co_await socket.connect(cppcoro::net::ipv4_endpoint(*addr, port));
+  auto peer_data = co_await exchange_user_data(socket, user_data);
+  prepare_socket(socket);
+
+  COVERBS_RPC_LOG_INFO("connect_tcp: connected to {}:{}", hostname, port);
+  co_return std::make_shared<tcp_transport>(std::move(socket), std::move(peer_data));
+}
+
+} // namespace coverbs_rpc
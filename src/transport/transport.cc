@@ -0,0 +1,45 @@
+#include "coverbs_rpc/transport.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
+#include "coverbs_rpc/transport/shm_transport.hpp"
+#include "coverbs_rpc/transport/tcp_transport.hpp"
+
+#include <stdexcept>
+
+namespace coverbs_rpc {
+
+auto transport_listener::accept_handshake()
+    -> cppcoro::task<cppcoro::task<std::shared_ptr<transport>>> {
+  auto connected = co_await accept();
+  co_return [](std::shared_ptr<transport> connected) -> cppcoro::task<std::shared_ptr<transport>> {
+    co_return connected;
+  }(std::move(connected));
+}
+
+auto make_listener(cppcoro::io_service &io_service, uint16_t port, TypedRpcConfig const &config,
+                   std::span<const std::byte> user_data) -> std::unique_ptr<transport_listener> {
+  switch (config.transport) {
+    case transport_kind::rdma:
+      return make_rdma_listener(io_service, port, config, user_data);
+    case transport_kind::shm:
+      return make_shm_listener(io_service, port, config, user_data);
+    case transport_kind::tcp:
+      return make_tcp_listener(io_service, port, config, user_data);
+  }
+  throw std::runtime_error("unknown transport kind");
+}
+
+auto connect_transport(cppcoro::io_service &io_service, std::string_view hostname, uint16_t port,
+                       TypedRpcConfig const &config, std::span<const std::byte> user_data)
+    -> cppcoro::task<std::shared_ptr<transport>> {
+  switch (config.transport) {
+    case transport_kind::rdma:
+      return connect_rdma(io_service, hostname, port, config, user_data);
+    case transport_kind::shm:
+      return connect_shm(io_service, hostname, port, config, user_data);
+    case transport_kind::tcp:
+      return connect_tcp(io_service, hostname, port, config, user_data);
+  }
+  throw std::runtime_error("unknown transport kind");
+}
+
+} // namespace coverbs_rpc
@@ -1,21 +1,78 @@
 #include "coverbs_rpc/typed_client.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
 
 #include <cppcoro/sync_wait.hpp>
-#include <rdmapp/device.h>
-#include <rdmapp/pd.h>
-#include <rdmapp/qp.h>
 
 namespace coverbs_rpc {
 
 typed_client::typed_client(cppcoro::io_service &io_service, std::string_view hostname,
                            uint16_t port, TypedRpcConfig config)
     : config_(config)
-    , device_(std::make_shared<rdmapp::device>(config.device_nr, config.port_nr))
-    , pd_(std::make_shared<rdmapp::pd>(device_))
     , io_service_(io_service)
-    , connector_(io_service_, pd_, nullptr, config.to_conn_config()) {
-  qp_ = cppcoro::sync_wait(connector_.connect(hostname, port));
-  client_ = std::make_unique<basic_client>(qp_, config_);
+    , metrics_(std::make_shared<rpc_metrics>()) {
+  auto const hello = detail::encode_credit_hello(detail::client_receives(config_));
+  transport_ = cppcoro::sync_wait(connect_transport(io_service_, hostname, port, config_, hello));
+  client_ = std::make_unique<basic_client>(transport_, config_, metrics_);
+  if (config_.bulk_connection) {
+    bulk_transport_ =
+        cppcoro::sync_wait(connect_transport(io_service_, hostname, port, config_, hello));
+    bulk_client_ = std::make_unique<basic_client>(bulk_transport_, config_, metrics_);
+  }
+}
+
+typed_client::typed_client(rdma_context &context, std::string_view hostname, uint16_t port,
+                           TypedRpcConfig config)
+    : config_(config)
+    , io_service_(context.io_service())
+    , metrics_(std::make_shared<rpc_metrics>()) {
+  auto const hello = detail::encode_credit_hello(detail::client_receives(config_));
+  transport_ = cppcoro::sync_wait(context.connect(hostname, port, config_, hello));
+  client_ = std::make_unique<basic_client>(transport_, config_, metrics_);
+  if (config_.bulk_connection) {
+    bulk_transport_ = cppcoro::sync_wait(context.connect(hostname, port, config_, hello));
+    bulk_client_ = std::make_unique<basic_client>(bulk_transport_, config_, metrics_);
+  }
+}
+
+typed_client::typed_client(cppcoro::io_service &io_service, std::shared_ptr<transport> transport,
+                           TypedRpcConfig config)
+    : config_(config)
+    , io_service_(io_service)
+    , transport_(std::move(transport))
+    , metrics_(std::make_shared<rpc_metrics>())
+    , client_(std::make_unique<basic_client>(transport_, config_, metrics_)) {}
+
+typed_client::typed_client(cppcoro::io_service &io_service, std::shared_ptr<transport> transport,
+                           std::shared_ptr<transport> bulk_transport, TypedRpcConfig config)
+    : typed_client(io_service, std::move(transport), config) {
+  if (bulk_transport) {
+    bulk_transport_ = std::move(bulk_transport);
+    bulk_client_ = std::make_unique<basic_client>(bulk_transport_, config_, metrics_);
+  }
+}
+
+auto typed_client::connect(cppcoro::io_service &io_service, std::string hostname, uint16_t port,
+                           TypedRpcConfig config) -> cppcoro::task<std::unique_ptr<typed_client>> {
+  auto const hello = detail::encode_credit_hello(detail::client_receives(config));
+  auto transport = co_await connect_transport(io_service, hostname, port, config, hello);
+  std::shared_ptr<coverbs_rpc::transport> bulk_transport;
+  if (config.bulk_connection) {
+    bulk_transport = co_await connect_transport(io_service, hostname, port, config, hello);
+  }
+  co_return std::make_unique<typed_client>(io_service, std::move(transport),
+                                           std::move(bulk_transport), config);
+}
+
+auto typed_client::connect(rdma_context &context, std::string hostname, uint16_t port,
+                           TypedRpcConfig config) -> cppcoro::task<std::unique_ptr<typed_client>> {
+  auto const hello = detail::encode_credit_hello(detail::client_receives(config));
+  auto transport = co_await context.connect(hostname, port, config, hello);
+  std::shared_ptr<coverbs_rpc::transport> bulk_transport;
+  if (config.bulk_connection) {
+    bulk_transport = co_await context.connect(hostname, port, config, hello);
+  }
+  co_return std::make_unique<typed_client>(context.io_service(), std::move(transport),
+                                           std::move(bulk_transport), config);
 }
 
 } // namespace coverbs_rpc
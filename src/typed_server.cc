@@ -1,41 +1,59 @@
 #include "coverbs_rpc/typed_server.hpp"
 #include "coverbs_rpc/basic_server.hpp"
 #include "coverbs_rpc/detail/logger.hpp"
+#include <chrono>
 #include <cppcoro/async_scope.hpp>
 
 namespace coverbs_rpc {
 
-using detail::get_logger;
-
 typed_server::typed_server(cppcoro::io_service &io_service, uint16_t port, TypedRpcConfig config,
                            std::uint32_t thread_count)
     : config_(config)
     , thread_count_(thread_count)
-    , device_(std::make_shared<rdmapp::device>(config.device_nr, config.port_nr))
-    , pd_(std::make_shared<rdmapp::pd>(device_))
     , io_service_(io_service)
-    , acceptor_(io_service_, port, pd_, nullptr, config.to_conn_config())
-    , mux_() {}
+    , listener_(make_listener(io_service_, port, config_,
+                              detail::encode_credit_hello(config_.max_inflight)))
+    , mux_()
+    , metrics_(std::make_shared<rpc_metrics>()) {}
 
 auto typed_server::run() -> cppcoro::task<void> {
   cppcoro::async_scope scope;
   while (true) {
-    auto qp = co_await acceptor_.accept();
-    get_logger()->info("typed_server: accepted connection");
-    scope.spawn(handle_connection(std::move(qp)));
+    auto handshake = co_await listener_->accept_handshake();
+    scope.spawn(handle_connection(std::move(handshake)));
   }
   co_await scope.join();
 }
 
-typed_server::~typed_server() { acceptor_.close(); }
+typed_server::~typed_server() { listener_->close(); }
+
+auto typed_server::handle_connection(cppcoro::task<std::shared_ptr<transport>> handshake)
+    -> cppcoro::task<void> {
+  auto const start = std::chrono::steady_clock::now();
+  std::shared_ptr<transport> transport;
+  try {
+    transport = co_await std::move(handshake);
+  } catch (const std::exception &e) {
+    COVERBS_RPC_LOG_WARN("typed_server: handshake failed: {}", e.what());
+    co_return;
+  }
+  auto const elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+  {
+    std::scoped_lock lock(accept_mutex_);
+    accept_ns_.record(static_cast<uint64_t>(elapsed_ns));
+  }
+  COVERBS_RPC_LOG_INFO("typed_server: accepted connection in {} us", elapsed_ns / 1000);
 
-auto typed_server::handle_connection(std::shared_ptr<rdmapp::qp> qp) -> cppcoro::task<void> {
-  basic_server server(qp, mux_, config_, thread_count_);
+  basic_server server(std::move(transport), mux_, config_, thread_count_, metrics_);
+  connections_.fetch_add(1, std::memory_order_relaxed);
   try {
     co_await server.run();
   } catch (const std::exception &e) {
-    get_logger()->warn("typed_server: connection closed with error: {}", e.what());
+    COVERBS_RPC_LOG_WARN("typed_server: connection closed with error: {}", e.what());
   }
+  connections_.fetch_sub(1, std::memory_order_relaxed);
 }
 
 } // namespace coverbs_rpc
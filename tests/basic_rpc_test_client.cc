@@ -3,11 +3,13 @@
 #include "coverbs_rpc/conn/connector.hpp"
 #include "coverbs_rpc/detail/logger.hpp"
 
+#include <array>
 #include <cppcoro/io_service.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
 #include <cppcoro/when_all.hpp>
 #include <memory>
+#include <span>
 #include <string>
 #include <thread>
 #include <vector>
@@ -51,10 +53,12 @@ cppcoro::task<void> run_rpc_test(basic_client &client, int num_calls) {
 }
 
 cppcoro::task<void> run_test(cppcoro::io_service &io_service, std::shared_ptr<rdmapp::pd> pd) {
-  qp_connector connector(io_service, pd, nullptr,
-                         ConnConfig{.cq_size = kClientMaxInFlight * 2,
-                                    .qp_config{.max_send_wr = kClientMaxInFlight * 2,
-                                               .max_recv_wr = kClientMaxInFlight * 2}});
+  ConnConfig conn_config{.cq_size = kClientMaxInFlight * 2,
+                         .qp_config{.max_send_wr = kClientMaxInFlight * 2,
+                                    .max_recv_wr = kClientMaxInFlight * 2}};
+  // Room for the gathered requests of step 4.
+  conn_config.qp_config.max_send_sge = 4;
+  qp_connector connector(io_service, pd, nullptr, conn_config);
   auto qp = co_await connector.connect(server_ip, server_port);
   basic_client client(qp, kClientRpcConfig);
 
@@ -74,6 +78,33 @@ cppcoro::task<void> run_test(cppcoro::io_service &io_service, std::shared_ptr<rd
   co_await cppcoro::when_all(std::move(tasks));
   get_logger()->info("Step 2: All concurrent RPC calls successful");
 
+  get_logger()->info("Step 3: Gathered request test, calling RPC {} times...", kNumCalls);
+  std::vector<std::byte> req_head(kRequestSize / 4, kRequestByte);
+  std::vector<std::byte> req_tail(kRequestSize - req_head.size(), kRequestByte);
+  std::array<std::span<const std::byte>, 2> req_parts{req_head, req_tail};
+  std::vector<std::byte> resp_data(kResponseSize);
+  for (int i = 0; i < kNumCalls; ++i) {
+    auto resp_len = co_await client.call(kTestFnId, req_parts, resp_data);
+    if (resp_len != kResponseSize) {
+      get_logger()->error("Response length mismatch: expected {}, got {}", kResponseSize, resp_len);
+      exit(1);
+    }
+  }
+  get_logger()->info("Step 3: All gathered RPC calls successful");
+
+  get_logger()->info("Step 4: Registered request part test, calling RPC {} times...", kNumCalls);
+  auto tail_mr = pd->reg_mr(req_tail.data(), req_tail.size());
+  std::array<send_part, 2> registered_parts{send_part{.bytes = req_head},
+                                            send_part{.bytes = req_tail, .lkey = tail_mr.lkey()}};
+  for (int i = 0; i < kNumCalls; ++i) {
+    auto resp_len = co_await client.call(kTestFnId, registered_parts, resp_data);
+    if (resp_len != kResponseSize) {
+      get_logger()->error("Response length mismatch: expected {}, got {}", kResponseSize, resp_len);
+      exit(1);
+    }
+  }
+  get_logger()->info("Step 4: All RPC calls with registered parts successful");
+
   co_return;
 }
 
@@ -0,0 +1,48 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/utils/bump_arena.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using coverbs_rpc::detail::get_logger;
+using coverbs_rpc::utils::bump_arena;
+
+int main() {
+  get_logger()->info("Starting bump_arena tests...");
+
+  bump_arena arena(1024);
+
+  // Test alignment
+  auto *c = arena.make<char>('x');
+  auto *d = arena.make<double>(1.5);
+  assert(*c == 'x' && *d == 1.5);
+  assert(reinterpret_cast<std::uintptr_t>(d) % alignof(double) == 0);
+  get_logger()->info("test_alignment passed");
+
+  // Test growth past the block size
+  void *big = arena.allocate(4096, 64);
+  assert(reinterpret_cast<std::uintptr_t>(big) % 64 == 0);
+  std::size_t capacity = arena.capacity();
+  assert(capacity >= 1024 + 4096);
+  get_logger()->info("test_growth passed: capacity={}", capacity);
+
+  // Test reset reuses the blocks
+  for (int round = 0; round < 100; ++round) {
+    arena.reset();
+    std::pmr::vector<std::pmr::string> strings(&arena);
+    for (int i = 0; i < 16; ++i) {
+      strings.emplace_back(40, static_cast<char>('a' + i));
+    }
+    assert(std::string_view{strings.back()} == std::string(40, 'p'));
+  }
+  assert(arena.capacity() == capacity);
+  get_logger()->info("test_reset passed");
+
+  get_logger()->info("All bump_arena tests passed!");
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/utils/codel.hpp"
+
+#include <cassert>
+#include <chrono>
+
+using coverbs_rpc::detail::get_logger;
+using coverbs_rpc::utils::codel;
+using namespace std::chrono_literals;
+
+int main() {
+  get_logger()->info("Starting codel tests...");
+
+  codel shedder(5ms, 100ms);
+  auto now = std::chrono::steady_clock::time_point{} + 1s;
+
+  // Test bursts: long waits are fine as long as the queue drains every interval
+  for (int i = 0; i < 50; ++i) {
+    shedder.record(i % 10 == 0 ? 1ms : 50ms, now);
+    assert(!shedder.overloaded(now));
+    now += 10ms;
+  }
+  get_logger()->info("test_bursts passed");
+
+  // Test standing queue: after an interval without a short wait, arriving requests are rejected
+  for (int i = 0; i < 25; ++i) {
+    shedder.record(20ms, now);
+    now += 10ms;
+  }
+  assert(shedder.overloaded(now));
+  get_logger()->info("test_standing_queue passed");
+
+  // Test recovery: one interval in which the queue drained ends the overload
+  for (int i = 0; i < 25; ++i) {
+    shedder.record(1ms, now);
+    now += 10ms;
+  }
+  assert(!shedder.overloaded(now));
+  get_logger()->info("test_recovery passed");
+
+  // Test idle: an interval in which nothing left the queue ends the overload as well
+  for (int i = 0; i < 25; ++i) {
+    shedder.record(20ms, now);
+    now += 10ms;
+  }
+  assert(shedder.overloaded(now));
+  // The interval that still holds long waits ends first, then one with none at all.
+  now += 100ms;
+  assert(shedder.overloaded(now));
+  now += 100ms;
+  assert(!shedder.overloaded(now));
+  get_logger()->info("test_idle passed");
+
+  get_logger()->info("All codel tests passed!");
+
+  return 0;
+}
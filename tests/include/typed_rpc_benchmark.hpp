@@ -1,31 +1,71 @@
 #pragma once
 
+#include "coverbs_rpc/common.hpp"
+#include "coverbs_rpc/detail/wire_codec.hpp"
+#include "coverbs_rpc/utils/bump_arena.hpp"
+
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 
 namespace coverbs_rpc::benchmark {
 
-constexpr int kNumCalls = 200000;
-constexpr int kThreads = 4;
-constexpr int kReportInterval = 10000;
+// Payloads are capped by this on the server, the client sizes its own slots per run.
+constexpr uint32_t kMaxPayload = 16 * 1024;
+
+inline auto parse_transport(std::string_view name) -> std::optional<transport_kind> {
+  if (name == "rdma") {
+    return transport_kind::rdma;
+  }
+  if (name == "shm") {
+    return transport_kind::shm;
+  }
+  if (name == "tcp") {
+    return transport_kind::tcp;
+  }
+  return std::nullopt;
+}
 
-struct BenchmarkRequest {
+struct PayloadRequest {
   std::string data;
+  uint32_t resp_size;
 };
 
-struct BenchmarkResponse {
+struct PayloadResponse {
   std::string data;
 };
 
-template <std::size_t I>
-struct BenchmarkHandler {
-  static auto handle(const BenchmarkRequest &req [[maybe_unused]]) -> BenchmarkResponse {
-    BenchmarkResponse resp;
-    if constexpr (I == 0) {
-      resp.data = std::string(256, 'a');
-    } else {
-      resp.data = std::string(4096, 'b');
-    }
-    return resp;
+// Replies with `resp_size` bytes, reusing the response so the server does not allocate per call.
+inline auto payload_handle(const PayloadRequest &req, PayloadResponse &resp,
+                           utils::bump_arena &arena [[maybe_unused]]) -> void {
+  resp.data.assign(req.resp_size, 'b');
+}
+
+// Fixed-layout key lookups, sent as raw bytes when Raw is set and as BEVE otherwise.
+template <bool Raw>
+struct KvRequest {
+  uint64_t key;
+  uint32_t len;
+};
+
+template <bool Raw>
+struct KvResponse {
+  uint64_t key;
+  uint64_t version;
+  uint32_t len;
+};
+
+template <bool Raw>
+struct KvHandler {
+  static auto handle(const KvRequest<Raw> &req) -> KvResponse<Raw> {
+    return KvResponse<Raw>{.key = req.key, .version = req.key * 2, .len = req.len};
   }
 };
-} // namespace coverbs_rpc::benchmark
\ No newline at end of file
+} // namespace coverbs_rpc::benchmark
+
+template <>
+inline constexpr bool coverbs_rpc::enable_raw_wire<coverbs_rpc::benchmark::KvRequest<true>> = true;
+template <>
+inline constexpr bool coverbs_rpc::enable_raw_wire<coverbs_rpc::benchmark::KvResponse<true>> =
+    true;
@@ -0,0 +1,57 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/utils/latency_histogram.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+using coverbs_rpc::detail::get_logger;
+using coverbs_rpc::utils::latency_histogram;
+
+static auto within(uint64_t reported, uint64_t expected) -> bool {
+  return reported >= expected && reported - expected <= expected / 64;
+}
+
+int main() {
+  get_logger()->info("Starting latency_histogram tests...");
+
+  // Test bucket boundaries round trip
+  for (uint64_t v : {0UL, 1UL, 127UL, 128UL, 129UL, 1000UL, 123456789UL,
+                     std::numeric_limits<uint64_t>::max()}) {
+    auto idx = latency_histogram::index_of(v);
+    assert(idx < latency_histogram::kBucketCount);
+    assert(latency_histogram::highest_equivalent(idx) >= v);
+    assert(within(latency_histogram::highest_equivalent(idx), v));
+  }
+  get_logger()->info("test_buckets passed");
+
+  // Test percentiles over 1..100000
+  latency_histogram h;
+  for (uint64_t v = 1; v <= 100000; ++v) {
+    h.record(v);
+  }
+  assert(h.count() == 100000);
+  assert(h.min() == 1 && h.max() == 100000);
+  assert(within(h.value_at_percentile(50), 50000));
+  assert(within(h.value_at_percentile(99), 99000));
+  assert(within(h.value_at_percentile(99.9), 99900));
+  assert(h.value_at_percentile(100) == 100000);
+  get_logger()->info("test_percentiles passed: p50={} p99={} p99.9={}", h.value_at_percentile(50),
+                     h.value_at_percentile(99), h.value_at_percentile(99.9));
+
+  // Test merge
+  latency_histogram a;
+  latency_histogram b;
+  a.record_n(10, 90);
+  b.record_n(5000, 10);
+  a.merge(b);
+  assert(a.count() == 100);
+  assert(a.value_at_percentile(90) == 10);
+  assert(within(a.value_at_percentile(91), 5000));
+  assert(a.max() == 5000);
+  get_logger()->info("test_merge passed");
+
+  get_logger()->info("All latency_histogram tests passed!");
+
+  return 0;
+}
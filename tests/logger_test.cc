@@ -0,0 +1,92 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/log.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+using coverbs_rpc::detail::get_logger;
+using coverbs_rpc::detail::log_record;
+using coverbs_rpc::detail::log_ring;
+using coverbs_rpc::detail::rate_limit;
+
+int main() {
+  get_logger()->info("Starting logger tests...");
+
+  // Test that a rate limit lets a burst through and counts the rest
+  {
+    rate_limit limit(3, std::chrono::hours(1));
+    uint64_t suppressed = 0;
+    int admitted = 0;
+    for (int i = 0; i < 10; ++i) {
+      admitted += limit.admit(suppressed) ? 1 : 0;
+    }
+    assert(admitted == 3);
+    assert(suppressed == 0);
+
+    rate_limit short_limit(1, std::chrono::milliseconds(1));
+    assert(short_limit.admit(suppressed));
+    assert(!short_limit.admit(suppressed));
+    assert(!short_limit.admit(suppressed));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    assert(short_limit.admit(suppressed));
+    assert(suppressed == 2);
+  }
+  get_logger()->info("test_rate_limit passed");
+
+  // Test ring order and that a full ring refuses instead of blocking
+  {
+    log_ring ring(4);
+    for (std::size_t i = 0; i < 4; ++i) {
+      assert(ring.try_push([&](log_record &r) { r.text_len = i; }));
+    }
+    assert(!ring.try_push([](log_record &) {}));
+    for (std::size_t i = 0; i < 4; ++i) {
+      assert(ring.try_pop([&](log_record const &r) { assert(r.text_len == i); }));
+    }
+    assert(!ring.try_pop([](log_record const &) {}));
+  }
+  get_logger()->info("test_log_ring passed");
+
+  // Test the async sink with numeric arguments, strings and rate limited storms
+  {
+    coverbs_rpc::set_log_sink(coverbs_rpc::log_sink::async);
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([t] {
+        static rate_limit storm(5);
+        for (int i = 0; i < 1000; ++i) {
+          get_logger()->error(storm, "storm from thread {}: {}", t, i);
+        }
+        get_logger()->info("thread {} says {}", t, std::string("done"));
+      });
+    }
+    threads.clear();
+    coverbs_rpc::set_log_sink(coverbs_rpc::log_sink::sync);
+  }
+  get_logger()->info("test_async_sink passed");
+
+  // Test that the macros skip evaluating the arguments of a disabled call
+  {
+    int evaluated = 0;
+    auto arg = [&] { return ++evaluated; };
+    // Zero when info is compiled out as well.
+    int const info_on = coverbs_rpc::detail::kMinLogLevel <= coverbs_rpc::log_level::info;
+    coverbs_rpc::set_log_level(coverbs_rpc::log_level::info);
+    COVERBS_RPC_LOG_DEBUG("not written: {}", arg());
+    assert(evaluated == 0);
+    COVERBS_RPC_LOG_INFO("written: {}", arg());
+    assert(evaluated == info_on);
+    coverbs_rpc::set_log_level(coverbs_rpc::log_level::off);
+    COVERBS_RPC_LOG_CRITICAL("not written: {}", arg());
+    assert(evaluated == info_on);
+    coverbs_rpc::set_log_level(coverbs_rpc::log_level::info);
+  }
+  get_logger()->info("test_lazy_args passed");
+
+  get_logger()->info("All logger tests passed!");
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/metrics.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using coverbs_rpc::rpc_metrics;
+using coverbs_rpc::detail::get_logger;
+
+constexpr int kThreads = 4;
+constexpr uint64_t kCallsPerThread = 10000;
+
+int main() {
+  get_logger()->info("Starting rpc_metrics tests...");
+
+  rpc_metrics metrics;
+
+  // Test concurrent recording into per-thread shards
+  {
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&metrics, t] {
+        for (uint64_t i = 0; i < kCallsPerThread; ++i) {
+          metrics.record(rpc_metrics::sample{
+              .fn_id = static_cast<uint32_t>(i % 2),
+              .error = i % 100 == 0,
+              .req_bytes = 10,
+              .resp_bytes = 20,
+              .wire_ns = 1000 * (t + 1),
+          });
+        }
+      });
+      // Snapshots may run while others record.
+      auto partial = metrics.snapshot();
+      assert(partial.total().calls <= kThreads * kCallsPerThread);
+    }
+  }
+
+  auto snapshot = metrics.snapshot();
+  auto total = snapshot.total();
+  assert(snapshot.by_fn.size() == 2);
+  assert(total.calls == kThreads * kCallsPerThread);
+  assert(total.errors == kThreads * kCallsPerThread / 100);
+  assert(total.req_bytes == 10 * total.calls && total.resp_bytes == 20 * total.calls);
+  assert(snapshot.by_fn[0].calls == kThreads * kCallsPerThread / 2);
+  assert(total.wire_ns.count() == total.calls && total.queue_ns.count() == 0);
+  assert(total.wire_ns.min() == 1000 && total.wire_ns.max() == 1000 * kThreads);
+  get_logger()->info("test_concurrent_record passed: p50 wire={}ns",
+                     total.wire_ns.value_at_percentile(50));
+
+  // Test merging snapshots
+  snapshot.merge(metrics.snapshot());
+  assert(snapshot.total().calls == 2 * total.calls);
+  get_logger()->info("test_merge passed");
+
+  // Test registries that come and go, their successors reuse the cache entry but not the shard
+  for (uint64_t i = 1; i <= 100; ++i) {
+    rpc_metrics short_lived;
+    for (uint64_t j = 0; j < i; ++j) {
+      short_lived.record(rpc_metrics::sample{.fn_id = 7});
+    }
+    assert(short_lived.snapshot().total().calls == i);
+  }
+  metrics.record(rpc_metrics::sample{.fn_id = 0});
+  assert(metrics.snapshot().total().calls == total.calls + 1);
+  get_logger()->info("test_short_lived passed");
+
+  get_logger()->info("All rpc_metrics tests passed!");
+
+  return 0;
+}
@@ -2,9 +2,13 @@
 #include "coverbs_rpc/utils/spin_wait.hpp"
 
 #include <cassert>
+#include <chrono>
+#include <coroutine>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace coverbs_rpc::utils;
 using coverbs_rpc::detail::get_logger;
@@ -22,6 +26,31 @@ cppcoro::task<void> test_exception() {
   co_return;
 }
 
+// Completes on another thread after `delay`, long enough for the waiter to park.
+struct delayed_value {
+  int value;
+  std::chrono::milliseconds delay;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) const {
+    std::thread([h, delay = delay] {
+      std::this_thread::sleep_for(delay);
+      h.resume();
+    }).detach();
+  }
+  int await_resume() const noexcept { return value; }
+};
+
+// Completes only when polled, like a call on a client with caller polling.
+struct polled_value {
+  int value;
+  std::coroutine_handle<> &waiter;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) const noexcept { waiter = h; }
+  int await_resume() const noexcept { return value; }
+};
+
 int main() {
   get_logger()->info("Starting spin_wait tests...");
 
@@ -56,6 +85,47 @@ int main() {
     get_logger()->info("test_exception passed: {}", e.what());
   }
 
+  // Test parking, with and without spinning first
+  assert(spin_wait(delayed_value{7, std::chrono::milliseconds(20)}, wait_policy::park()) == 7);
+  assert(spin_wait(delayed_value{8, std::chrono::milliseconds(20)},
+                   wait_policy{.max_spins = 1000, .max_spin_time = std::chrono::microseconds(5)}) ==
+         8);
+  assert(spin_wait(delayed_value{9, std::chrono::milliseconds(1)}, wait_policy::spin()) == 9);
+  get_logger()->info("test_park passed");
+
+  // Test poll_wait
+  std::coroutine_handle<> waiter;
+  int polls = 0;
+  int polled = poll_wait(polled_value{11, waiter}, [&] {
+    if (++polls < 3 || !waiter) {
+      return 0;
+    }
+    std::exchange(waiter, {}).resume();
+    return 1;
+  });
+  assert(polled == 11 && polls == 3);
+  get_logger()->info("test_poll_wait passed");
+
+  // Test spin_wait_all
+  auto [a, b, c] = spin_wait_all(test_int(1), test_void(),
+                                 delayed_value{3, std::chrono::milliseconds(10)});
+  assert(a == 1 && c == 3);
+  std::vector<delayed_value> many;
+  for (int i = 0; i < 16; ++i) {
+    many.push_back({i, std::chrono::milliseconds(i % 4)});
+  }
+  auto results = spin_wait_all(std::move(many), wait_policy::park());
+  for (int i = 0; i < 16; ++i) {
+    assert(results[i] == i);
+  }
+  try {
+    spin_wait_all(test_int(1), test_exception());
+    assert(false && "Should have thrown an exception");
+  } catch (const std::runtime_error &e) {
+    assert(std::string(e.what()) == "test exception");
+  }
+  get_logger()->info("test_spin_wait_all passed");
+
   get_logger()->info("All spin_wait tests passed!");
 
   return 0;
@@ -0,0 +1,284 @@
+#include "coverbs_rpc/client_pool.hpp"
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/replica_set.hpp"
+#include "coverbs_rpc/typed_client.hpp"
+#include "coverbs_rpc/typed_server.hpp"
+#include "coverbs_rpc/utils/spin_wait.hpp"
+
+#include <cppcoro/async_generator.hpp>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/static_thread_pool.hpp>
+#include <cppcoro/sync_wait.hpp>
+#include <cppcoro/task.hpp>
+#include <cppcoro/when_all.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace coverbs_rpc {
+using detail::get_logger;
+}
+
+struct EchoReq {
+  std::string msg;
+};
+
+struct EchoResp {
+  std::string msg;
+};
+
+auto echo(const EchoReq &req) -> EchoResp { return EchoResp{.msg = "Echo: " + req.msg}; }
+
+struct ChunksReq {
+  uint32_t count;
+};
+
+auto chunks(const ChunksReq &req) -> cppcoro::async_generator<uint32_t> {
+  for (uint32_t i = 0; i < req.count; ++i) {
+    co_yield i;
+  }
+}
+
+// Streams are the bulk calls, see run_priority_client.
+template <>
+inline constexpr coverbs_rpc::rpc_priority coverbs_rpc::handler_priority<&chunks> =
+    coverbs_rpc::rpc_priority::bulk;
+
+constexpr uint32_t kNumCalls = 10000;
+
+cppcoro::task<void> run_server(cppcoro::io_service &io_service, uint16_t port,
+                               coverbs_rpc::TypedRpcConfig config) {
+  coverbs_rpc::typed_server server(io_service, port, config);
+  server.register_handler<echo>();
+  server.register_handler<chunks>();
+  co_await server.run();
+}
+
+cppcoro::task<void> run_client(cppcoro::io_service &io_service, std::string hostname, uint16_t port,
+                               coverbs_rpc::TypedRpcConfig config) {
+  coverbs_rpc::typed_client client(io_service, hostname, port, config);
+
+  // Enough calls to wrap both rings many times over.
+  for (uint32_t i = 0; i < kNumCalls; ++i) {
+    auto msg = std::string(i % 900, 'x') + std::to_string(i);
+    auto resp = co_await client.call<echo>(EchoReq{.msg = msg});
+    if (resp.msg != "Echo: " + msg) {
+      coverbs_rpc::get_logger()->error("Test Failed: echo {}", i);
+      std::terminate();
+    }
+  }
+
+  // Calls resume on the pool, never on the transport's receive thread or the calling thread.
+  cppcoro::static_thread_pool pool(1);
+  co_await pool.schedule();
+  auto const pool_thread = std::this_thread::get_id();
+  co_await io_service.schedule();
+  for (uint32_t i = 0; i < 100; ++i) {
+    co_await client.call<echo>(EchoReq{.msg = "pool"}, {.resume_on = pool});
+    if (std::this_thread::get_id() != pool_thread) {
+      coverbs_rpc::get_logger()->error("Test Failed: call {} did not resume on the pool", i);
+      std::terminate();
+    }
+    co_await io_service.schedule();
+  }
+
+  uint32_t expected = 0;
+  auto stream = client.call_stream<chunks>(ChunksReq{.count = 100});
+  for (auto it = co_await stream.begin(); it != stream.end(); co_await ++it) {
+    if (*it != expected++) {
+      coverbs_rpc::get_logger()->error("Test Failed: chunk {} out of order", expected - 1);
+      std::terminate();
+    }
+  }
+  if (expected != 100) {
+    coverbs_rpc::get_logger()->error("Test Failed: got {} of 100 chunks", expected);
+    std::terminate();
+  }
+}
+
+// Two threads that make calls and handle responses themselves, each possibly completing the
+// other's. Transports without caller polling refuse the option.
+auto run_polling_client(cppcoro::io_service &io_service, std::string hostname, uint16_t port,
+                        coverbs_rpc::TypedRpcConfig config) -> void {
+  config.caller_polling = true;
+  if (config.transport != coverbs_rpc::transport_kind::shm) {
+    try {
+      coverbs_rpc::typed_client client(io_service, hostname, port, config);
+    } catch (const std::invalid_argument &) {
+      return;
+    }
+    coverbs_rpc::get_logger()->error("Test Failed: caller polling accepted without support");
+    std::terminate();
+  }
+  coverbs_rpc::typed_client client(io_service, hostname, port, config);
+  if (!client.caller_polling()) {
+    coverbs_rpc::get_logger()->error("Test Failed: caller polling not set up");
+    std::terminate();
+  }
+
+  auto caller = [&client](uint32_t first) {
+    for (uint32_t i = first; i < kNumCalls; i += 2) {
+      auto msg = std::to_string(i);
+      auto resp = coverbs_rpc::utils::poll_wait(client.call<echo>(EchoReq{.msg = msg}),
+                                                [&client] { return client.poll(); });
+      if (resp.msg != "Echo: " + msg) {
+        coverbs_rpc::get_logger()->error("Test Failed: polled echo {}", i);
+        std::terminate();
+      }
+    }
+  };
+  std::jthread even(caller, 0);
+  std::jthread odd(caller, 1);
+}
+
+// Concurrent gets share one connection, which is closed once idle and unused.
+cppcoro::task<void> run_pool_client(cppcoro::io_service &io_service, std::string hostname,
+                                    uint16_t port, coverbs_rpc::TypedRpcConfig config) {
+  coverbs_rpc::client_pool pool(io_service, config, {.idle_timeout = std::chrono::milliseconds(50)});
+  {
+    auto [a, b] = co_await cppcoro::when_all(pool.get(hostname, port), pool.get(hostname, port));
+    if (a != b || pool.size() != 1) {
+      coverbs_rpc::get_logger()->error("Test Failed: pool did not share the connection");
+      std::terminate();
+    }
+    auto resp = co_await a->call<echo>(EchoReq{.msg = "pool"});
+    if (resp.msg != "Echo: pool") {
+      coverbs_rpc::get_logger()->error("Test Failed: echo through the pool");
+      std::terminate();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (pool.reap_idle() != 0) {
+      coverbs_rpc::get_logger()->error("Test Failed: pool closed a client in use");
+      std::terminate();
+    }
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  if (pool.size() != 0) {
+    coverbs_rpc::get_logger()->error("Test Failed: idle client was not closed");
+    std::terminate();
+  }
+}
+
+// Both policies spread calls over every replica, here all connected to the same server.
+cppcoro::task<void> run_replica_client(cppcoro::io_service &io_service, std::string hostname,
+                                       uint16_t port, coverbs_rpc::TypedRpcConfig config) {
+  for (auto policy : {coverbs_rpc::balance_policy::least_inflight,
+                      coverbs_rpc::balance_policy::lowest_latency}) {
+    std::vector<std::shared_ptr<coverbs_rpc::typed_client>> replicas;
+    for (int i = 0; i < 3; ++i) {
+      replicas.push_back(std::make_shared<coverbs_rpc::typed_client>(io_service, hostname, port,
+                                                                     config));
+    }
+    coverbs_rpc::replica_set set(replicas, {.policy = policy});
+    for (uint32_t i = 0; i < 300; ++i) {
+      if ((co_await set.call<echo>(EchoReq{.msg = "replica"})).msg != "Echo: replica") {
+        coverbs_rpc::get_logger()->error("Test Failed: echo through the replica set");
+        std::terminate();
+      }
+    }
+    for (std::size_t i = 0; i < set.size(); ++i) {
+      if (set.client(i).metrics().total().calls == 0 || set.latency(i).count() == 0) {
+        coverbs_rpc::get_logger()->error("Test Failed: replica {} got no calls", i);
+        std::terminate();
+      }
+    }
+  }
+
+  // Hedges half of the calls once the delay is known, every one of which must still answer once.
+  std::vector<std::shared_ptr<coverbs_rpc::typed_client>> replicas;
+  for (int i = 0; i < 2; ++i) {
+    replicas.push_back(
+        std::make_shared<coverbs_rpc::typed_client>(io_service, hostname, port, config));
+  }
+  coverbs_rpc::replica_set set(replicas, {.hedge = {.percentile = 50, .budget = 1}});
+  for (uint32_t i = 0; i < 1000; ++i) {
+    auto const msg = "hedged " + std::to_string(i);
+    if ((co_await set.call_hedged<echo>(EchoReq{.msg = msg})).msg != "Echo: " + msg) {
+      coverbs_rpc::get_logger()->error("Test Failed: hedged echo {}", i);
+      std::terminate();
+    }
+  }
+}
+
+auto consume_chunks(coverbs_rpc::typed_client &client, uint32_t count) -> cppcoro::task<uint32_t> {
+  uint32_t expected = 0;
+  auto stream = client.call_stream<chunks>(ChunksReq{.count = count});
+  for (auto it = co_await stream.begin(); it != stream.end(); co_await ++it) {
+    if (*it != expected++) {
+      coverbs_rpc::get_logger()->error("Test Failed: bulk chunk {} out of order", expected - 1);
+      std::terminate();
+    }
+  }
+  co_return expected;
+}
+
+auto echo_many(coverbs_rpc::typed_client &client, uint32_t count) -> cppcoro::task<uint32_t> {
+  uint32_t answered = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if ((co_await client.call<echo>(EchoReq{.msg = "urgent"})).msg == "Echo: urgent") {
+      ++answered;
+    }
+  }
+  co_return answered;
+}
+
+// Normal calls run next to bulk streams, which the server admits one at a time, over the same
+// connection and over a separate one.
+cppcoro::task<void> run_priority_client(cppcoro::io_service &io_service, std::string hostname,
+                                        uint16_t port, coverbs_rpc::TypedRpcConfig config) {
+  config.bulk_slots = 2;
+  for (bool separate : {false, true}) {
+    config.bulk_connection = separate;
+    coverbs_rpc::typed_client client(io_service, hostname, port, config);
+    auto [a, b, urgent] = co_await cppcoro::when_all(
+        consume_chunks(client, 200), consume_chunks(client, 200), echo_many(client, 200));
+    if (a != 200 || b != 200 || urgent != 200) {
+      coverbs_rpc::get_logger()->error("Test Failed: priority classes got {}, {} and {} of 200",
+                                       a, b, urgent);
+      std::terminate();
+    }
+  }
+}
+
+// Runs without RDMA hardware. With shm both ends must be on one host.
+auto main(int argc, char *argv[]) -> int {
+  coverbs_rpc::TypedRpcConfig config;
+  config.max_req_payload = 1024;
+  config.max_resp_payload = 1024;
+  // Smaller than max_inflight full messages, so shm senders also have to wait for ring space.
+  config.shm_ring_bytes = 16 * 1024;
+  config.bulk_concurrency = 1;
+
+  std::string_view const kind = argc > 1 ? argv[1] : "";
+  if (kind == "shm") {
+    config.transport = coverbs_rpc::transport_kind::shm;
+  } else if (kind == "tcp") {
+    config.transport = coverbs_rpc::transport_kind::tcp;
+  } else {
+    argc = 0;
+  }
+
+  cppcoro::io_service io_service;
+  auto looper = std::jthread([&io_service]() { io_service.process_events(); });
+
+  if (argc == 3) {
+    cppcoro::sync_wait(run_server(io_service, std::stoi(argv[2]), config));
+  } else if (argc == 4) {
+    cppcoro::sync_wait(run_client(io_service, argv[2], std::stoi(argv[3]), config));
+    run_polling_client(io_service, argv[2], std::stoi(argv[3]), config);
+    cppcoro::sync_wait(run_pool_client(io_service, argv[2], std::stoi(argv[3]), config));
+    cppcoro::sync_wait(run_replica_client(io_service, argv[2], std::stoi(argv[3]), config));
+    cppcoro::sync_wait(run_priority_client(io_service, argv[2], std::stoi(argv[3]), config));
+    coverbs_rpc::get_logger()->info("Test Passed!");
+  } else {
+    coverbs_rpc::get_logger()->info("Usage: {} shm|tcp [port] for server and {} shm|tcp "
+                                    "[server_ip] [port] for client",
+                                    argv[0], argv[0]);
+  }
+
+  io_service.stop();
+  return 0;
+}
@@ -1,11 +1,24 @@
 #include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/transport/rdma_transport.hpp"
 #include "coverbs_rpc/typed_client.hpp"
 #include "coverbs_rpc/typed_server.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cppcoro/io_service.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
+#include <cppcoro/when_all.hpp>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 
 namespace coverbs_rpc {
 using detail::get_logger;
@@ -21,10 +34,112 @@ struct EchoResp {
 
 auto echo(const EchoReq &req) -> EchoResp { return EchoResp{.msg = "Echo: " + req.msg}; }
 
+struct PutReq {
+  std::string_view key;
+  std::span<const std::byte> value;
+};
+
+struct PutResp {
+  std::string_view key;
+  uint64_t value_size;
+};
+
+// Both the request and the response only point into the receive buffer.
+auto put_view(const PutReq &req) -> PutResp {
+  return PutResp{.key = req.key, .value_size = req.value.size()};
+}
+
+// Fixed-size keys packed back to back, viewed in place as bytes.
+using Key = std::array<std::byte, 8>;
+
+struct KeysReq {
+  std::span<const std::byte> keys;
+};
+
+struct KeysResp {
+  uint64_t count;
+  uint64_t last_first_byte;
+};
+
+auto count_keys(const KeysReq &req) -> KeysResp {
+  std::size_t const count = req.keys.size() / sizeof(Key);
+  return KeysResp{.count = count,
+                  .last_first_byte =
+                      count == 0 ? 0
+                                 : std::to_integer<uint64_t>(req.keys[(count - 1) * sizeof(Key)])};
+}
+
+struct SplitResp {
+  std::vector<std::string> words;
+};
+
+// Fills a response reused across calls, with scratch space from the per-request arena.
+auto split(const EchoReq &req, SplitResp &resp, coverbs_rpc::utils::bump_arena &arena) -> void {
+  std::pmr::vector<std::string_view> words(&arena);
+  std::size_t begin = 0;
+  while (begin <= req.msg.size()) {
+    std::size_t end = std::min(req.msg.find(' ', begin), req.msg.size());
+    words.push_back(std::string_view{req.msg}.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  resp.words.resize(words.size());
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    resp.words[i].assign(words[i]);
+  }
+}
+
+struct TagReq {
+  std::string msg;
+  std::optional<std::string> tag;
+};
+
+// A reused response, but the request must not remember the tag of an earlier call.
+auto tag(const TagReq &req, EchoResp &resp,
+         coverbs_rpc::utils::bump_arena &arena [[maybe_unused]]) -> void {
+  resp.msg = req.msg + ":" + req.tag.value_or("untagged");
+}
+
+struct CountReq {
+  uint64_t delta;
+};
+
+struct CountResp {
+  uint64_t total;
+};
+
+constexpr uint64_t kNumNotifies = 1000;
+std::atomic<uint64_t> notified_total{0};
+
+auto add(const CountReq &req) -> void { notified_total.fetch_add(req.delta); }
+
+auto total(const CountReq &req [[maybe_unused]]) -> CountResp {
+  return CountResp{.total = notified_total.load()};
+}
+
+auto slow_echo(const EchoReq &req) -> EchoResp {
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  return EchoResp{.msg = req.msg};
+}
+
+coverbs_rpc::typed_server *serving = nullptr;
+
+auto connections(const CountReq &req [[maybe_unused]]) -> CountResp {
+  return CountResp{.total = serving->connections()};
+}
+
 cppcoro::task<void> run_server(cppcoro::io_service &io_service, uint16_t port,
                                coverbs_rpc::TypedRpcConfig config) {
   coverbs_rpc::typed_server server(io_service, port, config);
+  serving = &server;
   server.register_handler<echo>();
+  server.register_handler<add>();
+  server.register_handler<total>();
+  server.register_handler<slow_echo>();
+  server.register_handler<put_view>();
+  server.register_handler<count_keys>();
+  server.register_handler<split>();
+  server.register_handler<tag>();
+  server.register_handler<connections>();
   co_await server.run();
 }
 
@@ -36,18 +151,156 @@ cppcoro::task<void> run_client(cppcoro::io_service &io_service, std::string host
   auto resp = co_await client.call<echo>(req);
   coverbs_rpc::get_logger()->info("Received: {}", resp.msg);
 
-  if (resp.msg == "Echo: Hello Typed RPC!") {
-    coverbs_rpc::get_logger()->info("Test Passed!");
-  } else {
+  if (resp.msg != "Echo: Hello Typed RPC!") {
     coverbs_rpc::get_logger()->error("Test Failed!");
     std::terminate();
   }
+
+  std::vector<std::byte> value(100, std::byte{0x2a});
+  auto lease = co_await client.call_lease<put_view>(PutReq{.key = "k1", .value = value});
+  if (lease->key != "k1" || lease->value_size != value.size()) {
+    coverbs_rpc::get_logger()->error("Test Failed: view round trip");
+    std::terminate();
+  }
+
+  std::vector<Key> keys(5);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    keys[i].fill(std::byte(i + 1));
+  }
+  auto counted =
+      co_await client.call<count_keys>(KeysReq{.keys = std::as_bytes(std::span{keys})});
+  if (counted.count != keys.size() || counted.last_first_byte != keys.size()) {
+    coverbs_rpc::get_logger()->error("Test Failed: {} keys viewed, last starting with {}",
+                                     counted.count, counted.last_first_byte);
+    std::terminate();
+  }
+
+  for (auto const &[msg, count] : {std::pair{"a bb ccc", 3UZ}, std::pair{"one", 1UZ}}) {
+    auto words = (co_await client.call<split>(EchoReq{.msg = msg})).words;
+    if (words.size() != count || words.back().empty()) {
+      coverbs_rpc::get_logger()->error("Test Failed: split \"{}\" gave {} words", msg,
+                                       words.size());
+      std::terminate();
+    }
+  }
+
+  // Tagged and untagged calls in turn, so that every server thread gets an untagged request
+  // after a tagged one.
+  for (int round = 0; round < 64; ++round) {
+    for (auto const &[sent, expected] : {std::pair{TagReq{.msg = "a", .tag = "t"}, "a:t"},
+                                         std::pair{TagReq{.msg = "b"}, "b:untagged"}}) {
+      auto tagged = (co_await client.call<tag>(sent)).msg;
+      if (tagged != expected) {
+        coverbs_rpc::get_logger()->error("Test Failed: tagged \"{}\", expected \"{}\"", tagged,
+                                         expected);
+        std::terminate();
+      }
+    }
+  }
+
+  for (uint64_t i = 0; i < kNumNotifies; ++i) {
+    co_await client.notify<add>(CountReq{.delta = 1});
+  }
+  // One-way calls run concurrently on the server, wait until all of them have landed.
+  uint64_t seen = 0;
+  for (int retry = 0; retry < 1000 && seen < kNumNotifies; ++retry) {
+    seen = (co_await client.call<total>(CountReq{.delta = 0})).total;
+  }
+  if (seen != kNumNotifies) {
+    coverbs_rpc::get_logger()->error("Test Failed: {} of {} notifies handled", seen, kNumNotifies);
+    std::terminate();
+  }
+
+  // A call that outlives its deadline fails, and its slot keeps working once the late reply
+  // has been dropped.
+  bool timed_out = false;
+  try {
+    co_await client.call<slow_echo>(EchoReq{.msg = "late"},
+                                    {.timeout = std::chrono::milliseconds(10)});
+  } catch (const coverbs_rpc::rpc_error &e) {
+    timed_out = e.status() == coverbs_rpc::rpc_status::timeout;
+  }
+  if (!timed_out) {
+    coverbs_rpc::get_logger()->error("Test Failed: slow call did not time out");
+    std::terminate();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  if ((co_await client.call<echo>(req)).msg != "Echo: Hello Typed RPC!") {
+    coverbs_rpc::get_logger()->error("Test Failed: call after timeout");
+    std::terminate();
+  }
+
+  // Once a client has closed, the server stops serving its connection instead of keeping
+  // receives posted on it.
+  uint64_t const before = (co_await client.call<connections>(CountReq{})).total;
+  {
+    coverbs_rpc::typed_client leaving(io_service, hostname, port, config);
+    if ((co_await leaving.call<echo>(req)).msg != "Echo: Hello Typed RPC!") {
+      coverbs_rpc::get_logger()->error("Test Failed: call before disconnect");
+      std::terminate();
+    }
+  }
+  uint64_t after = before + 1;
+  for (int retry = 0; retry < 100 && after > before; ++retry) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    after = (co_await client.call<connections>(CountReq{})).total;
+  }
+  if (after != before) {
+    coverbs_rpc::get_logger()->error("Test Failed: {} connections served after disconnect, {} "
+                                     "before",
+                                     after, before);
+    std::terminate();
+  }
+
+  // More pooled connections than one CQ could take the completions of, all busy at once and
+  // then closed together, which flushes every receive they had posted.
+  {
+    std::vector<std::unique_ptr<coverbs_rpc::typed_client>> pooled;
+    for (std::size_t i = 0; i < config.qp_pool_size; ++i) {
+      pooled.push_back(std::make_unique<coverbs_rpc::typed_client>(io_service, hostname, port,
+                                                                   config));
+    }
+    std::vector<cppcoro::task<EchoResp>> calls;
+    for (auto &pooled_client : pooled) {
+      for (std::size_t j = 0; j < config.max_inflight; ++j) {
+        calls.push_back(pooled_client->call<echo>(req));
+      }
+    }
+    for (auto const &echoed : co_await cppcoro::when_all(std::move(calls))) {
+      if (echoed.msg != "Echo: Hello Typed RPC!") {
+        coverbs_rpc::get_logger()->error("Test Failed: call on a pooled connection");
+        std::terminate();
+      }
+    }
+  }
+  if ((co_await client.call<echo>(req)).msg != "Echo: Hello Typed RPC!") {
+    coverbs_rpc::get_logger()->error("Test Failed: call after closing pooled connections");
+    std::terminate();
+  }
+
+  // Clients sharing one device, CQ pair and registered memory. After the first, they take
+  // pre-created qps.
+  coverbs_rpc::rdma_context context(
+      io_service, {.device_nr = config.device_nr, .port_nr = config.port_nr, .qp_pool_size = 2});
+  std::vector<std::unique_ptr<coverbs_rpc::typed_client>> shared;
+  for (int i = 0; i < 4; ++i) {
+    shared.push_back(std::make_unique<coverbs_rpc::typed_client>(context, hostname, port, config));
+  }
+  for (auto &shared_client : shared) {
+    if ((co_await shared_client->call<echo>(req)).msg != "Echo: Hello Typed RPC!") {
+      coverbs_rpc::get_logger()->error("Test Failed: call through shared context");
+      std::terminate();
+    }
+  }
+  coverbs_rpc::get_logger()->info("Test Passed!");
 }
 
 auto main(int argc, char *argv[]) -> int {
   coverbs_rpc::TypedRpcConfig config;
   config.max_req_payload = 1024;
   config.max_resp_payload = 1024;
+  // The server takes qps for its connections from a pool.
+  config.qp_pool_size = 4;
 
   cppcoro::io_service io_service;
   auto looper = std::jthread([&io_service]() { io_service.process_events(); });
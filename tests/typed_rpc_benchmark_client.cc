@@ -1,11 +1,20 @@
 #include "coverbs_rpc/detail/logger.hpp"
 #include "coverbs_rpc/typed_client.hpp"
-#include "coverbs_rpc/utils/spin_wait.hpp"
+#include "coverbs_rpc/utils/latency_histogram.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cppcoro/async_scope.hpp>
 #include <cppcoro/io_service.hpp>
+#include <cppcoro/on_scope_exit.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
+#include <cppcoro/when_all_ready.hpp>
+#include <format>
+#include <fstream>
+#include <glaze/glaze.hpp>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -15,79 +24,325 @@ using namespace coverbs_rpc;
 
 using coverbs_rpc::detail::get_logger;
 
-template <std::size_t I>
-void run_bench(typed_client &client, int threads_count, const std::string &label) {
-  auto work = [&](int calls, int idx = 0) {
-    benchmark::BenchmarkRequest req;
-    req.data = std::string(256, 'c');
-    auto start = std::chrono::high_resolution_clock::now();
-    auto last_report_time = start;
-    for (int i = 0; i < calls; ++i) {
-      auto resp = utils::spin_wait(client.call<benchmark::BenchmarkHandler<I>::handle>(req));
-      if ((i + 1) % benchmark::kReportInterval == 0) {
-        auto now = std::chrono::high_resolution_clock::now();
-        auto interval_us =
-            std::chrono::duration_cast<std::chrono::microseconds>(now - last_report_time).count();
-        get_logger()->info("Case {}-{} ({} threads): Progress {}/{}, Interval Latency = {:.2f} us",
-                           label, idx, threads_count, i + 1, calls,
-                           (double)interval_us / benchmark::kReportInterval);
-        last_report_time = now;
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_options {
+  std::string server_ip = "192.168.98.70";
+  uint16_t server_port = 9988;
+  std::string kind = "payload"; // payload, kv-beve or kv-raw
+  transport_kind transport = transport_kind::rdma;
+  bool caller_polling = false; // benchmark threads handle responses themselves
+  uint32_t req_size = 256;
+  uint32_t resp_size = 256;
+  uint32_t threads = 1;
+  uint32_t outstanding = 1; // calls in flight per thread
+  double rate = 0;          // total calls per second, 0 for closed loop
+  double duration_s = 10;
+  double warmup_s = 1;
+  std::string json_path;
+};
+
+struct latency_report {
+  double p50_us;
+  double p99_us;
+  double p999_us;
+  double max_us;
+  double mean_us;
+};
+
+struct bench_report {
+  std::string kind;
+  std::string mode;
+  uint32_t req_size;
+  uint32_t resp_size;
+  uint32_t threads;
+  uint32_t outstanding;
+  double target_rate;
+  double duration_s;
+  uint64_t calls;
+  uint64_t errors;
+  double throughput_ops;
+  double throughput_mib_s;
+  latency_report latency;
+};
+
+// Everything a lane records, only ever touched by that lane.
+struct lane_stats {
+  utils::latency_histogram latency_ns;
+  uint64_t calls = 0;
+  uint64_t errors = 0;
+};
+
+auto usage(const char *prog) -> void {
+  get_logger()->info(
+      "Usage: {} [server_ip] [port] [--kind payload|kv-beve|kv-raw] [--req-size B] "
+      "[--resp-size B] [--threads N] [--outstanding N] [--rate calls/s] [--duration s] "
+      "[--warmup s] [--transport rdma|shm|tcp] [--caller-polling] [--json path]",
+      prog);
+}
+
+auto parse_options(int argc, char **argv, bench_options &opts) -> bool {
+  int positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (!arg.starts_with("--")) {
+      if (positional == 0) {
+        opts.server_ip = arg;
+      } else if (positional == 1) {
+        opts.server_port = static_cast<uint16_t>(std::stoi(argv[i]));
+      } else {
+        return false;
+      }
+      ++positional;
+      continue;
+    }
+    if (arg == "--caller-polling") {
+      opts.caller_polling = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    std::string value = argv[++i];
+    if (arg == "--kind") {
+      opts.kind = value;
+    } else if (arg == "--req-size") {
+      opts.req_size = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--resp-size") {
+      opts.resp_size = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--threads") {
+      opts.threads = std::max<uint32_t>(static_cast<uint32_t>(std::stoul(value)), 1);
+    } else if (arg == "--outstanding") {
+      opts.outstanding = std::max<uint32_t>(static_cast<uint32_t>(std::stoul(value)), 1);
+    } else if (arg == "--rate") {
+      opts.rate = std::stod(value);
+    } else if (arg == "--duration") {
+      opts.duration_s = std::stod(value);
+    } else if (arg == "--warmup") {
+      opts.warmup_s = std::stod(value);
+    } else if (arg == "--transport") {
+      auto transport = benchmark::parse_transport(value);
+      if (!transport) {
+        return false;
       }
+      opts.transport = *transport;
+    } else if (arg == "--json") {
+      opts.json_path = value;
+    } else {
+      return false;
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  }
+  return opts.kind == "payload" || opts.kind == "kv-beve" || opts.kind == "kv-raw";
+}
+
+auto elapsed(bench_clock::time_point since) -> std::chrono::nanoseconds {
+  return bench_clock::now() - since;
+}
 
-    double avg_latency = (double)elapsed_us / calls;
-    get_logger()->info("Case {}-{} ({} threads): Total Average Latency = {:.2f} us", label, idx,
-                       threads_count, avg_latency);
+/**
+ * One sequence of calls. In closed loop it sends as soon as the previous call returns. In open
+ * loop it takes send times from a schedule shared by the thread's lanes and measures latency
+ * from the scheduled time rather than the actual one, so a stalled server shows up as latency
+ * instead of silently lowering the offered load.
+ */
+template <auto Handler>
+auto run_lane(typed_client &client, cppcoro::io_service &io, const detail::rpc_req_t<Handler> &req,
+              const bench_options &opts, bench_clock::time_point start,
+              bench_clock::time_point measure_from, bench_clock::time_point end,
+              uint64_t &next_ticket, lane_stats &stats) -> cppcoro::task<void> {
+  using namespace std::chrono;
+  double const thread_rate = opts.rate / opts.threads;
+  auto const interval =
+      thread_rate > 0 ? duration_cast<nanoseconds>(duration<double>(1.0 / thread_rate))
+                      : nanoseconds{0};
+
+  co_await io.schedule();
+  while (true) {
+    auto intended = bench_clock::now();
+    if (thread_rate > 0) {
+      // Lanes of a thread all run on its io_service, so the ticket needs no synchronization.
+      intended = start + interval * next_ticket++;
+      while (bench_clock::now() < intended) {
+        co_await io.schedule();
+      }
+    }
+    if (intended >= end) {
+      break;
+    }
+
+    bool failed = false;
+    try {
+      co_await client.call<Handler>(req);
+    } catch (const std::exception &) {
+      failed = true;
+    }
+
+    if (intended >= measure_from) {
+      stats.latency_ns.record(static_cast<uint64_t>(elapsed(intended).count()));
+      ++stats.calls;
+      stats.errors += failed ? 1 : 0;
+    }
+    // Completions arrive on the client's receive thread, send the next call from ours.
+    co_await io.schedule();
+  }
+}
+
+template <auto Handler>
+auto run_thread(typed_client &client, const detail::rpc_req_t<Handler> &req,
+                const bench_options &opts, bench_clock::time_point start,
+                bench_clock::time_point measure_from, bench_clock::time_point end,
+                std::vector<lane_stats> &lanes) -> void {
+  cppcoro::io_service io;
+  uint64_t next_ticket = 0;
+
+  auto run_lanes = [&]() -> cppcoro::task<void> {
+    auto stop_on_exit = cppcoro::on_scope_exit([&] { io.stop(); });
+    cppcoro::async_scope scope;
+    for (auto &lane : lanes) {
+      scope.spawn(run_lane<Handler>(client, io, req, opts, start, measure_from, end, next_ticket,
+                                    lane));
+    }
+    co_await scope.join();
+  };
+  auto process_events = [&]() -> cppcoro::task<void> {
+    if (client.caller_polling()) {
+      // Responses are handled on this thread too, between the lanes' events.
+      while (!io.is_stop_requested()) {
+        io.process_pending_events();
+        client.poll();
+      }
+    } else {
+      io.process_events();
+    }
+    co_return;
   };
 
-  // Warmup
-  work(100);
+  cppcoro::sync_wait(cppcoro::when_all_ready(run_lanes(), process_events()));
+}
+
+template <auto Handler>
+auto run_bench(typed_client &client, const detail::rpc_req_t<Handler> &req,
+               const bench_options &opts) -> bench_report {
+  using namespace std::chrono;
+  auto const start = bench_clock::now();
+  auto const measure_from = start + duration_cast<nanoseconds>(duration<double>(opts.warmup_s));
+  auto const end = measure_from + duration_cast<nanoseconds>(duration<double>(opts.duration_s));
 
-  if (threads_count == 1) {
-    work(benchmark::kNumCalls);
-  } else {
+  std::vector<std::vector<lane_stats>> lanes(opts.threads);
+  {
     std::vector<std::jthread> threads;
-    for (int t = 0; t < threads_count; ++t) {
-      threads.emplace_back(work, benchmark::kNumCalls / threads_count, t);
+    for (auto &thread_lanes : lanes) {
+      thread_lanes.resize(opts.outstanding);
+      threads.emplace_back([&, &my_lanes = thread_lanes] {
+        run_thread<Handler>(client, req, opts, start, measure_from, end, my_lanes);
+      });
+    }
+  }
+
+  lane_stats total;
+  for (auto const &thread_lanes : lanes) {
+    for (auto const &lane : thread_lanes) {
+      total.latency_ns.merge(lane.latency_ns);
+      total.calls += lane.calls;
+      total.errors += lane.errors;
     }
   }
+
+  auto const to_us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+  double const ops = static_cast<double>(total.calls - total.errors) / opts.duration_s;
+  double const bytes_per_call = opts.kind == "payload" ? opts.req_size + opts.resp_size : 0;
+  return bench_report{
+      .kind = opts.kind,
+      .mode = opts.rate > 0 ? "open" : "closed",
+      .req_size = opts.req_size,
+      .resp_size = opts.resp_size,
+      .threads = opts.threads,
+      .outstanding = opts.outstanding,
+      .target_rate = opts.rate,
+      .duration_s = opts.duration_s,
+      .calls = total.calls,
+      .errors = total.errors,
+      .throughput_ops = ops,
+      .throughput_mib_s = ops * bytes_per_call / (1024.0 * 1024.0),
+      .latency =
+          latency_report{
+              .p50_us = to_us(total.latency_ns.value_at_percentile(50)),
+              .p99_us = to_us(total.latency_ns.value_at_percentile(99)),
+              .p999_us = to_us(total.latency_ns.value_at_percentile(99.9)),
+              .max_us = to_us(total.latency_ns.max()),
+              .mean_us = total.latency_ns.mean() / 1000.0,
+          },
+  };
 }
 
+} // namespace
+
 int main(int argc, char **argv) {
-  std::string server_ip = "192.168.98.70";
-  uint16_t server_port = 9988;
-  if (argc >= 2)
-    server_ip = argv[1];
-  if (argc >= 3)
-    server_port = static_cast<uint16_t>(std::stoi(argv[2]));
+  bench_options opts;
+  if (!parse_options(argc, argv, opts)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (opts.req_size > benchmark::kMaxPayload || opts.resp_size > benchmark::kMaxPayload) {
+    get_logger()->error("Payload sizes are limited to {} bytes", benchmark::kMaxPayload);
+    return 1;
+  }
 
   cppcoro::io_service io_service;
   auto looper = std::jthread([&io_service]() { io_service.process_events(); });
 
+  // Room for the BEVE framing on top of the raw payload.
+  constexpr uint32_t kEncodingSlack = 64;
   TypedRpcConfig config;
-  config.max_inflight = 512;
-  config.max_req_payload = 8192;
-  config.max_resp_payload = 8192;
+  config.transport = opts.transport;
+  config.caller_polling = opts.caller_polling;
+  config.max_inflight = std::max<uint32_t>(opts.threads * opts.outstanding, 16);
+  config.max_req_payload = opts.req_size + kEncodingSlack;
+  config.max_resp_payload = opts.resp_size + kEncodingSlack;
 
+  int rc = 0;
   try {
-    typed_client client(io_service, server_ip, server_port, config);
+    typed_client client(io_service, opts.server_ip, opts.server_port, config);
+
+    get_logger()->info("Starting {} benchmark: {} threads x {} outstanding, {}", opts.kind,
+                       opts.threads, opts.outstanding,
+                       opts.rate > 0 ? std::format("open loop at {} calls/s", opts.rate)
+                                     : std::string("closed loop"));
 
-    get_logger()->info("Starting benchmarks...");
+    bench_report report;
+    if (opts.kind == "payload") {
+      benchmark::PayloadRequest req{.data = std::string(opts.req_size, 'c'),
+                                    .resp_size = opts.resp_size};
+      report = run_bench<benchmark::payload_handle>(client, req, opts);
+    } else if (opts.kind == "kv-beve") {
+      report = run_bench<benchmark::KvHandler<false>::handle>(
+          client, benchmark::KvRequest<false>{.key = 42, .len = 8}, opts);
+    } else {
+      report = run_bench<benchmark::KvHandler<true>::handle>(
+          client, benchmark::KvRequest<true>{.key = 42, .len = 8}, opts);
+    }
 
-    // Case 1: 256B req, 256B resp
-    run_bench<0>(client, 1, "1 (256B/256B)");
-    run_bench<0>(client, benchmark::kThreads, "1 (256B/256B)");
+    get_logger()->info("Calls: {} ({} errors), Throughput: {:.0f} ops/s, {:.2f} MiB/s",
+                       report.calls, report.errors, report.throughput_ops,
+                       report.throughput_mib_s);
+    get_logger()->info("Latency (us): p50={:.2f} p99={:.2f} p99.9={:.2f} max={:.2f} mean={:.2f}",
+                       report.latency.p50_us, report.latency.p99_us, report.latency.p999_us,
+                       report.latency.max_us, report.latency.mean_us);
 
-    // Case 2: 256B req, 4KB resp
-    run_bench<1>(client, 1, "2 (256B/4KB)");
-    run_bench<1>(client, benchmark::kThreads, "2 (256B/4KB)");
-    get_logger()->info("Done.");
+    if (!opts.json_path.empty()) {
+      std::string json;
+      if (glz::write_json(report, json) || !(std::ofstream(opts.json_path) << json)) {
+        get_logger()->error("Failed to write {}", opts.json_path);
+        rc = 1;
+      }
+    }
   } catch (const std::exception &e) {
     get_logger()->error("Exception: {}", e.what());
-    return 1;
+    rc = 1;
   }
 
-  return 0;
+  io_service.stop();
+  return rc;
 }
@@ -1,6 +1,7 @@
 #include "coverbs_rpc/detail/logger.hpp"
 #include "coverbs_rpc/typed_server.hpp"
 
+#include <chrono>
 #include <cppcoro/io_service.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <thread>
@@ -11,27 +12,47 @@ using namespace coverbs_rpc;
 using coverbs_rpc::detail::get_logger;
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    get_logger()->info("Usage: {} [port]", argv[0]);
+  auto transport = argc == 4 ? benchmark::parse_transport(argv[3]) : transport_kind::rdma;
+  if (argc < 2 || argc > 4 || !transport) {
+    get_logger()->info("Usage: {} [port] [threads] [rdma|shm|tcp]", argv[0]);
     return 1;
   }
 
   uint16_t port = static_cast<uint16_t>(std::stoi(argv[1]));
+  uint32_t threads = argc >= 3 ? static_cast<uint32_t>(std::stoul(argv[2])) : 4;
 
   cppcoro::io_service io_service;
   auto looper = std::jthread([&io_service]() { io_service.process_events(); });
 
   TypedRpcConfig config;
   config.max_inflight = 1024;
-  config.max_req_payload = 8192;
-  config.max_resp_payload = 8192;
+  config.transport = *transport;
+  config.max_req_payload = benchmark::kMaxPayload;
+  config.max_resp_payload = benchmark::kMaxPayload;
 
-  typed_server server(io_service, port, config, 4);
-  server.register_handler<benchmark::BenchmarkHandler<0>::handle>();
-  server.register_handler<benchmark::BenchmarkHandler<1>::handle>();
+  typed_server server(io_service, port, config, threads);
+  server.register_handler<benchmark::payload_handle>();
+  server.register_handler<benchmark::KvHandler<false>::handle>();
+  server.register_handler<benchmark::KvHandler<true>::handle>();
 
   get_logger()->info("Typed RPC Benchmark Server listening on port {}", port);
 
+  // Reports how long handshakes took whenever new clients came in, e.g. after a client restart.
+  auto reporter = std::jthread([&server](std::stop_token stop) {
+    uint64_t reported = 0;
+    while (!stop.stop_requested()) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      auto const accepts = server.accept_latency();
+      if (accepts.count() == reported) {
+        continue;
+      }
+      reported = accepts.count();
+      get_logger()->info("Accepted {} connections, handshake p50={}us p99={}us max={}us", reported,
+                         accepts.value_at_percentile(50) / 1000,
+                         accepts.value_at_percentile(99) / 1000, accepts.max() / 1000);
+    }
+  });
+
   try {
     cppcoro::sync_wait(server.run());
   } catch (const std::exception &e) {
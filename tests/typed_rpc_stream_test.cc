@@ -0,0 +1,96 @@
+#include "coverbs_rpc/detail/logger.hpp"
+#include "coverbs_rpc/typed_client.hpp"
+#include "coverbs_rpc/typed_server.hpp"
+
+#include <cppcoro/async_generator.hpp>
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/sync_wait.hpp>
+#include <cppcoro/task.hpp>
+#include <cstdint>
+#include <thread>
+
+namespace coverbs_rpc {
+using detail::get_logger;
+}
+
+struct ScanReq {
+  uint64_t begin;
+  uint64_t end;
+};
+
+struct ScanResp {
+  uint64_t key;
+  std::string value;
+};
+
+constexpr uint64_t kScanEnd = 10000;
+constexpr uint64_t kEarlyStop = 100;
+
+auto scan(const ScanReq &req) -> cppcoro::async_generator<ScanResp> {
+  for (uint64_t k = req.begin; k < req.end; ++k) {
+    co_yield ScanResp{.key = k, .value = "value-" + std::to_string(k)};
+  }
+}
+
+cppcoro::task<void> run_server(cppcoro::io_service &io_service, uint16_t port,
+                               coverbs_rpc::TypedRpcConfig config) {
+  coverbs_rpc::typed_server server(io_service, port, config);
+  server.register_handler<scan>();
+  co_await server.run();
+}
+
+cppcoro::task<void> run_client(cppcoro::io_service &io_service, std::string hostname, uint16_t port,
+                               coverbs_rpc::TypedRpcConfig config) {
+  coverbs_rpc::typed_client client(io_service, hostname, port, config);
+
+  uint64_t expected = 0;
+  auto stream = client.call_stream<scan>(ScanReq{.begin = 0, .end = kScanEnd});
+  for (auto it = co_await stream.begin(); it != stream.end(); co_await ++it) {
+    auto const &chunk = *it;
+    if (chunk.key != expected || chunk.value != "value-" + std::to_string(expected)) {
+      coverbs_rpc::get_logger()->error("Test Failed: unexpected chunk key={}", chunk.key);
+      std::terminate();
+    }
+    ++expected;
+  }
+  if (expected != kScanEnd) {
+    coverbs_rpc::get_logger()->error("Test Failed: got {} chunks, expected {}", expected, kScanEnd);
+    std::terminate();
+  }
+  coverbs_rpc::get_logger()->info("Full scan passed: {} chunks", expected);
+
+  // Leave a stream early, the slot must come back once the server has cancelled it.
+  for (int round = 0; round < 2 * static_cast<int>(config.max_inflight); ++round) {
+    auto partial = client.call_stream<scan>(ScanReq{.begin = 0, .end = kScanEnd});
+    uint64_t seen = 0;
+    for (auto it = co_await partial.begin(); it != partial.end() && seen < kEarlyStop;
+         co_await ++it) {
+      ++seen;
+    }
+  }
+  coverbs_rpc::get_logger()->info("Early stop passed");
+  coverbs_rpc::get_logger()->info("Test Passed!");
+}
+
+auto main(int argc, char *argv[]) -> int {
+  coverbs_rpc::TypedRpcConfig config;
+  config.max_inflight = 16;
+  config.max_req_payload = 1024;
+  config.max_resp_payload = 1024;
+  config.stream_window = 8;
+
+  cppcoro::io_service io_service;
+  auto looper = std::jthread([&io_service]() { io_service.process_events(); });
+
+  if (argc == 2) {
+    cppcoro::sync_wait(run_server(io_service, std::stoi(argv[1]), config));
+  } else if (argc == 3) {
+    cppcoro::sync_wait(run_client(io_service, argv[1], std::stoi(argv[2]), config));
+  } else {
+    coverbs_rpc::get_logger()->info(
+        "Usage: {} [port] for server and {} [server_ip] [port] for client", argv[0], argv[0]);
+  }
+
+  io_service.stop();
+  return 0;
+}
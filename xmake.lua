@@ -1,6 +1,13 @@
 add_rules("mode.debug", "mode.check", "mode.release")
 
 option("tests", {default = false, description = "Build tests programs"})
+option("min_log_level", {
+    default = "trace",
+    values = {"trace", "debug", "info", "warn", "err", "critical", "off"},
+    description = "Log calls below this level are compiled out"
+})
+
+local log_levels = {trace = 0, debug = 1, info = 2, warn = 3, err = 4, critical = 5, off = 6}
 
 set_languages("c++23", { public = true })
 set_warnings("all", "extra", "pedantic", "error", {private=true})
@@ -18,6 +25,8 @@ add_requires("glaze 7.0.0", {public=true})
 target("coverbs-rpc")
     add_headerfiles("include/(coverbs_rpc/**.hpp)")
     add_includedirs("include", {public=true})
+    add_defines("COVERBS_RPC_MIN_LOG_LEVEL=" .. log_levels[get_config("min_log_level") or "trace"],
+                {public=true})
     set_kind("static")
     if has_config("pic") then
         add_cxxflags("-fpic")
@@ -27,6 +36,7 @@ target("coverbs-rpc")
     add_packages("glaze", {public=true})
     add_packages("concurrentqueue", {private=true})
     add_files("src/conn/*.cc")
+    add_files("src/transport/*.cc")
     add_files("src/*.cc")
 
 if has_config("tests") then
@@ -45,6 +55,26 @@ if has_config("tests") then
         add_files("tests/spin_wait_test.cc")
         add_rules("test_config")
 
+    target("bump_arena_test")
+        add_files("tests/bump_arena_test.cc")
+        add_rules("test_config")
+
+    target("latency_histogram_test")
+        add_files("tests/latency_histogram_test.cc")
+        add_rules("test_config")
+
+    target("codel_test")
+        add_files("tests/codel_test.cc")
+        add_rules("test_config")
+
+    target("rpc_metrics_test")
+        add_files("tests/rpc_metrics_test.cc")
+        add_rules("test_config")
+
+    target("logger_test")
+        add_files("tests/logger_test.cc")
+        add_rules("test_config")
+
     target("basic_conn_test")
         add_files("tests/basic_conn_test.cc")
         add_rules("test_config")
@@ -69,6 +99,14 @@ if has_config("tests") then
         add_files("tests/typed_rpc_basic_test.cc")
         add_rules("test_config")
 
+    target("typed_rpc_stream_test")
+        add_files("tests/typed_rpc_stream_test.cc")
+        add_rules("test_config")
+
+    target("transport_rpc_test")
+        add_files("tests/transport_rpc_test.cc")
+        add_rules("test_config")
+
     target("typed_rpc_mux_test_server")
         add_files("tests/typed_rpc_mux_test_server.cc")
         add_rules("test_config")